@@ -29,6 +29,11 @@ extern "C" {
 #define CSV_EMPTY_IS_NULL 16 /* Pass null pointer to cb1 function when
                                 empty, unquoted fields are encountered */
 
+/* writer options */
+#define CSV_QUOTE_MINIMAL 1 /* only quote fields containing the delimiter,
+                               quote, CR or LF, or starting or ending with
+                               a space or tab */
+
 
 /* Character values */
 #define CSV_TAB    0x09
@@ -37,6 +42,7 @@ extern "C" {
 #define CSV_LF     0x0a
 #define CSV_COMMA  0x2c
 #define CSV_QUOTE  0x22
+#define CSV_SEMICOLON 0x3b
 
 struct csv_parser {
   int pstate;         /* Parser state */
@@ -55,6 +61,11 @@ struct csv_parser {
   void *(*malloc_func)(size_t);
   void *(*realloc_func)(void *, size_t);
   void (*free_func)(void *);
+  size_t row_end;     /* Bytes of the current csv_parse data up to the end of the last row */
+  /* csv_parse variant for the current delimiter, quote and space and term functions */
+  size_t (*parse_func)(struct csv_parser *, const void *, size_t, void (*)(void *, size_t, void *), void (*)(int, void *), void *);
+  /* Scanner for runs of plain field bytes picked for this processor, NULL with custom space or term functions */
+  size_t (*scan_func)(const unsigned char *, size_t, unsigned char, unsigned char);
 };
 
 /* Function Prototypes */
@@ -68,6 +79,8 @@ size_t csv_write(void *dest, size_t dest_size, const void *src, size_t src_size)
 int csv_fwrite(FILE *fp, const void *src, size_t src_size);
 size_t csv_write2(void *dest, size_t dest_size, const void *src, size_t src_size, unsigned char quote);
 int csv_fwrite2(FILE *fp, const void *src, size_t src_size, unsigned char quote);
+size_t csv_write_field(void *dest, size_t dest_size, const void *src, size_t src_size, unsigned char delim, unsigned char quote, unsigned char options);
+int csv_fwrite_field(FILE *fp, const void *src, size_t src_size, unsigned char delim, unsigned char quote, unsigned char options);
 int csv_get_opts(struct csv_parser *p);
 int csv_set_opts(struct csv_parser *p, unsigned char options);
 void csv_set_delim(struct csv_parser *p, unsigned char c);
@@ -80,6 +93,8 @@ void csv_set_realloc_func(struct csv_parser *p, void *(*)(void *, size_t));
 void csv_set_free_func(struct csv_parser *p, void (*)(void *));
 void csv_set_blk_size(struct csv_parser *p, size_t);
 size_t csv_get_buffer_size(struct csv_parser *p);
+int csv_at_row_start(struct csv_parser *p);
+size_t csv_row_end(struct csv_parser *p);
 
 #ifdef __cplusplus
 }
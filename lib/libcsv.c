@@ -23,8 +23,15 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #  define SIZE_MAX ((size_t)-1) /* C89 doesn't have stdint.h or SIZE_MAX */
 #endif
 
+#include <string.h>
 #include "csv.h"
 
+/* SSE2 is part of x86-64, AVX2 is used if the processor supports it */
+#if defined(__GNUC__) && defined(__x86_64__)
+#  define CSV_SIMD
+#  include <immintrin.h>
+#endif
+
 #define VERSION "3.0.3"
 
 #define ROW_NOT_BEGUN           0
@@ -60,6 +67,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #define SUBMIT_ROW(p, c) \
   do { \
+    (p)->row_end = pos; \
     if (cb2) \
       cb2(c, data); \
     pstate = ROW_NOT_BEGUN; \
@@ -74,6 +82,8 @@ static char *csv_errors[] = {"success",
                              "data size too large",
                              "invalid status code"};
 
+static void csv_select_parse(struct csv_parser *p);
+
 int
 csv_error(struct csv_parser *p)
 {
@@ -132,9 +142,11 @@ csv_init(struct csv_parser *p, unsigned char options)
   p->is_space = NULL;
   p->is_term = NULL;
   p->blk_size = MEM_BLK_SIZE;
+  p->row_end = 0;
   p->malloc_func = NULL;
   p->realloc_func = realloc;
   p->free_func = free;
+  csv_select_parse(p);
 
   return 0;
 }
@@ -163,6 +175,7 @@ csv_fini(struct csv_parser *p, void (*cb1)(void *, size_t, void *), void (*cb2)(
   int pstate = p->pstate;
   size_t spaces = p->spaces;
   size_t entry_pos = p->entry_pos;
+  size_t pos = 0;  /* A row submitted here ends where the data parsed so far ends */
 
   if (p == NULL)
     return -1;
@@ -199,14 +212,20 @@ void
 csv_set_delim(struct csv_parser *p, unsigned char c)
 {
   /* Set the delimiter */
-  if (p) p->delim_char = c;
+  if (p) {
+    p->delim_char = c;
+    csv_select_parse(p);
+  }
 }
 
 void
 csv_set_quote(struct csv_parser *p, unsigned char c)
 {
   /* Set the quote character */
-  if (p) p->quote_char = c;
+  if (p) {
+    p->quote_char = c;
+    csv_select_parse(p);
+  }
 }
 
 unsigned char
@@ -227,14 +246,20 @@ void
 csv_set_space_func(struct csv_parser *p, int (*f)(unsigned char))
 {
   /* Set the space function */
-  if (p) p->is_space = f;
+  if (p) {
+    p->is_space = f;
+    csv_select_parse(p);
+  }
 }
  
 void
 csv_set_term_func(struct csv_parser *p, int (*f)(unsigned char))
 {
   /* Set the term function */
-  if (p) p->is_term = f;
+  if (p) {
+    p->is_term = f;
+    csv_select_parse(p);
+  }
 }
 
 void
@@ -266,19 +291,44 @@ csv_get_buffer_size(struct csv_parser *p)
     return p->entry_size;
   return 0;
 }
+
+int
+csv_at_row_start(struct csv_parser *p)
+{
+  /* Return nonzero if every row seen so far has been submitted, parsing
+     further data then does not depend on the data that came before */
+  if (p)
+    return p->pstate == ROW_NOT_BEGUN;
+  return 0;
+}
+
+size_t
+csv_row_end(struct csv_parser *p)
+{
+  /* Return the number of bytes of the data passed to csv_parse, up to and
+     including the terminator of the row submitted last.  Meant to be called
+     from the end of row callback, the next row is parsed from there. */
+  if (p)
+    return p->row_end;
+  return 0;
+}
  
 static int
 csv_increase_buffer(struct csv_parser *p)
 {
   /* Increase the size of the entry buffer.  Attempt to increase size by 
-   * p->blk_size, if this is larger than SIZE_MAX try to increase current
-   * buffer size to SIZE_MAX.  If allocation fails, try to allocate halve 
-   * the size and try again until successful or increment size is zero.
+   * p->blk_size or the current size, whichever is larger, so the buffer
+   * grows geometrically. If this is larger than SIZE_MAX try to increase
+   * current buffer size to SIZE_MAX.  If allocation fails, try to allocate
+   * halve the size and try again until successful or increment size is zero.
    */
 
   size_t to_add = p->blk_size;
   void *vp;
 
+  if (p->entry_size > to_add)
+    to_add = p->entry_size;
+
   if ( p->entry_size >= SIZE_MAX - to_add )
     to_add = SIZE_MAX - p->entry_size;
 
@@ -300,226 +350,337 @@ csv_increase_buffer(struct csv_parser *p)
   p->entry_size += to_add;
   return 0;
 }
- 
-size_t
-csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data)
-{
-  unsigned const char *us = s;  /* Access input data as array of unsigned char */
-  unsigned char c;              /* The character we are currently processing */
-  size_t pos = 0;               /* The number of characters we have processed in this call */
-
-  /* Store key fields into local variables for performance */
-  unsigned char delim = p->delim_char;
-  unsigned char quote = p->quote_char;
-  int (*is_space)(unsigned char) = p->is_space;
-  int (*is_term)(unsigned char) = p->is_term;
-  int quoted = p->quoted;
-  int pstate = p->pstate;
-  size_t spaces = p->spaces;
-  size_t entry_pos = p->entry_pos;
 
+/* Fast path for the body of a field: the scanners below return the length
+   of the run at the start of s which contains no delimiter, quote, CR, LF,
+   space or tab.  Every byte of such a run is simply appended to an unquoted
+   field, so the run can be copied at once. Only used with the default
+   is_space and is_term. */
 
-  if (!p->entry_buf && pos < len) {
-    /* Buffer hasn't been allocated yet and len > 0 */
-    if (csv_increase_buffer(p) != 0) { 
-      p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
-      return pos;
-    }
+static size_t
+csv_scan_scalar(const unsigned char *s, size_t n, unsigned char delim, unsigned char quote)
+{
+  size_t i;
+  for (i = 0; i < n; i++) {
+    unsigned char c = s[i];
+    if (c == delim || c == quote || c == CSV_CR || c == CSV_LF || c == CSV_SPACE || c == CSV_TAB)
+      break;
   }
+  return i;
+}
 
-  while (pos < len) {
-    /* Check memory usage, increase buffer if neccessary */
-    if (entry_pos == ((p->options & CSV_APPEND_NULL) ? p->entry_size - 1 : p->entry_size) ) {
-      if (csv_increase_buffer(p) != 0) {
-        p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
-        return pos;
-      }
-    }
-
-    c = us[pos++];
-
-    switch (pstate) {
-      case ROW_NOT_BEGUN:
-      case FIELD_NOT_BEGUN:
-        if ((is_space ? is_space(c) : c == CSV_SPACE || c == CSV_TAB) && c!=delim) { /* Space or Tab */
-          continue;
-        } else if (is_term ? is_term(c) : c == CSV_CR || c == CSV_LF) { /* Carriage Return or Line Feed */
-          if (pstate == FIELD_NOT_BEGUN) {
-            SUBMIT_FIELD(p);
-            SUBMIT_ROW(p, (unsigned char)c); 
-          } else {  /* ROW_NOT_BEGUN */
-            /* Don't submit empty rows by default */
-            if (p->options & CSV_REPALL_NL) {
-              SUBMIT_ROW(p, (unsigned char)c);
-            }
-          }
-          continue;
-        } else if (c == delim) { /* Comma */
-          SUBMIT_FIELD(p);
-          break;
-        } else if (c == quote) { /* Quote */
-          pstate = FIELD_BEGUN;
-          quoted = 1;
-        } else {               /* Anything else */
-          pstate = FIELD_BEGUN;
-          quoted = 0;
-          SUBMIT_CHAR(p, c);
-        }
-        break;
-      case FIELD_BEGUN:
-        if (c == quote) {         /* Quote */
-          if (quoted) {
-            SUBMIT_CHAR(p, c);
-            pstate = FIELD_MIGHT_HAVE_ENDED;
-          } else {
-            /* STRICT ERROR - double quote inside non-quoted field */
-            if (p->options & CSV_STRICT) {
-              p->status = CSV_EPARSE;
-              p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
-              return pos-1;
-            }
-            SUBMIT_CHAR(p, c);
-            spaces = 0;
-          }
-        } else if (c == delim) {  /* Comma */
-          if (quoted) {
-            SUBMIT_CHAR(p, c);
-          } else {
-            SUBMIT_FIELD(p);
-          }
-        } else if (is_term ? is_term(c) : c == CSV_CR || c == CSV_LF) {  /* Carriage Return or Line Feed */
-          if (!quoted) {
-            SUBMIT_FIELD(p);
-            SUBMIT_ROW(p, (unsigned char)c);
-          } else {
-            SUBMIT_CHAR(p, c);
-          }
-        } else if (!quoted && (is_space? is_space(c) : c == CSV_SPACE || c == CSV_TAB)) { /* Tab or space for non-quoted field */
-            SUBMIT_CHAR(p, c);
-            spaces++;
-        } else {  /* Anything else */
-          SUBMIT_CHAR(p, c);
-          spaces = 0;
-        }
-        break;
-      case FIELD_MIGHT_HAVE_ENDED:
-        /* This only happens when a quote character is encountered in a quoted field */
-        if (c == delim) {  /* Comma */
-          entry_pos -= spaces + 1;  /* get rid of spaces and original quote */
-          SUBMIT_FIELD(p);
-        } else if (is_term ? is_term(c) : c == CSV_CR || c == CSV_LF) {  /* Carriage Return or Line Feed */
-          entry_pos -= spaces + 1;  /* get rid of spaces and original quote */
-          SUBMIT_FIELD(p);
-          SUBMIT_ROW(p, (unsigned char)c);
-        } else if (is_space ? is_space(c) : c == CSV_SPACE || c == CSV_TAB) {  /* Space or Tab */
-          SUBMIT_CHAR(p, c);
-          spaces++;
-        } else if (c == quote) {  /* Quote */
-          if (spaces) {
-            /* STRICT ERROR - unescaped double quote */
-            if (p->options & CSV_STRICT) {
-              p->status = CSV_EPARSE;
-              p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
-              return pos-1;
-            }
-            spaces = 0;
-            SUBMIT_CHAR(p, c);
-          } else {
-            /* Two quotes in a row */
-            pstate = FIELD_BEGUN;
-          }
-        } else {  /* Anything else */
-          /* STRICT ERROR - unescaped double quote */
-          if (p->options & CSV_STRICT) {
-            p->status = CSV_EPARSE;
-            p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
-            return pos-1;
-          }
-          pstate = FIELD_BEGUN;
-          spaces = 0;
-          SUBMIT_CHAR(p, c);
-        }
-        break;
-     default:
-       break;
-    }
+#ifdef CSV_SIMD
+static size_t
+csv_scan_sse2(const unsigned char *s, size_t n, unsigned char delim, unsigned char quote)
+{
+  const __m128i d = _mm_set1_epi8((char)delim), q = _mm_set1_epi8((char)quote);
+  const __m128i cr = _mm_set1_epi8(CSV_CR), lf = _mm_set1_epi8(CSV_LF);
+  const __m128i sp = _mm_set1_epi8(CSV_SPACE), tab = _mm_set1_epi8(CSV_TAB);
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b, d), _mm_cmpeq_epi8(b, q)),
+                             _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b, cr), _mm_cmpeq_epi8(b, lf)),
+                                          _mm_or_si128(_mm_cmpeq_epi8(b, sp), _mm_cmpeq_epi8(b, tab))));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(m);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
   }
-  p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos;
-  return pos;
+  return i + csv_scan_scalar(s + i, n - i, delim, quote);
 }
 
-size_t
-csv_write (void *dest, size_t dest_size, const void *src, size_t src_size)
+__attribute__((target("avx2"))) static size_t
+csv_scan_avx2(const unsigned char *s, size_t n, unsigned char delim, unsigned char quote)
 {
-  unsigned char *cdest = dest;
-  const unsigned char *csrc = src;
-  size_t chars = 0;
+  const __m256i d = _mm256_set1_epi8((char)delim), q = _mm256_set1_epi8((char)quote);
+  const __m256i cr = _mm256_set1_epi8(CSV_CR), lf = _mm256_set1_epi8(CSV_LF);
+  const __m256i sp = _mm256_set1_epi8(CSV_SPACE), tab = _mm256_set1_epi8(CSV_TAB);
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(b, d), _mm256_cmpeq_epi8(b, q)),
+                                _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(b, cr), _mm256_cmpeq_epi8(b, lf)),
+                                                _mm256_or_si256(_mm256_cmpeq_epi8(b, sp), _mm256_cmpeq_epi8(b, tab))));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(m);
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+  return i + csv_scan_sse2(s + i, n - i, delim, quote);
+}
+#endif
 
-  if (src == NULL)
-    return 0;
+/* csv_parse is instantiated for the common dialects, where the delimiter
+   and quote are constants and the default space and term tests are used,
+   which lets the compiler drop the function pointer checks from the inner
+   loop.  csv_select_parse picks the variant whenever the dialect changes,
+   together with the scanner for the processor, so csv_parse doesn't have
+   to check the processor on every call. */
 
-  if (cdest == NULL)
-    dest_size = 0;
+typedef size_t (*csv_scan_func)(const unsigned char *, size_t, unsigned char, unsigned char);
 
-  if (dest_size > 0)
-    *cdest++ = '"';
-  chars++;
+static csv_scan_func
+csv_select_scan(void)
+{
+#ifdef CSV_SIMD
+  return __builtin_cpu_supports("avx2") ? csv_scan_avx2 : csv_scan_sse2;
+#else
+  return csv_scan_scalar;
+#endif
+}
 
-  while (src_size) {
-    if (*csrc == '"') {
-      if (dest_size > chars)
-        *cdest++ = '"';
-      if (chars < SIZE_MAX) chars++;
-    }
-    if (dest_size > chars)
-      *cdest++ = *csrc;
-    if (chars < SIZE_MAX) chars++;
-    src_size--;
-    csrc++;
-  }
+#define CSV_PARSE_FUNCTION(name, DELIM, QUOTE, IS_SPACE, IS_TERM) \
+static size_t \
+name(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data) \
+{ \
+  unsigned const char *us = s;  /* Access input data as array of unsigned char */ \
+  unsigned char c;              /* The character we are currently processing */ \
+  size_t pos = 0;               /* The number of characters we have processed in this call */ \
+ \
+  /* Store key fields into local variables for performance */ \
+  const unsigned char delim = (DELIM); \
+  const unsigned char quote = (QUOTE); \
+  int (* const is_space)(unsigned char) = (IS_SPACE); \
+  int (* const is_term)(unsigned char) = (IS_TERM); \
+  int quoted = p->quoted; \
+  int pstate = p->pstate; \
+  size_t spaces = p->spaces; \
+  size_t entry_pos = p->entry_pos; \
+  /* Custom space or term functions can make any byte special */ \
+  csv_scan_func scan = (!is_space && !is_term) ? p->scan_func : NULL; \
+  /* Room kept free at the end of the entry buffer */ \
+  const size_t reserved = (p->options & CSV_APPEND_NULL) ? 1 : 0; \
+ \
+  if (!p->entry_buf && pos < len) { \
+    /* Buffer hasn't been allocated yet and len > 0 */ \
+    if (csv_increase_buffer(p) != 0) {  \
+      p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos; \
+      return pos; \
+    } \
+  } \
+ \
+  while (pos < len) { \
+    /* Check memory usage, increase buffer if neccessary */ \
+    if (entry_pos == p->entry_size - reserved) { \
+      if (csv_increase_buffer(p) != 0) { \
+        p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos; \
+        return pos; \
+      } \
+    } \
+ \
+    if (pstate == FIELD_BEGUN && scan) { \
+      /* Copy the run of ordinary bytes up to the next special one, as far as \
+         the entry buffer allows.  In a quoted field only the quote is special, \
+         spaces is always 0 there. */ \
+      size_t room = p->entry_size - reserved - entry_pos; \
+      size_t n = (len - pos < room) ? len - pos : room; \
+      size_t run; \
+      if (quoted) { \
+        const unsigned char *end = memchr(us + pos, quote, n); \
+        run = end ? (size_t)(end - (us + pos)) : n; \
+      } else { \
+        run = scan(us + pos, n, delim, quote); \
+      } \
+      if (run) { \
+        memcpy(p->entry_buf + entry_pos, us + pos, run); \
+        entry_pos += run; \
+        pos += run; \
+        spaces = 0; \
+        continue; \
+      } \
+    } \
+ \
+    c = us[pos++]; \
+ \
+    switch (pstate) { \
+      case ROW_NOT_BEGUN: \
+      case FIELD_NOT_BEGUN: \
+        if ((is_space ? is_space(c) : c == CSV_SPACE || c == CSV_TAB) && c!=delim) { /* Space or Tab */ \
+          continue; \
+        } else if (is_term ? is_term(c) : c == CSV_CR || c == CSV_LF) { /* Carriage Return or Line Feed */ \
+          if (pstate == FIELD_NOT_BEGUN) { \
+            SUBMIT_FIELD(p); \
+            SUBMIT_ROW(p, (unsigned char)c);  \
+          } else {  /* ROW_NOT_BEGUN */ \
+            /* Don't submit empty rows by default */ \
+            if (p->options & CSV_REPALL_NL) { \
+              SUBMIT_ROW(p, (unsigned char)c); \
+            } \
+          } \
+          continue; \
+        } else if (c == delim) { /* Comma */ \
+          SUBMIT_FIELD(p); \
+          break; \
+        } else if (c == quote) { /* Quote */ \
+          pstate = FIELD_BEGUN; \
+          quoted = 1; \
+        } else {               /* Anything else */ \
+          pstate = FIELD_BEGUN; \
+          quoted = 0; \
+          SUBMIT_CHAR(p, c); \
+        } \
+        break; \
+      case FIELD_BEGUN: \
+        if (c == quote) {         /* Quote */ \
+          if (quoted) { \
+            SUBMIT_CHAR(p, c); \
+            pstate = FIELD_MIGHT_HAVE_ENDED; \
+          } else { \
+            /* STRICT ERROR - double quote inside non-quoted field */ \
+            if (p->options & CSV_STRICT) { \
+              p->status = CSV_EPARSE; \
+              p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos; \
+              return pos-1; \
+            } \
+            SUBMIT_CHAR(p, c); \
+            spaces = 0; \
+          } \
+        } else if (c == delim) {  /* Comma */ \
+          if (quoted) { \
+            SUBMIT_CHAR(p, c); \
+          } else { \
+            SUBMIT_FIELD(p); \
+          } \
+        } else if (is_term ? is_term(c) : c == CSV_CR || c == CSV_LF) {  /* Carriage Return or Line Feed */ \
+          if (!quoted) { \
+            SUBMIT_FIELD(p); \
+            SUBMIT_ROW(p, (unsigned char)c); \
+          } else { \
+            SUBMIT_CHAR(p, c); \
+          } \
+        } else if (!quoted && (is_space? is_space(c) : c == CSV_SPACE || c == CSV_TAB)) { /* Tab or space for non-quoted field */ \
+            SUBMIT_CHAR(p, c); \
+            spaces++; \
+        } else {  /* Anything else */ \
+          SUBMIT_CHAR(p, c); \
+          spaces = 0; \
+        } \
+        break; \
+      case FIELD_MIGHT_HAVE_ENDED: \
+        /* This only happens when a quote character is encountered in a quoted field */ \
+        if (c == delim) {  /* Comma */ \
+          entry_pos -= spaces + 1;  /* get rid of spaces and original quote */ \
+          SUBMIT_FIELD(p); \
+        } else if (is_term ? is_term(c) : c == CSV_CR || c == CSV_LF) {  /* Carriage Return or Line Feed */ \
+          entry_pos -= spaces + 1;  /* get rid of spaces and original quote */ \
+          SUBMIT_FIELD(p); \
+          SUBMIT_ROW(p, (unsigned char)c); \
+        } else if (is_space ? is_space(c) : c == CSV_SPACE || c == CSV_TAB) {  /* Space or Tab */ \
+          SUBMIT_CHAR(p, c); \
+          spaces++; \
+        } else if (c == quote) {  /* Quote */ \
+          if (spaces) { \
+            /* STRICT ERROR - unescaped double quote */ \
+            if (p->options & CSV_STRICT) { \
+              p->status = CSV_EPARSE; \
+              p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos; \
+              return pos-1; \
+            } \
+            spaces = 0; \
+            SUBMIT_CHAR(p, c); \
+          } else { \
+            /* Two quotes in a row */ \
+            pstate = FIELD_BEGUN; \
+          } \
+        } else {  /* Anything else */ \
+          /* STRICT ERROR - unescaped double quote */ \
+          if (p->options & CSV_STRICT) { \
+            p->status = CSV_EPARSE; \
+            p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos; \
+            return pos-1; \
+          } \
+          pstate = FIELD_BEGUN; \
+          spaces = 0; \
+          SUBMIT_CHAR(p, c); \
+        } \
+        break; \
+     default: \
+       break; \
+    } \
+  } \
+  p->quoted = quoted, p->pstate = pstate, p->spaces = spaces, p->entry_pos = entry_pos; \
+  return pos; \
+}
 
-  if (dest_size > chars)
-    *cdest = '"';
-  if (chars < SIZE_MAX) chars++;
+CSV_PARSE_FUNCTION(csv_parse_generic, p->delim_char, p->quote_char, p->is_space, p->is_term)
+CSV_PARSE_FUNCTION(csv_parse_comma, CSV_COMMA, CSV_QUOTE, NULL, NULL)
+CSV_PARSE_FUNCTION(csv_parse_semicolon, CSV_SEMICOLON, CSV_QUOTE, NULL, NULL)
+CSV_PARSE_FUNCTION(csv_parse_tab, CSV_TAB, CSV_QUOTE, NULL, NULL)
 
-  return chars;
+static void
+csv_select_parse(struct csv_parser *p)
+{
+  p->parse_func = csv_parse_generic;
+  p->scan_func = (p->is_space || p->is_term) ? NULL : csv_select_scan();
+  if (p->quote_char != CSV_QUOTE || p->is_space || p->is_term)
+    return;
+  switch (p->delim_char) {
+    case CSV_COMMA:
+      p->parse_func = csv_parse_comma;
+      break;
+    case CSV_SEMICOLON:
+      p->parse_func = csv_parse_semicolon;
+      break;
+    case CSV_TAB:
+      p->parse_func = csv_parse_tab;
+      break;
+    default:
+      break;
+  }
 }
 
-int
-csv_fwrite (FILE *fp, const void *src, size_t src_size)
+size_t
+csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, size_t, void *), void (*cb2)(int c, void *), void *data)
 {
-  const unsigned char *csrc = src;
-
-  if (fp == NULL || src == NULL)
-    return 0;
+  return p->parse_func(p, s, len, cb1, cb2, data);
+}
 
-  if (fputc('"', fp) == EOF)
-    return EOF;
+/* Writing copies the runs between quote characters at once, which memchr
+   finds with the vector instructions of the C library.  A field is only
+   checked for characters which need quoting with CSV_QUOTE_MINIMAL, using
+   the SSE2 scanner of the parser where there is one.  Fields are short, so
+   it isn't worth checking the processor for AVX2 on every field. */
 
-  while (src_size) {
-    if (*csrc == '"') {
-      if (fputc('"', fp) == EOF)
-        return EOF;
-    }
-    if (fputc(*csrc, fp) == EOF)
-      return EOF;
-    src_size--;
-    csrc++;
-  }
-
-  if (fputc('"', fp) == EOF) {
-    return EOF;
+static int
+csv_needs_quotes (const unsigned char *s, size_t n, unsigned char delim, unsigned char quote)
+{
+#ifdef CSV_SIMD
+  csv_scan_func scan = csv_scan_sse2;
+#else
+  csv_scan_func scan = csv_scan_scalar;
+#endif
+  size_t i = 0;
+
+  /* The parser drops spaces and tabs around unquoted fields, inside a field they are kept
+     unless one of them is the delimiter */
+  while ((i += scan(s + i, n - i, delim, quote)) < n) {
+    if (s[i] == delim)
+      return 1;
+    if ((s[i] != CSV_SPACE && s[i] != CSV_TAB) || i == 0 || i == n - 1)
+      return 1;
+    i++;
   }
-
   return 0;
 }
 
+/* Appends n bytes of src at offset chars of dest, as far as they fit in dest_size,
+   and returns the offset after them */
+static size_t
+csv_append (unsigned char *dest, size_t dest_size, size_t chars, const void *src, size_t n)
+{
+  if (dest_size > chars)
+    memcpy(dest + chars, src, dest_size - chars < n ? dest_size - chars : n);
+  return chars > SIZE_MAX - n ? SIZE_MAX : chars + n;
+}
+
 size_t
-csv_write2 (void *dest, size_t dest_size, const void *src, size_t src_size, unsigned char quote)
+csv_write_field (void *dest, size_t dest_size, const void *src, size_t src_size, unsigned char delim, unsigned char quote, unsigned char options)
 {
   unsigned char *cdest = dest;
   const unsigned char *csrc = src;
   size_t chars = 0;
+  int quoted;
 
   if (src == NULL)
     return 0;
@@ -527,55 +688,75 @@ csv_write2 (void *dest, size_t dest_size, const void *src, size_t src_size, unsi
   if (dest == NULL)
     dest_size = 0;
 
-  if (dest_size > 0)
-    *cdest++ = quote;
-  chars++;
+  quoted = !(options & CSV_QUOTE_MINIMAL) || csv_needs_quotes(csrc, src_size, delim, quote);
+  if (!quoted)
+    return csv_append(cdest, dest_size, chars, csrc, src_size);
 
+  chars = csv_append(cdest, dest_size, chars, &quote, 1);
   while (src_size) {
-    if (*csrc == quote) {
-      if (dest_size > chars)
-        *cdest++ = quote;
-      if (chars < SIZE_MAX) chars++;
-    }
-    if (dest_size > chars)
-      *cdest++ = *csrc;
-    if (chars < SIZE_MAX) chars++;
-    src_size--;
-    csrc++;
+    /* The run up to and including the next quote, which is then doubled */
+    const unsigned char *q = memchr(csrc, quote, src_size);
+    size_t run = q ? (size_t)(q - csrc) + 1 : src_size;
+    chars = csv_append(cdest, dest_size, chars, csrc, run);
+    if (q)
+      chars = csv_append(cdest, dest_size, chars, &quote, 1);
+    src_size -= run;
+    csrc += run;
   }
-
-  if (dest_size > chars)
-    *cdest = quote;
-  if (chars < SIZE_MAX) chars++;
-
-  return chars;
+  return csv_append(cdest, dest_size, chars, &quote, 1);
 }
 
 int
-csv_fwrite2 (FILE *fp, const void *src, size_t src_size, unsigned char quote)
+csv_fwrite_field (FILE *fp, const void *src, size_t src_size, unsigned char delim, unsigned char quote, unsigned char options)
 {
   const unsigned char *csrc = src;
 
   if (fp == NULL || src == NULL)
     return 0;
 
+  if ((options & CSV_QUOTE_MINIMAL) && !csv_needs_quotes(csrc, src_size, delim, quote))
+    return fwrite(csrc, 1, src_size, fp) == src_size ? 0 : EOF;
+
   if (fputc(quote, fp) == EOF)
     return EOF;
 
   while (src_size) {
-    if (*csrc == quote) {
-      if (fputc(quote, fp) == EOF)
-        return EOF;
-    }
-    if (fputc(*csrc, fp) == EOF)
+    const unsigned char *q = memchr(csrc, quote, src_size);
+    size_t run = q ? (size_t)(q - csrc) + 1 : src_size;
+    if (fwrite(csrc, 1, run, fp) != run)
+      return EOF;
+    if (q && fputc(quote, fp) == EOF)
       return EOF;
-    src_size--;
-    csrc++;
+    src_size -= run;
+    csrc += run;
   }
 
-  if (fputc(quote, fp) == EOF) {
+  if (fputc(quote, fp) == EOF)
     return EOF;
-  }
 
   return 0;
 }
+
+size_t
+csv_write (void *dest, size_t dest_size, const void *src, size_t src_size)
+{
+  return csv_write_field(dest, dest_size, src, src_size, CSV_COMMA, CSV_QUOTE, 0);
+}
+
+int
+csv_fwrite (FILE *fp, const void *src, size_t src_size)
+{
+  return csv_fwrite_field(fp, src, src_size, CSV_COMMA, CSV_QUOTE, 0);
+}
+
+size_t
+csv_write2 (void *dest, size_t dest_size, const void *src, size_t src_size, unsigned char quote)
+{
+  return csv_write_field(dest, dest_size, src, src_size, CSV_COMMA, quote, 0);
+}
+
+int
+csv_fwrite2 (FILE *fp, const void *src, size_t src_size, unsigned char quote)
+{
+  return csv_fwrite_field(fp, src, src_size, CSV_COMMA, quote, 0);
+}
@@ -0,0 +1,143 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <safe_math.h>
+
+#include "arena.h"
+
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+#define ARENA_ALIGNMENT _Alignof(max_align_t)
+
+struct arena_block
+{
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    _Alignas(max_align_t) char data[];
+};
+
+// arena_realloc stores the size of an allocation in front of it.
+struct resizable_header
+{
+    _Alignas(max_align_t) size_t size;
+};
+
+void arena_init(struct arena *arena)
+{
+    arena->blocks = NULL;
+    arena->last = NULL;
+}
+
+void arena_free(struct arena *arena)
+{
+    struct arena_block *block = arena->blocks;
+    while(block != NULL)
+    {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena_init(arena);
+}
+
+/*
+ * Makes sure the current block has size bytes free after aligning its used bytes to alignment.
+ *
+ * @returns false on error
+ */
+static bool arena_reserve(struct arena *arena, size_t size, size_t alignment)
+{
+    struct arena_block *block = arena->blocks;
+    if(block != NULL)
+    {
+        size_t offset = (block->used + alignment - 1) & ~(alignment - 1);
+        if(offset <= block->size && block->size - offset >= size) return true;
+    }
+
+    size_t block_size = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+    size_t allocation_size;
+    if(!psnip_safe_add(&allocation_size, block_size, sizeof(struct arena_block))) return false;
+    block = malloc(allocation_size);
+    if(block == NULL) return false;
+    block->next = arena->blocks;
+    block->size = block_size;
+    block->used = 0;
+    arena->blocks = block;
+    return true;
+}
+
+static void *arena_take(struct arena *arena, size_t size, size_t alignment)
+{
+    if(!arena_reserve(arena, size, alignment)) return NULL;
+    struct arena_block *block = arena->blocks;
+    block->used = (block->used + alignment - 1) & ~(alignment - 1);
+    void *ptr = block->data + block->used;
+    block->used += size;
+    arena->last = ptr;
+    return ptr;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    return arena_take(arena, size, ARENA_ALIGNMENT);
+}
+
+char *arena_strndup(struct arena *arena, const char *str, size_t length)
+{
+    size_t size;
+    if(!psnip_safe_add(&size, length, 1)) return NULL;
+    char *copy = arena_take(arena, size, 1);
+    if(copy == NULL) return NULL;
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+void *arena_realloc(struct arena *arena, void *ptr, size_t size)
+{
+    // Grow or shrink in place if nothing was allocated after ptr and the current block has room.
+    if(ptr != NULL && (struct resizable_header *) arena->last + 1 == ptr)
+    {
+        struct arena_block *block = arena->blocks;
+        struct resizable_header *header = arena->last;
+        size_t offset = (size_t) ((char *) ptr - block->data);
+        if(block->size - offset >= size)
+        {
+            block->used = offset + size;
+            header->size = size;
+            return ptr;
+        }
+    }
+
+    size_t allocation_size;
+    if(!psnip_safe_add(&allocation_size, size, sizeof(struct resizable_header))) return NULL;
+    struct resizable_header *header = arena_take(arena, allocation_size, ARENA_ALIGNMENT);
+    if(header == NULL) return NULL;
+    header->size = size;
+    if(ptr != NULL)
+    {
+        size_t old_size = ((struct resizable_header *) ptr - 1)->size;
+        memcpy(header + 1, ptr, (old_size < size) ? old_size : size);
+    }
+    return header + 1;
+}
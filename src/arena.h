@@ -0,0 +1,63 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VOORRAADTELLEN_ARENA_H
+#define VOORRAADTELLEN_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator, everything allocated from an arena is freed at once by arena_free.
+ * Memory is taken from the system in large blocks, so allocating many small strings is cheap.
+ */
+struct arena_block;
+
+struct arena
+{
+    struct arena_block *blocks; // The block allocations are taken from, it links to the older blocks.
+    void *last; // The most recent allocation.
+};
+
+void arena_init(struct arena *arena);
+void arena_free(struct arena *arena);
+
+/*
+ * Allocates size bytes aligned for any type.
+ *
+ * @returns NULL on error
+ */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/*
+ * Copies the first length bytes of str into the arena, followed by a '\0'.
+ * The copy is not aligned, which keeps many short strings densely packed.
+ *
+ * @returns NULL on error
+ */
+char *arena_strndup(struct arena *arena, const char *str, size_t length);
+
+/*
+ * Resizes ptr like realloc, ptr has to be NULL or returned by arena_realloc.
+ * The allocation grows in place if nothing was allocated after it.
+ * The old memory is not reused until the arena is freed.
+ *
+ * @returns NULL on error, ptr is left alone then.
+ */
+void *arena_realloc(struct arena *arena, void *ptr, size_t size);
+
+#endif
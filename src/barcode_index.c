@@ -0,0 +1,279 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <safe_math.h>
+
+#include "barcode_index.h"
+
+struct barcode_index_slot
+{
+    uint64_t hash;
+    size_t row; // SIZE_MAX if this slot is empty.
+};
+
+// 64-bit FNV-1a
+static uint64_t hash_barcode(const char *barcode)
+{
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for(const unsigned char *c = (const unsigned char *) barcode; *c != '\0'; c++)
+    {
+        hash ^= *c;
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+static const char *barcode_of(const struct catalog *catalog, size_t row, size_t column)
+{
+    if(catalog_column_count(catalog, row) <= column) return NULL;
+    return catalog_cell(catalog, row, column);
+}
+
+// Numeric barcodes with more digits than this go into the hash table.
+#define NUMERIC_KEY_MAX_DIGITS 17
+#define NUMERIC_KEY_LENGTH_SHIFT 57
+
+struct key_row
+{
+    uint64_t key;
+    size_t row;
+};
+
+/*
+ * Packs a barcode consisting of only digits into a 64-bit key.
+ * The amount of digits is stored above the value, so leading zeroes are significant
+ * (0123 and 123 are different barcodes, just like in the CSV file).
+ *
+ * @returns false if the barcode is not numeric or too long.
+ */
+static bool numeric_key(const char *barcode, uint64_t *key)
+{
+    uint64_t value = 0;
+    size_t length = 0;
+    for(const char *c = barcode; *c != '\0'; c++)
+    {
+        if(*c < '0' || *c > '9' || length == NUMERIC_KEY_MAX_DIGITS) return false;
+        value = value * 10 + (uint64_t) (*c - '0');
+        length++;
+    }
+    if(length == 0) return false;
+    *key = ((uint64_t) length << NUMERIC_KEY_LENGTH_SHIFT) | value;
+    return true;
+}
+
+static int compare_key_rows(const void *a, const void *b)
+{
+    const struct key_row *x = a;
+    const struct key_row *y = b;
+    if(x->key != y->key) return (x->key < y->key) ? -1 : 1;
+    // Keep duplicates in file order.
+    if(x->row != y->row) return (x->row < y->row) ? -1 : 1;
+    return 0;
+}
+
+// Returns the index of the first key which is not less than key.
+static size_t lower_bound(const uint64_t *keys, size_t keys_size, uint64_t key)
+{
+    if(keys_size == 0) return 0;
+    const uint64_t *base = keys;
+    size_t n = keys_size;
+    while(n > 1)
+    {
+        size_t half = n / 2;
+        // No branch on the comparison, compilers turn this into a conditional move.
+        base = (base[half - 1] < key) ? base + half : base;
+        n -= half;
+    }
+    return (size_t) (base - keys) + (*base < key);
+}
+
+static bool build_numeric_keys(struct barcode_index *index, const struct catalog *catalog, size_t column, size_t numeric_size)
+{
+    if(numeric_size == 0) return true;
+
+    size_t size;
+    if(!psnip_safe_mul(&size, numeric_size, sizeof(struct key_row))) return false;
+    struct key_row *pairs = malloc(size);
+    if(pairs == NULL) return false;
+
+    size_t used = 0;
+    for(size_t i = 0; i < catalog->records_size; i++)
+    {
+        const char *barcode = barcode_of(catalog, i, column);
+        if(barcode == NULL || !numeric_key(barcode, &pairs[used].key)) continue;
+        pairs[used].row = i;
+        used++;
+    }
+    qsort(pairs, used, sizeof(struct key_row), compare_key_rows);
+
+    if(!psnip_safe_mul(&size, used, sizeof(uint64_t))) { free(pairs); return false; }
+    index->keys = malloc(size);
+    if(!psnip_safe_mul(&size, used, sizeof(size_t))) { free(pairs); return false; }
+    index->key_rows = malloc(size);
+    if(index->keys == NULL || index->key_rows == NULL) { free(pairs); return false; }
+    for(size_t i = 0; i < used; i++)
+    {
+        index->keys[i] = pairs[i].key;
+        index->key_rows[i] = pairs[i].row;
+    }
+    index->keys_size = used;
+    free(pairs);
+    return true;
+}
+
+bool barcode_index_build(struct barcode_index *index, const struct catalog *catalog, size_t column)
+{
+    index->keys = NULL;
+    index->key_rows = NULL;
+    index->keys_size = 0;
+    index->slots = NULL;
+    index->capacity = 0;
+    index->borrowed = false;
+
+    size_t numeric_size = 0;
+    size_t string_size = 0;
+    for(size_t i = 0; i < catalog->records_size; i++)
+    {
+        const char *barcode = barcode_of(catalog, i, column);
+        if(barcode == NULL || *barcode == '\0') continue;
+        uint64_t key;
+        if(numeric_key(barcode, &key)) numeric_size++; else string_size++;
+    }
+
+    if(!build_numeric_keys(index, catalog, column, numeric_size)) { barcode_index_free(index); return false; }
+    if(string_size == 0) return true;
+
+    // Keep the load factor at or below 50%, so probe sequences stay short.
+    size_t capacity = 16;
+    while(capacity / 2 < string_size)
+    {
+        if(!psnip_safe_mul(&capacity, capacity, 2)) { barcode_index_free(index); return false; }
+    }
+    size_t size;
+    if(!psnip_safe_mul(&size, capacity, sizeof(struct barcode_index_slot))) { barcode_index_free(index); return false; }
+    struct barcode_index_slot *slots = malloc(size);
+    if(slots == NULL) { barcode_index_free(index); return false; }
+    for(size_t i = 0; i < capacity; i++) slots[i].row = SIZE_MAX;
+
+    size_t mask = capacity - 1;
+    for(size_t i = 0; i < catalog->records_size; i++)
+    {
+        const char *barcode = barcode_of(catalog, i, column);
+        if(barcode == NULL || *barcode == '\0') continue;
+        uint64_t key;
+        if(numeric_key(barcode, &key)) continue;
+
+        uint64_t hash = hash_barcode(barcode);
+        size_t slot = (size_t) hash & mask;
+        while(slots[slot].row != SIZE_MAX) slot = (slot + 1) & mask;
+        slots[slot].hash = hash;
+        slots[slot].row = i;
+    }
+
+    index->slots = slots;
+    index->capacity = capacity;
+    return true;
+}
+
+size_t barcode_index_find(const struct barcode_index *index, const struct catalog *catalog, size_t column, const char *barcode, size_t *rows, size_t max_rows)
+{
+    uint64_t key;
+    if(numeric_key(barcode, &key))
+    {
+        size_t found = 0;
+        for(size_t i = lower_bound(index->keys, index->keys_size, key); i < index->keys_size && index->keys[i] == key; i++)
+        {
+            if(found < max_rows) rows[found] = index->key_rows[i];
+            found++;
+        }
+        return found;
+    }
+
+    if(index->capacity == 0) return 0;
+
+    uint64_t hash = hash_barcode(barcode);
+    size_t mask = index->capacity - 1;
+    size_t found = 0;
+    for(size_t slot = (size_t) hash & mask; index->slots[slot].row != SIZE_MAX; slot = (slot + 1) & mask)
+    {
+        const struct barcode_index_slot *current = index->slots + slot;
+        if(current->hash != hash) continue;
+        if(strcmp(barcode_of(catalog, current->row, column), barcode) != 0) continue;
+        if(found < max_rows) rows[found] = current->row;
+        found++;
+    }
+    return found;
+}
+
+bool barcode_index_save_snapshot(const struct barcode_index *index, struct snapshot_writer *writer)
+{
+    return snapshot_write_size(writer, index->keys_size)
+        && snapshot_write_array(writer, index->keys, index->keys_size * sizeof(uint64_t))
+        && snapshot_write_array(writer, index->key_rows, index->keys_size * sizeof(size_t))
+        && snapshot_write_size(writer, index->capacity)
+        && snapshot_write_array(writer, index->slots, index->capacity * sizeof(struct barcode_index_slot));
+}
+
+bool barcode_index_load_snapshot(struct barcode_index *index, struct snapshot_reader *reader)
+{
+    index->keys = NULL;
+    index->key_rows = NULL;
+    index->keys_size = 0;
+    index->slots = NULL;
+    index->capacity = 0;
+    index->borrowed = true;
+
+    size_t keys_size;
+    if(!snapshot_read_size(reader, &keys_size)) return false;
+    index->keys = (uint64_t *) snapshot_read_array(reader, keys_size, sizeof(uint64_t));
+    index->key_rows = (size_t *) snapshot_read_array(reader, keys_size, sizeof(size_t));
+    if(index->keys == NULL || index->key_rows == NULL) goto damaged;
+    index->keys_size = keys_size;
+
+    size_t capacity;
+    if(!snapshot_read_size(reader, &capacity)) goto damaged;
+    if(capacity == 0) return true;
+    if((capacity & (capacity - 1)) != 0) goto damaged;
+    index->slots = (struct barcode_index_slot *) snapshot_read_array(reader, capacity, sizeof(struct barcode_index_slot));
+    if(index->slots == NULL) goto damaged;
+    index->capacity = capacity;
+    return true;
+
+    damaged:
+    barcode_index_free(index);
+    return false;
+}
+
+void barcode_index_free(struct barcode_index *index)
+{
+    if(!index->borrowed)
+    {
+        free(index->keys);
+        free(index->key_rows);
+        free(index->slots);
+    }
+    index->borrowed = false;
+    index->keys = NULL;
+    index->key_rows = NULL;
+    index->keys_size = 0;
+    index->slots = NULL;
+    index->capacity = 0;
+}
@@ -0,0 +1,76 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VOORRAADTELLEN_BARCODE_INDEX_H
+#define VOORRAADTELLEN_BARCODE_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "catalog.h"
+#include "snapshot.h"
+
+/*
+ * Index over the barcode column.
+ *
+ * Numeric barcodes (EAN/UPC/GTIN) are packed into 64-bit keys, kept in one
+ * sorted array which is binary searched. Any other barcode goes into an
+ * open-addressing hash table of strings.
+ * Duplicate barcodes are all kept and are found in the order they appear in the CSV file.
+ */
+struct barcode_index
+{
+    uint64_t *keys;     // Sorted, duplicates are adjacent.
+    size_t *key_rows;   // key_rows[i] is the record index belonging to keys[i].
+    size_t keys_size;
+
+    struct barcode_index_slot *slots;
+    size_t capacity; // Always a power of two, or 0 if the hash table is empty.
+    bool borrowed;   // The arrays point into a snapshot, they are not freed.
+};
+
+/*
+ * @returns false on error
+ */
+bool barcode_index_build(struct barcode_index *index, const struct catalog *catalog, size_t column);
+
+/*
+ * Looks up all records with the given barcode.
+ * At most max_rows record indexes are stored in rows.
+ *
+ * @returns the total amount of records with this barcode, which may be larger than max_rows.
+ */
+size_t barcode_index_find(const struct barcode_index *index, const struct catalog *catalog, size_t column, const char *barcode, size_t *rows, size_t max_rows);
+
+/*
+ * @returns false on error
+ */
+bool barcode_index_save_snapshot(const struct barcode_index *index, struct snapshot_writer *writer);
+
+/*
+ * Initializes index with the index written by barcode_index_save_snapshot.
+ * The index is used right where it is in the snapshot, which has to stay open until the index is freed.
+ *
+ * @returns false on error, or if the snapshot is damaged
+ */
+bool barcode_index_load_snapshot(struct barcode_index *index, struct snapshot_reader *reader);
+
+void barcode_index_free(struct barcode_index *index);
+
+#endif
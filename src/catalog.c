@@ -0,0 +1,608 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <safe_math.h>
+
+#include "catalog.h"
+
+#define TEXT_MIN_CAPACITY 4096
+#define RECORDS_MIN_CAPACITY 64
+
+/*
+ * The CSV file a lazily loaded catalog was read from, and what it takes to parse its records again.
+ */
+struct catalog_source
+{
+    struct mapped_file file;    // Taken over by catalog_end_source, records are parsed again from its mapping.
+    size_t *loaded;         // The columns stored while the file is read.
+    size_t loaded_count;
+    size_t *row_starts;     // Record row is parsed from row_starts[row] up to row_starts[row + 1], holds records_capacity + 1 offsets.
+    struct csv_parser parser;   // Readers parse records with a parser set up like this one.
+    bool ended;             // Set by catalog_end_source, readers can be made after that.
+    size_t cells_capacity;  // Room for the cells of any record, each followed by a '\0'.
+    struct catalog_reader reader;   // Parses the cells asked for through catalog_cell.
+};
+
+void catalog_init(struct catalog *catalog)
+{
+    catalog->columns = NULL;
+    catalog->column_count = 0;
+    catalog->column_counts = NULL;
+    catalog->column_counts_borrowed = false;
+    catalog->records_size = 0;
+    catalog->records_capacity = 0;
+    catalog->pending_fields = 0;
+    catalog->source = NULL;
+}
+
+static void source_free(struct catalog_source *source)
+{
+    mapped_file_close(&source->file);
+    free(source->loaded);
+    free(source->row_starts);
+    if(source->ended) catalog_reader_free(&source->reader);
+    csv_free(&source->parser);
+    free(source);
+}
+
+void catalog_free(struct catalog *catalog)
+{
+    if(catalog->source != NULL) source_free(catalog->source);
+    for(size_t i = 0; i < catalog->column_count; i++)
+    {
+        struct catalog_column *column = catalog->columns + i;
+        if(!column->borrowed)
+        {
+            free(column->text);
+            free(column->offsets);
+        }
+        if(column->edited != NULL)
+        {
+            for(size_t row = 0; row < catalog->records_size; row++) free(column->edited[row]);
+            free(column->edited);
+        }
+    }
+    free(catalog->columns);
+    if(!catalog->column_counts_borrowed) free(catalog->column_counts);
+    catalog_init(catalog);
+}
+
+/*
+ * Appends a cell to the text of column, the caller sets its offset.
+ *
+ * @returns false on error
+ */
+static bool append_text(struct catalog_column *column, const char *data, size_t length)
+{
+    size_t required;
+    if(!psnip_safe_add(&required, column->text_size, length) || !psnip_safe_add(&required, required, 1)) return false;
+    if(required > column->text_capacity)
+    {
+        size_t capacity = (column->text_capacity == 0) ? TEXT_MIN_CAPACITY : column->text_capacity;
+        while(capacity < required)
+        {
+            if(!psnip_safe_mul(&capacity, capacity, 2)) return false;
+        }
+        char *tmp = realloc(column->text, capacity);
+        if(tmp == NULL) return false;
+        column->text = tmp;
+        column->text_capacity = capacity;
+    }
+    memcpy(column->text + column->text_size, data, length);
+    column->text[column->text_size + length] = '\0';
+    column->text_size = required;
+    return true;
+}
+
+/*
+ * @returns whether the cells of column are stored, which is every column unless the catalog is loaded lazily.
+ */
+static bool column_loaded(const struct catalog *catalog, size_t column)
+{
+    const struct catalog_source *source = catalog->source;
+    if(source == NULL) return true;
+    for(size_t i = 0; i < source->loaded_count; i++)
+    {
+        if(source->loaded[i] == column) return true;
+    }
+    return false;
+}
+
+/*
+ * Adds a column in which all records read so far have an empty cell.
+ *
+ * @returns false on error
+ */
+static bool add_column(struct catalog *catalog)
+{
+    size_t size;
+    if(!psnip_safe_add(&size, catalog->column_count, 1) || !psnip_safe_mul(&size, size, sizeof(struct catalog_column))) return false;
+    struct catalog_column *columns = realloc(catalog->columns, size);
+    if(columns == NULL) return false;
+    catalog->columns = columns;
+
+    struct catalog_column *column = columns + catalog->column_count;
+    column->text = NULL;
+    column->text_size = 0;
+    column->text_capacity = 0;
+    column->edited = NULL;
+    column->offsets = NULL;
+    column->borrowed = false;
+    // The cells of a lazily loaded catalog are parsed when asked for, unless the column is loaded.
+    if(!column_loaded(catalog, catalog->column_count))
+    {
+        catalog->column_count++;
+        return true;
+    }
+    // The offsets of a loaded column of a lazily loaded catalog tell that it is loaded, so it gets them right away.
+    if(catalog->records_capacity > 0 || catalog->source != NULL)
+    {
+        if(!psnip_safe_mul(&size, catalog->records_capacity == 0 ? 1 : catalog->records_capacity, sizeof(size_t))) return false;
+        column->offsets = malloc(size);
+        if(column->offsets == NULL) return false;
+    }
+    // All empty cells of the records read so far share the terminator of the first one.
+    if(!append_text(column, "", 0)) { free(column->offsets); return false; }
+    for(size_t row = 0; row < catalog->records_size; row++) column->offsets[row] = 0;
+    catalog->column_count++;
+    return true;
+}
+
+/*
+ * Makes room for count more records in column_counts and the offsets of every column.
+ *
+ * @returns false on error
+ */
+static bool reserve_records(struct catalog *catalog, size_t count)
+{
+    size_t required;
+    if(!psnip_safe_add(&required, catalog->records_size, count)) return false;
+    if(required <= catalog->records_capacity) return true;
+    size_t capacity = (catalog->records_capacity == 0) ? RECORDS_MIN_CAPACITY : catalog->records_capacity;
+    while(capacity < required)
+    {
+        if(!psnip_safe_mul(&capacity, capacity, 2)) return false;
+    }
+    size_t size;
+    if(!psnip_safe_mul(&size, capacity, sizeof(size_t))) return false;
+
+    size_t *column_counts = realloc(catalog->column_counts, size);
+    if(column_counts == NULL) return false;
+    catalog->column_counts = column_counts;
+    for(size_t i = 0; i < catalog->column_count; i++)
+    {
+        if(catalog->source != NULL && catalog->columns[i].offsets == NULL) continue;
+        size_t *offsets = realloc(catalog->columns[i].offsets, size);
+        if(offsets == NULL) return false;
+        catalog->columns[i].offsets = offsets;
+    }
+    if(catalog->source != NULL)
+    {
+        if(!psnip_safe_add(&size, size, sizeof(size_t))) return false;
+        size_t *row_starts = realloc(catalog->source->row_starts, size);
+        if(row_starts == NULL) return false;
+        catalog->source->row_starts = row_starts;
+    }
+    catalog->records_capacity = capacity;
+    return true;
+}
+
+bool catalog_reserve(struct catalog *catalog, size_t records)
+{
+    return reserve_records(catalog, records);
+}
+
+bool catalog_append_field(struct catalog *catalog, const char *data, size_t length)
+{
+    if(catalog->pending_fields == 0 && !reserve_records(catalog, 1)) return false;
+    if(catalog->pending_fields == catalog->column_count && !add_column(catalog)) return false;
+    // A lazily loaded catalog only counts the fields of the columns it doesn't load.
+    if(catalog->columns[catalog->pending_fields].offsets == NULL)
+    {
+        catalog->pending_fields++;
+        return true;
+    }
+
+    struct catalog_column *column = catalog->columns + catalog->pending_fields;
+    size_t offset = column->text_size;
+    if(!append_text(column, data, length)) return false;
+    column->offsets[catalog->records_size] = offset;
+    catalog->pending_fields++;
+    return true;
+}
+
+bool catalog_end_record(struct catalog *catalog)
+{
+    if(catalog->pending_fields == 0 && !reserve_records(catalog, 1)) return false;
+    // Pad the record with empty cells, they are never saved.
+    for(size_t i = catalog->pending_fields; i < catalog->column_count; i++)
+    {
+        struct catalog_column *column = catalog->columns + i;
+        if(column->offsets == NULL) continue; // Not loaded, the cells are parsed when asked for.
+        size_t offset = column->text_size;
+        if(!append_text(column, "", 0)) return false;
+        column->offsets[catalog->records_size] = offset;
+    }
+    catalog->column_counts[catalog->records_size] = catalog->pending_fields;
+    catalog->records_size++;
+    catalog->pending_fields = 0;
+    return true;
+}
+
+bool catalog_init_lazy(struct catalog *catalog, struct csv_parser *parser, const size_t *columns, size_t count)
+{
+    catalog_init(catalog);
+    struct catalog_source *source = malloc(sizeof(struct catalog_source));
+    if(source == NULL) return false;
+    if(csv_init(&source->parser, (unsigned char) csv_get_opts(parser)) != 0) { free(source); return false; }
+    csv_set_delim(&source->parser, csv_get_delim(parser));
+    csv_set_quote(&source->parser, csv_get_quote(parser));
+    csv_set_space_func(&source->parser, parser->is_space);
+    csv_set_term_func(&source->parser, parser->is_term);
+    // Nothing to close until catalog_end_source hands over the file.
+    source->file.stream = NULL;
+    source->file.data = NULL;
+    source->file.size = 0;
+    source->file.mapped = false;
+    source->ended = false;
+    source->cells_capacity = 0;
+    source->loaded_count = count;
+    source->loaded = malloc(count == 0 ? 1 : count * sizeof(size_t));
+    source->row_starts = malloc(sizeof(size_t));
+    if(source->loaded == NULL || source->row_starts == NULL) { source_free(source); return false; }
+    if(count > 0) memcpy(source->loaded, columns, count * sizeof(size_t));
+    source->row_starts[0] = 0;
+    catalog->source = source;
+    return true;
+}
+
+bool catalog_init_like(struct catalog *catalog, const struct catalog *other)
+{
+    const struct catalog_source *source = other->source;
+    if(source == NULL)
+    {
+        catalog_init(catalog);
+        return true;
+    }
+    return catalog_init_lazy(catalog, (struct csv_parser *) &source->parser, source->loaded, source->loaded_count);
+}
+
+void catalog_skip_source(struct catalog *catalog, size_t end)
+{
+    catalog->source->row_starts[catalog->records_size] = end;
+}
+
+bool catalog_end_lazy_record(struct catalog *catalog, size_t end)
+{
+    if(!catalog_end_record(catalog)) return false;
+    catalog->source->row_starts[catalog->records_size] = end;
+    return true;
+}
+
+bool catalog_end_source(struct catalog *catalog, struct mapped_file *file)
+{
+    struct catalog_source *source = catalog->source;
+    source->file = *file;
+    size_t longest = 0;
+    for(size_t row = 0; row < catalog->records_size; row++)
+    {
+        size_t length = source->row_starts[row + 1] - source->row_starts[row];
+        if(length > longest) longest = length;
+    }
+
+    // The cells of a record are never longer than the record, with a '\0' after each cell.
+    if(!psnip_safe_add(&source->cells_capacity, longest, catalog->column_count) || !psnip_safe_add(&source->cells_capacity, source->cells_capacity, 1)) return false;
+    source->ended = true;
+    if(catalog_reader_init(&source->reader, catalog)) return true;
+    source->ended = false;
+    return false;
+}
+
+bool catalog_reader_init(struct catalog_reader *reader, const struct catalog *catalog)
+{
+    const struct catalog_source *source = catalog->source;
+    reader->cells = NULL;
+    reader->cell_offsets = NULL;
+    reader->parsed_row = SIZE_MAX;
+    // Only the cells of a lazily loaded catalog have to be parsed.
+    if(source == NULL) return csv_init(&reader->parser, 0) == 0;
+    if(!source->ended) return false;
+
+    struct csv_parser *template = (struct csv_parser *) &source->parser;
+    if(csv_init(&reader->parser, (unsigned char) csv_get_opts(template)) != 0) return false;
+    csv_set_delim(&reader->parser, csv_get_delim(template));
+    csv_set_quote(&reader->parser, csv_get_quote(template));
+    csv_set_space_func(&reader->parser, template->is_space);
+    csv_set_term_func(&reader->parser, template->is_term);
+    reader->cells = malloc(source->cells_capacity);
+    reader->cell_offsets = malloc(catalog->column_count == 0 ? 1 : catalog->column_count * sizeof(size_t));
+    reader->cells_size = 0;
+    reader->cells_capacity = source->cells_capacity;
+    reader->cell_count = 0;
+    reader->cell_offsets_capacity = catalog->column_count;
+    if(reader->cells == NULL || reader->cell_offsets == NULL) { catalog_reader_free(reader); return false; }
+
+    // Let the parser allocate a field buffer for the longest field right away, by parsing the first record.
+    csv_set_blk_size(&reader->parser, source->cells_capacity);
+    if(catalog->records_size > 0)
+    {
+        size_t length = source->row_starts[1] - source->row_starts[0];
+        size_t bytes_processed = csv_parse(&reader->parser, source->file.data + source->row_starts[0], length, NULL, NULL, NULL);
+        csv_fini(&reader->parser, NULL, NULL, NULL);
+        if(bytes_processed < length) { catalog_reader_free(reader); return false; }
+    }
+    return true;
+}
+
+void catalog_reader_free(struct catalog_reader *reader)
+{
+    csv_free(&reader->parser);
+    free(reader->cells);
+    free(reader->cell_offsets);
+    reader->cells = NULL;
+    reader->cell_offsets = NULL;
+}
+
+static void parsed_cell_callback(void *data, size_t length, void *callback_data)
+{
+    struct catalog_reader *reader = callback_data;
+    // Only a record which doesn't parse the same way as when it was read could run out of room.
+    if(reader->parsed_row_ended || reader->cell_count == reader->cell_offsets_capacity) return;
+    if(length >= reader->cells_capacity - reader->cells_size) return;
+    memcpy(reader->cells + reader->cells_size, data, length);
+    reader->cells[reader->cells_size + length] = '\0';
+    reader->cell_offsets[reader->cell_count++] = reader->cells_size;
+    reader->cells_size += length + 1;
+}
+
+static void parsed_record_callback(int c, void *callback_data)
+{
+    struct catalog_reader *reader = callback_data;
+    reader->parsed_row_ended = true;
+}
+
+const char *catalog_read_cell(struct catalog_reader *reader, const struct catalog *catalog, size_t row, size_t column)
+{
+    const struct catalog_column *current = catalog->columns + column;
+    if(current->offsets != NULL) return current->text + current->offsets[row];
+    const struct catalog_source *source = catalog->source;
+    if(source == NULL || reader->cells == NULL) return "";
+    if(reader->parsed_row != row)
+    {
+        reader->cells_size = 0;
+        reader->cell_count = 0;
+        reader->parsed_row_ended = false;
+        size_t start = source->row_starts[row];
+        csv_parse(&reader->parser, source->file.data + start, source->row_starts[row + 1] - start, parsed_cell_callback, parsed_record_callback, reader);
+        csv_fini(&reader->parser, parsed_cell_callback, parsed_record_callback, reader);
+        reader->parsed_row = row;
+    }
+    if(column >= reader->cell_count) return "";
+    return reader->cells + reader->cell_offsets[column];
+}
+
+const char *catalog_parse_cell(const struct catalog *catalog, size_t row, size_t column)
+{
+    struct catalog_source *source = catalog->source;
+    if(!source->ended) return "";
+    return catalog_read_cell(&source->reader, catalog, row, column);
+}
+
+bool catalog_add_columns(struct catalog *catalog, size_t count)
+{
+    while(catalog->column_count < count)
+    {
+        if(!add_column(catalog)) return false;
+    }
+    return true;
+}
+
+bool catalog_set_cell(struct catalog *catalog, size_t row, size_t column, const char *text)
+{
+    if(!catalog_add_columns(catalog, column + 1)) return false;
+
+    struct catalog_column *current = catalog->columns + column;
+    if(current->edited == NULL)
+    {
+        current->edited = calloc(catalog->records_capacity, sizeof(char *));
+        if(current->edited == NULL) return false;
+    }
+    size_t length = strlen(text);
+    char *copy = malloc(length + 1);
+    if(copy == NULL) return false;
+    memcpy(copy, text, length + 1);
+    if(catalog->column_counts[row] <= column)
+    {
+        if(catalog->column_counts_borrowed)
+        {
+            size_t *column_counts = malloc(catalog->records_capacity * sizeof(size_t));
+            if(column_counts == NULL) { free(copy); return false; }
+            memcpy(column_counts, catalog->column_counts, catalog->records_size * sizeof(size_t));
+            catalog->column_counts = column_counts;
+            catalog->column_counts_borrowed = false;
+        }
+        catalog->column_counts[row] = column + 1;
+    }
+    free(current->edited[row]);
+    current->edited[row] = copy;
+    return true;
+}
+
+bool catalog_append(struct catalog *catalog, const struct catalog *other)
+{
+    if(other->records_size == 0) return true;
+    if(!reserve_records(catalog, other->records_size)) return false;
+    while(catalog->column_count < other->column_count)
+    {
+        if(!add_column(catalog)) return false;
+    }
+
+    size_t base = catalog->records_size;
+    size_t i;
+    for(i = 0; i < catalog->column_count; i++)
+    {
+        struct catalog_column *column = catalog->columns + i;
+        if(column->offsets == NULL) continue; // Not loaded, the cells are parsed when asked for.
+        size_t offset = column->text_size;
+        if(i < other->column_count)
+        {
+            const struct catalog_column *appended = other->columns + i;
+            if(!append_text(column, appended->text, appended->text_size - 1)) break;
+            for(size_t row = 0; row < other->records_size; row++) column->offsets[base + row] = offset + appended->offsets[row];
+        }
+        else
+        {
+            // None of the appended records reach this column, they share one empty cell.
+            if(!append_text(column, "", 0)) break;
+            for(size_t row = 0; row < other->records_size; row++) column->offsets[base + row] = offset;
+        }
+    }
+    if(i < catalog->column_count)
+    {
+        // Drop the cells copied so far, so the text still ends with the last record.
+        for(size_t j = 0; j < i; j++)
+        {
+            struct catalog_column *column = catalog->columns + j;
+            if(column->offsets == NULL) continue;
+            column->text_size = column->offsets[base];
+            if(j < other->column_count) column->text_size -= other->columns[j].offsets[0];
+        }
+        return false;
+    }
+
+    memcpy(catalog->column_counts + base, other->column_counts, other->records_size * sizeof(size_t));
+    if(catalog->source != NULL) memcpy(catalog->source->row_starts + base + 1, other->source->row_starts + 1, other->records_size * sizeof(size_t));
+    catalog->records_size += other->records_size;
+    return true;
+}
+
+bool catalog_save_snapshot(const struct catalog *catalog, struct snapshot_writer *writer)
+{
+    if(catalog->source != NULL) return false;
+    if(!snapshot_write_size(writer, catalog->column_count) || !snapshot_write_size(writer, catalog->records_size)) return false;
+    if(!snapshot_write_array(writer, catalog->column_counts, catalog->records_size * sizeof(size_t))) return false;
+    for(size_t i = 0; i < catalog->column_count; i++)
+    {
+        const struct catalog_column *column = catalog->columns + i;
+        if(!snapshot_write_size(writer, column->text_size) || !snapshot_write_array(writer, column->text, column->text_size)) return false;
+        if(!snapshot_write_array(writer, column->offsets, catalog->records_size * sizeof(size_t))) return false;
+    }
+    return true;
+}
+
+bool catalog_load_snapshot(struct catalog *catalog, struct snapshot_reader *reader)
+{
+    catalog_init(catalog);
+    size_t column_count, records_size;
+    if(!snapshot_read_size(reader, &column_count) || !snapshot_read_size(reader, &records_size)) return false;
+    // Every column takes at least a byte of the snapshot, so a damaged count can't cause a huge allocation.
+    if(column_count > reader->size) return false;
+    // The arrays are not checked cell by cell, that would read the whole snapshot before the catalog can be used.
+    catalog->column_counts = (size_t *) snapshot_read_array(reader, records_size, sizeof(size_t));
+    if(catalog->column_counts == NULL) return false;
+    catalog->column_counts_borrowed = true;
+    catalog->records_size = records_size;
+    catalog->records_capacity = records_size;
+
+    catalog->columns = malloc(column_count == 0 ? 1 : column_count * sizeof(struct catalog_column));
+    if(catalog->columns == NULL) goto damaged;
+    for(size_t i = 0; i < column_count; i++)
+    {
+        struct catalog_column *column = catalog->columns + i;
+        size_t text_size;
+        if(!snapshot_read_size(reader, &text_size) || text_size == 0) goto damaged;
+        column->text = (char *) snapshot_read_array(reader, text_size, 1);
+        column->offsets = (size_t *) snapshot_read_array(reader, records_size, sizeof(size_t));
+        if(column->text == NULL || column->offsets == NULL || column->text[text_size - 1] != '\0') goto damaged;
+        column->text_size = text_size;
+        column->text_capacity = text_size;
+        column->edited = NULL;
+        column->borrowed = true;
+        catalog->column_count++;
+    }
+    return true;
+
+    damaged:
+    catalog_free(catalog);
+    return false;
+}
+
+bool catalog_save_edits(const struct catalog *catalog, struct snapshot_writer *writer)
+{
+    return catalog_save_edits_replacing(catalog, writer, SIZE_MAX, NULL);
+}
+
+/*
+ * @returns the edited cells of column, or cells if column is the replaced column
+ */
+static char *const *edits_of(const struct catalog *catalog, size_t column, size_t replaced_column, char *const *cells)
+{
+    if(column == replaced_column) return cells;
+    return catalog->columns[column].edited;
+}
+
+bool catalog_save_edits_replacing(const struct catalog *catalog, struct snapshot_writer *writer, size_t column, char *const *cells)
+{
+    size_t edits_size = 0;
+    for(size_t i = 0; i < catalog->column_count; i++)
+    {
+        char *const *edited = edits_of(catalog, i, column, cells);
+        if(edited == NULL) continue;
+        for(size_t row = 0; row < catalog->records_size; row++)
+        {
+            if(edited[row] != NULL) edits_size++;
+        }
+    }
+    if(!snapshot_write_size(writer, edits_size)) return false;
+    for(size_t i = 0; i < catalog->column_count; i++)
+    {
+        char *const *edited = edits_of(catalog, i, column, cells);
+        if(edited == NULL) continue;
+        for(size_t row = 0; row < catalog->records_size; row++)
+        {
+            if(edited[row] == NULL) continue;
+            if(!snapshot_write_size(writer, row) || !snapshot_write_size(writer, i) || !snapshot_write_string(writer, edited[row])) return false;
+        }
+    }
+    return true;
+}
+
+bool catalog_load_edits(struct catalog *catalog, struct snapshot_reader *reader, size_t column_limit)
+{
+    size_t edits_size;
+    if(!snapshot_read_size(reader, &edits_size)) return false;
+    for(size_t i = 0; i < edits_size; i++)
+    {
+        size_t row, column, length;
+        const char *text;
+        if(!snapshot_read_size(reader, &row) || !snapshot_read_size(reader, &column) || !snapshot_read_string(reader, &text, &length)) return false;
+        if(row >= catalog->records_size || column >= column_limit) return false;
+        char *copy = malloc(length + 1);
+        if(copy == NULL) return false;
+        memcpy(copy, text, length);
+        copy[length] = '\0';
+        bool stored = catalog_set_cell(catalog, row, column, copy);
+        free(copy);
+        if(!stored) return false;
+    }
+    return true;
+}
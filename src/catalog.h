@@ -0,0 +1,232 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VOORRAADTELLEN_CATALOG_H
+#define VOORRAADTELLEN_CATALOG_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <csv.h>
+
+#include "snapshot.h"
+#include "mapped_file.h"
+
+/*
+ * All records of the CSV file, stored column-major.
+ * The cells of a column are stored back to back in one blob, each followed by a '\0',
+ * so sweeping over a column reads memory sequentially.
+ * Every record has a cell in every column, cells past the end of a record are empty.
+ *
+ * A lazily loaded catalog only stores the columns it was initialized with,
+ * the other cells are parsed from the memory mapped CSV file when they are asked for.
+ */
+struct catalog_column
+{
+    char *text;
+    size_t text_size;
+    size_t text_capacity;
+    size_t *offsets;    // offsets[row] is where the cell of record row starts in text, NULL if the column is not loaded.
+    char **edited;      // If not NULL, a non-NULL edited[row] replaces the cell of record row in text.
+    bool borrowed;      // text and offsets point into a snapshot, they are not freed.
+};
+
+struct catalog
+{
+    struct catalog_column *columns;
+    size_t column_count;    // The most columns of any record.
+    size_t *column_counts;  // column_counts[row] is the amount of columns record row has in the CSV file.
+    bool column_counts_borrowed;    // column_counts points into a snapshot, it is copied before it changes.
+    size_t records_size;
+    size_t records_capacity;
+    size_t pending_fields;  // Fields appended to the record which hasn't ended yet.
+    struct catalog_source *source; // NULL unless the catalog is loaded lazily.
+};
+
+void catalog_init(struct catalog *catalog);
+void catalog_free(struct catalog *catalog);
+
+/*
+ * Initializes a lazily loaded catalog, which only stores the cells of the count columns in columns while the CSV file is read.
+ * Its other cells are parsed again with a parser set up like parser.
+ *
+ * @returns false on error
+ */
+bool catalog_init_lazy(struct catalog *catalog, struct csv_parser *parser, const size_t *columns, size_t count);
+
+/*
+ * Initializes catalog to read records the same way as other, lazily with the same columns if other is loaded lazily.
+ *
+ * @returns false on error
+ */
+bool catalog_init_like(struct catalog *catalog, const struct catalog *other);
+
+/*
+ * Marks the source before offset end as not part of any record, like the header.
+ */
+void catalog_skip_source(struct catalog *catalog, size_t end);
+
+/*
+ * Like catalog_end_record, for a lazily loaded catalog, where the record ends before offset end of the source.
+ *
+ * @returns false on error
+ */
+bool catalog_end_lazy_record(struct catalog *catalog, size_t end);
+
+/*
+ * Ends the source of a lazily loaded catalog, parsing cells never fails after this.
+ * The catalog takes over file, which has to be the mapped CSV file the records were read from,
+ * and closes it in catalog_free. The caller may not use file anymore.
+ *
+ * @returns false on error
+ */
+bool catalog_end_source(struct catalog *catalog, struct mapped_file *file);
+
+/*
+ * Parses the record row of a lazily loaded catalog to get a cell of a column which is not loaded.
+ * The cell stays valid until a cell of another record is parsed.
+ */
+const char *catalog_parse_cell(const struct catalog *catalog, size_t row, size_t column);
+
+/*
+ * Reads cells as they were read from the CSV file, parsing the records of a lazily loaded catalog itself.
+ * A thread with a reader of its own can read cells while another thread reads through catalog_cell.
+ */
+struct catalog_reader
+{
+    struct csv_parser parser;
+    // The cells of the record parsed last, each followed by a '\0'.
+    size_t parsed_row;      // SIZE_MAX if no record has been parsed yet.
+    bool parsed_row_ended;
+    char *cells;            // NULL if the catalog is not loaded lazily.
+    size_t cells_size;
+    size_t cells_capacity;
+    size_t *cell_offsets;
+    size_t cell_count;
+    size_t cell_offsets_capacity;
+};
+
+/*
+ * Initializes a reader for catalog, after catalog_end_source if it is loaded lazily.
+ *
+ * @returns false on error
+ */
+bool catalog_reader_init(struct catalog_reader *reader, const struct catalog *catalog);
+void catalog_reader_free(struct catalog_reader *reader);
+
+/*
+ * Like catalog_cell without the edited cells.
+ * The cell stays valid until reader reads a cell of another record.
+ */
+const char *catalog_read_cell(struct catalog_reader *reader, const struct catalog *catalog, size_t row, size_t column);
+
+/*
+ * Makes room for records more records, so reading them doesn't have to grow the catalog.
+ *
+ * @returns false on error
+ */
+bool catalog_reserve(struct catalog *catalog, size_t records);
+
+/*
+ * Appends a field to the record being read, the record is added by catalog_end_record.
+ *
+ * @returns false on error
+ */
+bool catalog_append_field(struct catalog *catalog, const char *data, size_t length);
+
+/*
+ * @returns false on error
+ */
+bool catalog_end_record(struct catalog *catalog);
+
+/*
+ * Appends copies of all records of other, which must not have edited cells.
+ * other has to be initialized by catalog_init_like from catalog, and neither catalog may be in the middle of a record.
+ * A lazily loaded other has to store where its records end in the same file as catalog.
+ * The records of catalog are left unchanged on error.
+ *
+ * @returns false on error
+ */
+bool catalog_append(struct catalog *catalog, const struct catalog *other);
+
+/*
+ * Adds empty columns until the catalog has count columns.
+ *
+ * @returns false on error
+ */
+bool catalog_add_columns(struct catalog *catalog, size_t count);
+
+/*
+ * Replaces a cell with a copy of text, extending the record with empty cells if it is shorter.
+ *
+ * @returns false on error
+ */
+bool catalog_set_cell(struct catalog *catalog, size_t row, size_t column, const char *text);
+
+/*
+ * Writes the records as they were read, without the edited cells.
+ *
+ * @returns false on error, or if the catalog is loaded lazily
+ */
+bool catalog_save_snapshot(const struct catalog *catalog, struct snapshot_writer *writer);
+
+/*
+ * Initializes catalog with the records written by catalog_save_snapshot.
+ * The records are used right where they are in the snapshot, which has to stay open until the catalog is freed.
+ * No records can be added to the catalog, its cells can be edited.
+ *
+ * @returns false on error, or if the snapshot is damaged
+ */
+bool catalog_load_snapshot(struct catalog *catalog, struct snapshot_reader *reader);
+
+/*
+ * Writes all edited cells.
+ *
+ * @returns false on error
+ */
+bool catalog_save_edits(const struct catalog *catalog, struct snapshot_writer *writer);
+
+/*
+ * Like catalog_save_edits, with the edited cells of column replaced by the non-NULL cells[row].
+ * The edited cells of column are not read, so they may change meanwhile.
+ *
+ * @returns false on error
+ */
+bool catalog_save_edits_replacing(const struct catalog *catalog, struct snapshot_writer *writer, size_t column, char *const *cells);
+
+/*
+ * Edits the cells written by catalog_save_edits again, only cells before column_limit are accepted.
+ *
+ * @returns false on error, or if the snapshot is damaged
+ */
+bool catalog_load_edits(struct catalog *catalog, struct snapshot_reader *reader, size_t column_limit);
+
+static inline const char *catalog_cell(const struct catalog *catalog, size_t row, size_t column)
+{
+    const struct catalog_column *current = catalog->columns + column;
+    if(current->edited != NULL && current->edited[row] != NULL) return current->edited[row];
+    if(current->offsets == NULL) return catalog_parse_cell(catalog, row, column);
+    return current->text + current->offsets[row];
+}
+
+static inline size_t catalog_column_count(const struct catalog *catalog, size_t row)
+{
+    return catalog->column_counts[row];
+}
+
+#endif
@@ -0,0 +1,211 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// fileno and fsync are not part of C11.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <csv.h>
+#include <safe_math.h>
+
+#include "count_journal.h"
+#include "mapped_file.h"
+
+#ifdef __unix__
+    #include <unistd.h>
+    #ifdef _POSIX_VERSION
+        #define POSIX
+    #endif
+#endif
+
+#define COUNT_JOURNAL_SUFFIX ".journal"
+#define COUNT_JOURNAL_FIELDS 5
+
+char *count_journal_path_of(const char *csv_path)
+{
+    size_t length = strlen(csv_path);
+    size_t size;
+    if(!psnip_safe_add(&size, length, sizeof(COUNT_JOURNAL_SUFFIX))) return NULL;
+    char *path = malloc(size);
+    if(path == NULL) return NULL;
+    memcpy(path, csv_path, length);
+    memcpy(path + length, COUNT_JOURNAL_SUFFIX, sizeof(COUNT_JOURNAL_SUFFIX));
+    return path;
+}
+
+/*
+ * The fields of the event being parsed while replaying.
+ */
+struct replay
+{
+    char *fields[COUNT_JOURNAL_FIELDS];
+    size_t capacities[COUNT_JOURNAL_FIELDS];
+    size_t count;
+    size_t damaged;
+    bool error;
+    count_journal_event_func event;
+    void *data;
+};
+
+static void replay_field_callback(void *data, size_t length, void *callback_data)
+{
+    struct replay *replay = callback_data;
+    size_t field = replay->count++;
+    if(replay->error || field >= COUNT_JOURNAL_FIELDS) return;
+    if(length >= replay->capacities[field])
+    {
+        char *tmp = realloc(replay->fields[field], length + 1);
+        if(tmp == NULL) { replay->error = true; return; }
+        replay->fields[field] = tmp;
+        replay->capacities[field] = length + 1;
+    }
+    memcpy(replay->fields[field], data, length);
+    replay->fields[field][length] = '\0';
+}
+
+static void replay_record_callback(int c, void *callback_data)
+{
+    struct replay *replay = callback_data;
+    size_t count = replay->count;
+    replay->count = 0;
+    if(replay->error) return;
+    if(count != COUNT_JOURNAL_FIELDS) { replay->damaged++; return; }
+    char *end;
+    errno = 0;
+    unsigned long long row = strtoull(replay->fields[0], &end, 10);
+    if(*end != '\0' || errno != 0 || row > SIZE_MAX) { replay->damaged++; return; }
+    replay->event((size_t) row, replay->fields[2], replay->fields[3], replay->fields[4], replay->data);
+}
+
+bool count_journal_replay(const char *path, count_journal_event_func event, void *data, size_t *damaged)
+{
+    *damaged = 0;
+    FILE *stream = fopen(path, "rb");
+    if(stream == NULL) return errno == ENOENT;
+    struct mapped_file file;
+    if(!mapped_file_open(&file, stream)) { fclose(stream); return false; }
+    struct csv_parser parser;
+    if(csv_init(&parser, 0) != 0) { mapped_file_close(&file); return false; }
+    csv_set_delim(&parser, CSV_COMMA);
+
+    struct replay replay;
+    memset(&replay, 0, sizeof(replay));
+    replay.event = event;
+    replay.data = data;
+    bool success = true;
+    while(success)
+    {
+        const char *chunk;
+        size_t chunk_size;
+        success = mapped_file_next_chunk(&file, &chunk, &chunk_size);
+        if(!success || chunk_size == 0) break;
+        success = csv_parse(&parser, chunk, chunk_size, replay_field_callback, replay_record_callback, &replay) == chunk_size && !replay.error;
+    }
+    // Not finishing the parser leaves out the last event if its line ending was never written.
+    csv_free(&parser);
+    mapped_file_close(&file);
+    for(size_t i = 0; i < COUNT_JOURNAL_FIELDS; i++) free(replay.fields[i]);
+    *damaged = replay.damaged;
+    return success;
+}
+
+bool count_journal_open(struct count_journal *journal, char *path, size_t sync_interval)
+{
+    journal->path = path;
+    journal->sync_interval = sync_interval;
+    journal->unsynced = 0;
+    journal->events = 0;
+    journal->torn = false;
+    journal->stream = fopen(path, "a+b");
+    if(journal->stream == NULL) { count_journal_close(journal); return false; }
+    // An event left partly written by a crash is not appended to.
+    if(fseek(journal->stream, -1, SEEK_END) == 0)
+    {
+        journal->torn = fgetc(journal->stream) != '\n';
+    }
+    // Switching from reading to writing needs a seek in between.
+    if(fseek(journal->stream, 0, SEEK_END) != 0) { count_journal_close(journal); return false; }
+    return true;
+}
+
+static bool write_field(FILE *stream, const char *text)
+{
+    return csv_fwrite(stream, text, strlen(text)) != EOF;
+}
+
+static bool sync_journal(struct count_journal *journal)
+{
+    if(fflush(journal->stream) != 0) return false;
+#ifdef POSIX
+    if(fsync(fileno(journal->stream)) != 0) return false;
+#endif
+    journal->unsynced = 0;
+    return true;
+}
+
+bool count_journal_append(struct count_journal *journal, size_t row, const char *barcode, const char *old_amount, const char *new_amount)
+{
+    if(journal->stream == NULL) return false;
+    // If the last event was only partly written, it ends up on a line of its own.
+    bool written = (!journal->torn || fputc('\n', journal->stream) != EOF)
+        && fprintf(journal->stream, "%llu,%lld,", (unsigned long long) row, (long long) time(NULL)) >= 0
+        && write_field(journal->stream, barcode) && fputc(',', journal->stream) != EOF
+        && write_field(journal->stream, old_amount) && fputc(',', journal->stream) != EOF
+        && write_field(journal->stream, new_amount) && fputc('\n', journal->stream) != EOF;
+    if(!written) { journal->torn = true; return false; }
+    journal->events++;
+    journal->unsynced++;
+    bool flushed = journal->sync_interval > 0 && journal->unsynced >= journal->sync_interval ? sync_journal(journal) : fflush(journal->stream) == 0;
+    // Part of the event may still be waiting to be written.
+    journal->torn = !flushed;
+    return flushed;
+}
+
+bool count_journal_clear(struct count_journal *journal)
+{
+    if(journal->stream != NULL) fclose(journal->stream);
+    journal->stream = fopen(journal->path, "wb");
+    journal->unsynced = 0;
+    journal->events = 0;
+    journal->torn = false;
+    return journal->stream != NULL;
+}
+
+void count_journal_remove(struct count_journal *journal)
+{
+    if(journal->path != NULL)
+    {
+        if(journal->stream != NULL) fclose(journal->stream);
+        journal->stream = NULL;
+        remove(journal->path);
+    }
+    count_journal_close(journal);
+}
+
+void count_journal_close(struct count_journal *journal)
+{
+    if(journal->stream != NULL) fclose(journal->stream);
+    journal->stream = NULL;
+    free(journal->path);
+    journal->path = NULL;
+}
@@ -0,0 +1,88 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VOORRAADTELLEN_COUNT_JOURNAL_H
+#define VOORRAADTELLEN_COUNT_JOURNAL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Append-only log of counted amounts, stored next to the CSV file they belong to.
+ * Counting only appends a line to the journal, the CSV file is brought up to date
+ * now and then by compacting, after which the journal is cleared.
+ * A journal left behind by a crash is replayed on the next start.
+ *
+ * Every event is a CSV record of the record index, the time, the barcode, the old and the new amount.
+ * An event which was only partly written has no line ending. It is ignored if it is the last line,
+ * otherwise the next event starts on a new line after it, and it is skipped as a damaged event.
+ */
+struct count_journal
+{
+    FILE *stream;       // NULL if the journal is not open.
+    char *path;
+    size_t sync_interval;   // The journal is synced to disk after this many events, or never if 0.
+    size_t unsynced;
+    size_t events;      // Events appended since the journal was last cleared.
+    bool torn;          // The journal ends in a partly written event, the next event starts on a new line.
+};
+
+typedef void (*count_journal_event_func)(size_t row, const char *barcode, const char *old_amount, const char *new_amount, void *data);
+
+/*
+ * @returns the path of the journal belonging to csv_path, or NULL on error
+ */
+char *count_journal_path_of(const char *csv_path);
+
+/*
+ * Calls event for every complete event in the journal at path, in order, and sets *damaged to the amount of damaged events skipped.
+ * No journal at path counts as an empty one.
+ *
+ * @returns false on error
+ */
+bool count_journal_replay(const char *path, count_journal_event_func event, void *data, size_t *damaged);
+
+/*
+ * Opens the journal at path to append events, creating it if there is none.
+ * path is owned by the journal after this.
+ *
+ * @returns false on error, with the journal closed
+ */
+bool count_journal_open(struct count_journal *journal, char *path, size_t sync_interval);
+
+/*
+ * @returns false on error
+ */
+bool count_journal_append(struct count_journal *journal, size_t row, const char *barcode, const char *old_amount, const char *new_amount);
+
+/*
+ * Removes all events, after they have been saved to the CSV file.
+ *
+ * @returns false on error, no events can be appended then
+ */
+bool count_journal_clear(struct count_journal *journal);
+
+/*
+ * Closes the journal and removes its file, once all events have been saved to the CSV file.
+ */
+void count_journal_remove(struct count_journal *journal);
+
+void count_journal_close(struct count_journal *journal);
+
+#endif
@@ -0,0 +1,297 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <csv.h>
+
+#include "csv_sniffer.h"
+#include "folded_text.h"
+
+// Only the first records of the sample are looked at, and only their first columns.
+#define SNIFF_ROWS_MAX 200
+#define SNIFF_COLUMNS_MAX 256
+
+static const unsigned char delimiters[] = { ';', ',', '\t', '|' };
+
+/*
+ * The sample without the record it ends in the middle of, if it holds more than one line.
+ */
+static size_t complete_lines(const char *sample, size_t size)
+{
+    for(size_t i = size; i > 0; i--)
+    {
+        if(sample[i - 1] == '\n') return i;
+    }
+    return size;
+}
+
+/*
+ * @returns false on error
+ */
+static bool sniff_parse(const char *sample, size_t size, unsigned char delim, unsigned char quote,
+        void (*field_callback)(void *, size_t, void *), void (*record_callback)(int, void *), void *data)
+{
+    struct csv_parser parser;
+    if(csv_init(&parser, 0) != 0) return false;
+    csv_set_delim(&parser, delim);
+    csv_set_quote(&parser, quote);
+    size_t bytes_processed = csv_parse(&parser, sample, size, field_callback, record_callback, data);
+    csv_fini(&parser, field_callback, record_callback, data);
+    csv_free(&parser);
+    return bytes_processed == size;
+}
+
+/*
+ * How many fields the records have with one delimiter.
+ */
+struct record_shapes
+{
+    size_t rows;
+    size_t fields;
+    size_t counts[SNIFF_COLUMNS_MAX + 1];   // counts[n] is the amount of records with n fields, the last one counts longer records too.
+};
+
+static void shape_field_callback(void *data, size_t length, void *callback_data)
+{
+    struct record_shapes *shapes = callback_data;
+    shapes->fields++;
+}
+
+static void shape_record_callback(int c, void *callback_data)
+{
+    struct record_shapes *shapes = callback_data;
+    if(shapes->rows < SNIFF_ROWS_MAX)
+    {
+        shapes->counts[(shapes->fields < SNIFF_COLUMNS_MAX) ? shapes->fields : SNIFF_COLUMNS_MAX]++;
+        shapes->rows++;
+    }
+    shapes->fields = 0;
+}
+
+/*
+ * Counts the fields in sample which start and end with quote.
+ */
+static size_t quoted_fields(const char *sample, size_t size, unsigned char delim, unsigned char quote)
+{
+    size_t count = 0;
+    for(size_t i = 0; i + 1 < size; i++)
+    {
+        if(sample[i] != (char) quote) continue;
+        bool opens = (i == 0 || sample[i - 1] == (char) delim || sample[i - 1] == '\n');
+        if(!opens) continue;
+        const char *end = memchr(sample + i + 1, quote, size - i - 1);
+        if(end == NULL) break;
+        size_t after = (size_t) (end - sample) + 1;
+        if(after == size || sample[after] == (char) delim || sample[after] == '\n' || sample[after] == '\r') count++;
+        i = after - 1;
+    }
+    return count;
+}
+
+bool csv_sniff_dialect(const char *sample, size_t size, struct csv_dialect *dialect)
+{
+    size = complete_lines(sample, size);
+    size_t best_consistent = 0;
+    size_t best_fields = 0;
+    bool found = false;
+    struct record_shapes *shapes = malloc(sizeof(struct record_shapes));
+    if(shapes == NULL) return false;
+    for(size_t i = 0; i < sizeof(delimiters); i++)
+    {
+        memset(shapes, 0, sizeof(struct record_shapes));
+        if(!sniff_parse(sample, size, delimiters[i], CSV_QUOTE, shape_field_callback, shape_record_callback, shapes)) continue;
+
+        // The delimiter should split most records into the same amount of fields, more than one.
+        size_t fields = 0;
+        for(size_t n = 2; n <= SNIFF_COLUMNS_MAX; n++)
+        {
+            if(shapes->counts[n] > shapes->counts[fields]) fields = n;
+        }
+        if(fields == 0) continue;
+        size_t consistent = shapes->counts[fields];
+        if(consistent * 10 < shapes->rows * 8) continue;
+        if(consistent > best_consistent || (consistent == best_consistent && fields > best_fields))
+        {
+            best_consistent = consistent;
+            best_fields = fields;
+            dialect->delim = delimiters[i];
+            found = true;
+        }
+    }
+    free(shapes);
+    if(!found) return false;
+
+    // Single quotes only quote fields if double quotes never do, they also show up in text a lot.
+    dialect->quote = CSV_QUOTE;
+    if(quoted_fields(sample, size, dialect->delim, CSV_QUOTE) == 0 && quoted_fields(sample, size, dialect->delim, '\'') > 0) dialect->quote = '\'';
+    return true;
+}
+
+/*
+ * What the cells of the first records say about their columns.
+ */
+struct column_stats
+{
+    size_t filled;      // Non-empty cells, after the first record.
+    size_t gtins;
+    size_t integers;
+    size_t numbers;
+    bool first_number;  // Whether the cell in the first record is a number.
+    bool first_named;   // Whether the cell in the first record names an amount.
+};
+
+struct column_sniffer
+{
+    size_t row;
+    size_t field;
+    struct column_stats columns[SNIFF_COLUMNS_MAX];
+};
+
+static bool is_gtin(const char *text, size_t length)
+{
+    if(length != 8 && length != 12 && length != 13 && length != 14) return false;
+    // The digits are weighted 3 and 1 alternately from the right, the check digit included with weight 1.
+    unsigned int sum = 0;
+    for(size_t i = 0; i < length; i++)
+    {
+        if(!isdigit((unsigned char) text[i])) return false;
+        unsigned int digit = (unsigned int) (text[i] - '0');
+        sum += ((length - i) % 2 == 0) ? digit * 3 : digit;
+    }
+    return sum % 10 == 0;
+}
+
+/*
+ * Whether text is a number, with an optional sign and a decimal point or comma.
+ * Sets *integer to whether it has no decimals.
+ */
+static bool is_number(const char *text, size_t length, bool *integer)
+{
+    size_t i = 0;
+    if(i < length && (text[i] == '-' || text[i] == '+')) i++;
+    size_t digits = 0;
+    bool separated = false;
+    for(; i < length; i++)
+    {
+        if(isdigit((unsigned char) text[i])) digits++;
+        else if((text[i] == '.' || text[i] == ',') && !separated) separated = true;
+        else return false;
+    }
+    *integer = !separated;
+    return digits > 0;
+}
+
+static bool names_amount(const char *text, size_t length)
+{
+    static const char *names[] = { "aantal", "voorraad", "stock", "qty", "quantity", "amount", "count" };
+    char folded[32];
+    if(length >= sizeof(folded)) return false;
+    for(size_t i = 0; i < length; i++) folded[i] = (char) fold_char((unsigned char) text[i]);
+    folded[length] = '\0';
+    for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        char name[32];
+        size_t name_length = strlen(names[i]);
+        for(size_t j = 0; j <= name_length; j++) name[j] = (char) fold_char((unsigned char) names[i][j]);
+        if(strstr(folded, name) != NULL) return true;
+    }
+    return false;
+}
+
+static void column_field_callback(void *data, size_t length, void *callback_data)
+{
+    struct column_sniffer *sniffer = callback_data;
+    size_t field = sniffer->field++;
+    if(sniffer->row >= SNIFF_ROWS_MAX || field >= SNIFF_COLUMNS_MAX) return;
+    struct column_stats *column = sniffer->columns + field;
+    const char *text = data;
+    bool integer;
+    bool number = is_number(text, length, &integer);
+    if(sniffer->row == 0)
+    {
+        column->first_number = number;
+        column->first_named = names_amount(text, length);
+        return;
+    }
+    if(length == 0) return;
+    column->filled++;
+    if(is_gtin(text, length)) column->gtins++;
+    if(number) column->numbers++;
+    if(number && integer) column->integers++;
+}
+
+static void column_record_callback(int c, void *callback_data)
+{
+    struct column_sniffer *sniffer = callback_data;
+    sniffer->row++;
+    sniffer->field = 0;
+}
+
+bool csv_sniff_columns(const char *sample, size_t size, struct csv_dialect *dialect)
+{
+    size = complete_lines(sample, size);
+    struct column_sniffer *sniffer = calloc(1, sizeof(struct column_sniffer));
+    if(sniffer == NULL) return false;
+    if(!sniff_parse(sample, size, dialect->delim, dialect->quote, column_field_callback, column_record_callback, sniffer)) { free(sniffer); return false; }
+
+    // The first record is a header if it has text where the other records have numbers, or if no column has numbers at all.
+    bool numeric_columns = false;
+    dialect->has_header = false;
+    for(size_t i = 0; i < SNIFF_COLUMNS_MAX; i++)
+    {
+        const struct column_stats *column = sniffer->columns + i;
+        if(column->filled == 0 || column->numbers * 2 < column->filled) continue;
+        numeric_columns = true;
+        if(!column->first_number) dialect->has_header = true;
+    }
+    if(!numeric_columns) dialect->has_header = true;
+
+    // Without a header the first record holds data, but the other records are plenty to tell the columns apart.
+    dialect->barcode_found = false;
+    for(size_t i = 0; i < SNIFF_COLUMNS_MAX; i++)
+    {
+        const struct column_stats *column = sniffer->columns + i;
+        if(column->gtins == 0 || column->gtins * 2 < column->filled) continue;
+        if(dialect->barcode_found && column->gtins <= sniffer->columns[dialect->barcode_column].gtins) continue;
+        dialect->barcode_column = i;
+        dialect->barcode_found = true;
+    }
+
+    // Of the columns of whole numbers, one named like an amount wins, then the one with the most whole numbers.
+    dialect->amount_found = false;
+    for(size_t i = 0; i < SNIFF_COLUMNS_MAX; i++)
+    {
+        const struct column_stats *column = sniffer->columns + i;
+        if(dialect->barcode_found && i == dialect->barcode_column) continue;
+        if(column->filled == 0 || column->integers * 10 < column->filled * 8) continue;
+        if(dialect->amount_found)
+        {
+            const struct column_stats *best = sniffer->columns + dialect->amount_column;
+            bool named = dialect->has_header && column->first_named;
+            bool best_named = dialect->has_header && best->first_named;
+            if(named != best_named ? !named : column->integers <= best->integers) continue;
+        }
+        dialect->amount_column = i;
+        dialect->amount_found = true;
+    }
+    free(sniffer);
+    return true;
+}
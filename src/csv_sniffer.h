@@ -0,0 +1,58 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VOORRAADTELLEN_CSV_SNIFFER_H
+#define VOORRAADTELLEN_CSV_SNIFFER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Amount of bytes at the start of a CSV file which are sniffed.
+#define CSV_SNIFFER_SAMPLE_SIZE (64 * 1024)
+
+/*
+ * What the first part of a CSV file looks like, so the user only has to confirm it.
+ */
+struct csv_dialect
+{
+    unsigned char delim;
+    unsigned char quote;
+    bool has_header;        // Whether the first record looks like column names rather than data.
+    bool barcode_found;
+    size_t barcode_column;  // The column whose cells are GTIN barcodes with a valid check digit, if found.
+    bool amount_found;
+    size_t amount_column;   // The column whose cells are whole numbers, if found.
+};
+
+/*
+ * Guesses the delimiter and quote character of the CSV data in sample,
+ * which may end in the middle of a record.
+ *
+ * @returns false if no delimiter splits the records consistently
+ */
+bool csv_sniff_dialect(const char *sample, size_t size, struct csv_dialect *dialect);
+
+/*
+ * Guesses whether there is a header, and which columns hold the barcodes and amounts,
+ * parsing sample with the delimiter and quote character of dialect.
+ *
+ * @returns false on error
+ */
+bool csv_sniff_columns(const char *sample, size_t size, struct csv_dialect *dialect);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <safe_math.h>
+
+#include "folded_text.h"
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+    #if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        #include <immintrin.h>
+        #define HAVE_AVX2_KERNEL
+    #endif
+#endif
+
+typedef const char *(*find_func)(const char *haystack, size_t haystack_size, const char *needle, size_t needle_size);
+
+// Chosen once in folded_text_build, depending on what the CPU supports.
+static find_func find_substring;
+
+/*
+ * All find functions first look for positions where both the first and the last byte
+ * of the needle match, and only then compare the bytes in between.
+ */
+static const char *find_scalar(const char *haystack, size_t haystack_size, const char *needle, size_t needle_size)
+{
+    if(needle_size > haystack_size) return NULL;
+    const char *last_start = haystack + (haystack_size - needle_size);
+    const char *current = haystack;
+    while(current <= last_start)
+    {
+        current = memchr(current, needle[0], (size_t) (last_start - current) + 1);
+        if(current == NULL) return NULL;
+        if(current[needle_size - 1] == needle[needle_size - 1] && memcmp(current + 1, needle + 1, (needle_size > 2) ? needle_size - 2 : 0) == 0) return current;
+        current++;
+    }
+    return NULL;
+}
+
+#if defined(__SSE2__)
+static unsigned int count_trailing_zeroes(uint32_t mask)
+{
+    #if defined(__GNUC__)
+        return (unsigned int) __builtin_ctz(mask);
+    #else
+        unsigned int count = 0;
+        while((mask & 1) == 0) { mask >>= 1; count++; }
+        return count;
+    #endif
+}
+
+static const char *find_sse2(const char *haystack, size_t haystack_size, const char *needle, size_t needle_size)
+{
+    if(needle_size > haystack_size) return NULL;
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_size - 1]);
+    size_t middle_size = (needle_size > 2) ? needle_size - 2 : 0;
+
+    size_t i = 0;
+    for(; haystack_size - i >= 16 + needle_size - 1; i += 16)
+    {
+        __m128i first_block = _mm_loadu_si128((const __m128i *) (haystack + i));
+        __m128i last_block = _mm_loadu_si128((const __m128i *) (haystack + i + needle_size - 1));
+        uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first_block, first), _mm_cmpeq_epi8(last_block, last)));
+        while(mask != 0)
+        {
+            unsigned int bit = count_trailing_zeroes(mask);
+            if(memcmp(haystack + i + bit + 1, needle + 1, middle_size) == 0) return haystack + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return find_scalar(haystack + i, haystack_size - i, needle, needle_size);
+}
+#endif
+
+#if defined(HAVE_AVX2_KERNEL)
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *haystack, size_t haystack_size, const char *needle, size_t needle_size)
+{
+    if(needle_size > haystack_size) return NULL;
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_size - 1]);
+    size_t middle_size = (needle_size > 2) ? needle_size - 2 : 0;
+
+    size_t i = 0;
+    for(; haystack_size - i >= 32 + needle_size - 1; i += 32)
+    {
+        __m256i first_block = _mm256_loadu_si256((const __m256i *) (haystack + i));
+        __m256i last_block = _mm256_loadu_si256((const __m256i *) (haystack + i + needle_size - 1));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first_block, first), _mm256_cmpeq_epi8(last_block, last)));
+        while(mask != 0)
+        {
+            unsigned int bit = count_trailing_zeroes(mask);
+            if(memcmp(haystack + i + bit + 1, needle + 1, middle_size) == 0) return haystack + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return find_sse2(haystack + i, haystack_size - i, needle, needle_size);
+}
+#endif
+
+static find_func choose_find_func(void)
+{
+    #if defined(HAVE_AVX2_KERNEL)
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2")) return find_avx2;
+    #endif
+    #if defined(__SSE2__)
+        return find_sse2;
+    #else
+        return find_scalar;
+    #endif
+}
+
+bool folded_text_build(struct folded_text *folded, const struct catalog *catalog)
+{
+    folded->columns = NULL;
+    folded->column_count = 0;
+    folded->records_size = catalog->records_size;
+    find_substring = choose_find_func();
+    if(catalog->column_count == 0) return true;
+
+    size_t size;
+    if(!psnip_safe_mul(&size, catalog->column_count, sizeof(struct folded_column))) return false;
+    folded->columns = malloc(size);
+    if(folded->columns == NULL) return false;
+
+    // The catalog already stores every column as '\0' separated cells, so folding its text is enough.
+    for(size_t column = 0; column < catalog->column_count; column++)
+    {
+        const struct catalog_column *source = catalog->columns + column;
+        struct folded_column *current = folded->columns + column;
+        current->text = malloc(source->text_size);
+        if(current->text == NULL) { folded_text_free(folded); return false; }
+        current->starts = source->offsets;
+        current->text_size = source->text_size;
+        folded->column_count++;
+        for(size_t i = 0; i < source->text_size; i++) current->text[i] = (char) fold_char((unsigned char) source->text[i]);
+    }
+    return true;
+}
+
+/*
+ * Finds the record containing offset, searching forward from record row.
+ * starts[row] <= offset must hold.
+ */
+static size_t locate_record(const size_t *starts, size_t records_size, size_t offset, size_t row)
+{
+    // Gallop forward, matches tend to be close to the previous one.
+    size_t step = 1;
+    while(row + step < records_size && starts[row + step] <= offset)
+    {
+        row += step;
+        step *= 2;
+    }
+    size_t high = (row + step < records_size) ? row + step : records_size;
+    while(high - row > 1)
+    {
+        size_t middle = row + (high - row) / 2;
+        if(starts[middle] <= offset) row = middle; else high = middle;
+    }
+    return row;
+}
+
+bool folded_text_search(const struct folded_text *folded, const char *query, uint8_t *matched)
+{
+    size_t needle_size = strlen(query);
+    if(needle_size == 0)
+    {
+        memset(matched, 1, folded->records_size);
+        return true;
+    }
+    char *needle = malloc(needle_size);
+    if(needle == NULL) return false;
+    for(size_t i = 0; i < needle_size; i++) needle[i] = (char) fold_char((unsigned char) query[i]);
+
+    for(size_t column = 0; column < folded->column_count; column++)
+    {
+        const struct folded_column *current = folded->columns + column;
+        size_t row = 0;
+        size_t position = 0;
+        while(position < current->text_size)
+        {
+            const char *found = find_substring(current->text + position, current->text_size - position, needle, needle_size);
+            if(found == NULL) break;
+            row = locate_record(current->starts, folded->records_size, (size_t) (found - current->text), row);
+            matched[row] = 1;
+            // The rest of this cell doesn't matter anymore.
+            position = (row + 1 < folded->records_size) ? current->starts[row + 1] : current->text_size;
+        }
+    }
+    free(needle);
+    return true;
+}
+
+void folded_text_free(struct folded_text *folded)
+{
+    for(size_t i = 0; i < folded->column_count; i++)
+    {
+        free(folded->columns[i].text);
+    }
+    free(folded->columns);
+    folded->columns = NULL;
+    folded->column_count = 0;
+}
@@ -0,0 +1,68 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VOORRAADTELLEN_FOLDED_TEXT_H
+#define VOORRAADTELLEN_FOLDED_TEXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "catalog.h"
+
+/*
+ * Case-folded copy of all text in the catalog, laid out exactly like the catalog's columns.
+ * Every cell is followed by a '\0', so a substring match never spans two records.
+ * Cells edited after building are not part of it.
+ */
+struct folded_column
+{
+    char *text;
+    const size_t *starts; // starts[i] is the offset of record i's cell in text, owned by the catalog.
+    size_t text_size;
+};
+
+struct folded_text
+{
+    struct folded_column *columns;
+    size_t column_count;
+    size_t records_size;
+};
+
+// Case folding used for searching, only ASCII letters are folded.
+static inline unsigned char fold_char(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') ? (unsigned char) (c - 'A' + 'a') : c;
+}
+
+/*
+ * @returns false on error
+ */
+bool folded_text_build(struct folded_text *folded, const struct catalog *catalog);
+
+/*
+ * Sets matched[i] to 1 for every record i containing query (case-insensitive) in any column.
+ * Other elements of matched are left alone.
+ *
+ * @returns false on error
+ */
+bool folded_text_search(const struct folded_text *folded, const char *query, uint8_t *matched);
+
+void folded_text_free(struct folded_text *folded);
+
+#endif
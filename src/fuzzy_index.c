@@ -0,0 +1,538 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <safe_math.h>
+
+#include "fuzzy_index.h"
+#include "folded_text.h"
+
+#define NO_NODE UINT32_MAX
+#define EMPTY_SLOT UINT32_MAX
+
+struct fuzzy_index_node
+{
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t distance; // Edit distance to the parent's word.
+};
+
+// Words are split on anything but ASCII letters and digits, bytes of UTF-8 sequences are kept in the word.
+static bool is_word_char(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+bool fuzzy_index_next_word(const char *str, size_t *position, const char **word, size_t *length)
+{
+    const unsigned char *s = (const unsigned char *) str;
+    size_t i = *position;
+    while(true)
+    {
+        while(s[i] != '\0' && !is_word_char(s[i])) i++;
+        if(s[i] == '\0') { *position = i; return false; }
+        size_t start = i;
+        bool digits_only = true;
+        while(is_word_char(s[i]))
+        {
+            if(s[i] < '0' || s[i] > '9') digits_only = false;
+            i++;
+        }
+        if(digits_only || i - start > FUZZY_INDEX_MAX_WORD_LENGTH) continue;
+        *word = str + start;
+        *length = i - start;
+        *position = i;
+        return true;
+    }
+}
+
+// 64-bit FNV-1a of the case-folded word.
+static uint64_t hash_word(const char *word, size_t length)
+{
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for(size_t i = 0; i < length; i++)
+    {
+        hash ^= fold_char((unsigned char) word[i]);
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+static bool word_equals(const char *folded, const char *word, size_t length)
+{
+    for(size_t i = 0; i < length; i++)
+    {
+        if(folded[i] != (char) fold_char((unsigned char) word[i])) return false;
+    }
+    return folded[length] == '\0';
+}
+
+/*
+ * Levenshtein distance between two words of at most FUZZY_INDEX_MAX_WORD_LENGTH characters.
+ */
+static uint32_t edit_distance(const char *a, size_t a_length, const char *b, size_t b_length)
+{
+    uint8_t previous[FUZZY_INDEX_MAX_WORD_LENGTH + 1];
+    uint8_t current[FUZZY_INDEX_MAX_WORD_LENGTH + 1];
+    for(size_t j = 0; j <= b_length; j++) previous[j] = (uint8_t) j;
+    for(size_t i = 1; i <= a_length; i++)
+    {
+        current[0] = (uint8_t) i;
+        for(size_t j = 1; j <= b_length; j++)
+        {
+            uint8_t substitution = previous[j - 1] + (a[i - 1] != b[j - 1]);
+            uint8_t deletion = previous[j] + 1;
+            uint8_t insertion = current[j - 1] + 1;
+            uint8_t best = (substitution < deletion) ? substitution : deletion;
+            current[j] = (insertion < best) ? insertion : best;
+        }
+        memcpy(previous, current, b_length + 1);
+    }
+    return previous[b_length];
+}
+
+/*
+ * Edit distance where swapping two adjacent characters also counts as one edit (optimal string alignment).
+ * Swapped characters are the most common typo, but this distance breaks the triangle inequality the BK-tree relies on,
+ * so it is only used to check the words found with the plain edit distance.
+ */
+static uint32_t typo_distance(const char *a, size_t a_length, const char *b, size_t b_length)
+{
+    uint8_t rows[3][FUZZY_INDEX_MAX_WORD_LENGTH + 1];
+    uint8_t *before = rows[0];
+    uint8_t *previous = rows[1];
+    uint8_t *current = rows[2];
+    for(size_t j = 0; j <= b_length; j++) previous[j] = (uint8_t) j;
+    for(size_t i = 1; i <= a_length; i++)
+    {
+        current[0] = (uint8_t) i;
+        for(size_t j = 1; j <= b_length; j++)
+        {
+            uint8_t substitution = previous[j - 1] + (a[i - 1] != b[j - 1]);
+            uint8_t deletion = previous[j] + 1;
+            uint8_t insertion = current[j - 1] + 1;
+            uint8_t best = (substitution < deletion) ? substitution : deletion;
+            if(insertion < best) best = insertion;
+            if(i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1] && before[j - 2] + 1 < best) best = before[j - 2] + 1;
+            current[j] = best;
+        }
+        uint8_t *tmp = before;
+        before = previous;
+        previous = current;
+        current = tmp;
+    }
+    return previous[b_length];
+}
+
+size_t fuzzy_index_max_distance(size_t word_length)
+{
+    if(word_length <= 2) return 0;
+    if(word_length <= 5) return 1;
+    return 2;
+}
+
+/*
+ * Grows *array of *capacity elements of element_size to hold at least needed elements.
+ *
+ * @returns false on error
+ */
+static bool reserve(void **array, size_t *capacity, size_t needed, size_t element_size)
+{
+    if(needed <= *capacity) return true;
+    size_t new_capacity = (*capacity == 0) ? 1024 : *capacity;
+    while(new_capacity < needed)
+    {
+        if(!psnip_safe_mul(&new_capacity, new_capacity, 2)) return false;
+    }
+    size_t size;
+    if(!psnip_safe_mul(&size, new_capacity, element_size)) return false;
+    void *tmp = realloc(*array, size);
+    if(tmp == NULL) return false;
+    *array = tmp;
+    *capacity = new_capacity;
+    return true;
+}
+
+struct word_count
+{
+    uint32_t count;
+    uint32_t last_row; // Last record + 1 counted for this word, so every record is counted once.
+};
+
+/*
+ * State only needed while building the index.
+ */
+struct builder
+{
+    struct fuzzy_index *index;
+    size_t words_capacity;
+    size_t starts_capacity;
+    size_t words_used;
+
+    // Hash table from word to word number.
+    uint32_t *slots;
+    size_t slots_capacity; // Always a power of two.
+    uint64_t *hashes; // hashes[i] is the hash of word i.
+    size_t hashes_capacity;
+
+    struct word_count *counts;
+    size_t counts_capacity;
+};
+
+static const char *word_of(const struct fuzzy_index *index, uint32_t id, size_t *length)
+{
+    *length = index->word_starts[id + 1] - index->word_starts[id] - 1;
+    return index->words + index->word_starts[id];
+}
+
+static size_t find_word_slot(const struct builder *builder, uint64_t hash, const char *word, size_t length)
+{
+    size_t mask = builder->slots_capacity - 1;
+    size_t slot = (size_t) hash & mask;
+    while(builder->slots[slot] != EMPTY_SLOT)
+    {
+        uint32_t id = builder->slots[slot];
+        if(builder->hashes[id] == hash && word_equals(builder->index->words + builder->index->word_starts[id], word, length)) break;
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static bool grow_slots(struct builder *builder)
+{
+    size_t capacity;
+    size_t size;
+    if(!psnip_safe_mul(&capacity, builder->slots_capacity, 2) || !psnip_safe_mul(&size, capacity, sizeof(uint32_t))) return false;
+    uint32_t *slots = malloc(size);
+    if(slots == NULL) return false;
+    for(size_t i = 0; i < capacity; i++) slots[i] = EMPTY_SLOT;
+    size_t mask = capacity - 1;
+    for(size_t id = 0; id < builder->index->words_size; id++)
+    {
+        size_t slot = (size_t) builder->hashes[id] & mask;
+        while(slots[slot] != EMPTY_SLOT) slot = (slot + 1) & mask;
+        slots[slot] = (uint32_t) id;
+    }
+    free(builder->slots);
+    builder->slots = slots;
+    builder->slots_capacity = capacity;
+    return true;
+}
+
+/*
+ * @returns the word number of word, adding it if it's new, or UINT32_MAX on error.
+ */
+static uint32_t intern_word(struct builder *builder, const char *word, size_t length)
+{
+    struct fuzzy_index *index = builder->index;
+    uint64_t hash = hash_word(word, length);
+    size_t slot = find_word_slot(builder, hash, word, length);
+    if(builder->slots[slot] != EMPTY_SLOT) return builder->slots[slot];
+    if(index->words_size >= UINT32_MAX - 1) return UINT32_MAX;
+
+    size_t needed;
+    if(!psnip_safe_add(&needed, builder->words_used, length + 1)) return UINT32_MAX;
+    if(!reserve((void **) &index->words, &builder->words_capacity, needed, 1)) return UINT32_MAX;
+    if(!reserve((void **) &index->word_starts, &builder->starts_capacity, index->words_size + 2, sizeof(size_t))) return UINT32_MAX;
+    if(!reserve((void **) &builder->hashes, &builder->hashes_capacity, index->words_size + 1, sizeof(uint64_t))) return UINT32_MAX;
+    size_t counts_capacity = builder->counts_capacity;
+    if(!reserve((void **) &builder->counts, &builder->counts_capacity, index->words_size + 1, sizeof(struct word_count))) return UINT32_MAX;
+    memset(builder->counts + counts_capacity, 0, (builder->counts_capacity - counts_capacity) * sizeof(struct word_count));
+
+    uint32_t id = (uint32_t) index->words_size;
+    index->word_starts[id] = builder->words_used;
+    for(size_t i = 0; i < length; i++) index->words[builder->words_used++] = (char) fold_char((unsigned char) word[i]);
+    index->words[builder->words_used++] = '\0';
+    index->word_starts[id + 1] = builder->words_used;
+    builder->hashes[id] = hash;
+    builder->slots[slot] = id;
+    index->words_size++;
+
+    if(index->words_size > builder->slots_capacity / 2 && !grow_slots(builder)) return UINT32_MAX;
+    return id;
+}
+
+static void insert_node(struct fuzzy_index *index, uint32_t id)
+{
+    size_t length;
+    const char *word = word_of(index, id, &length);
+    index->nodes[id].first_child = NO_NODE;
+    index->nodes[id].next_sibling = NO_NODE;
+
+    uint32_t node = 0;
+    while(true)
+    {
+        size_t node_length;
+        const char *node_word = word_of(index, node, &node_length);
+        uint32_t distance = edit_distance(word, length, node_word, node_length);
+        uint32_t child = index->nodes[node].first_child;
+        while(child != NO_NODE && index->nodes[child].distance != distance) child = index->nodes[child].next_sibling;
+        if(child == NO_NODE)
+        {
+            index->nodes[id].distance = distance;
+            index->nodes[id].next_sibling = index->nodes[node].first_child;
+            index->nodes[node].first_child = id;
+            return;
+        }
+        node = child;
+    }
+}
+
+bool fuzzy_index_build(struct fuzzy_index *index, const struct catalog *catalog, size_t skip_column)
+{
+    size_t records_size = catalog->records_size;
+    memset(index, 0, sizeof(struct fuzzy_index));
+    if(records_size >= UINT32_MAX) return false;
+
+    struct builder builder;
+    memset(&builder, 0, sizeof(struct builder));
+    builder.index = index;
+    builder.slots_capacity = 4096;
+    builder.slots = malloc(builder.slots_capacity * sizeof(uint32_t));
+    if(builder.slots == NULL) return false;
+    for(size_t i = 0; i < builder.slots_capacity; i++) builder.slots[i] = EMPTY_SLOT;
+
+    // First pass: collect all words and count the records containing each.
+    for(size_t row = 0; row < records_size; row++)
+    {
+        for(size_t column = 0; column < catalog_column_count(catalog, row); column++)
+        {
+            if(column == skip_column) continue;
+            size_t position = 0;
+            const char *word;
+            size_t length;
+            while(fuzzy_index_next_word(catalog_cell(catalog, row, column), &position, &word, &length))
+            {
+                uint32_t id = intern_word(&builder, word, length);
+                if(id == UINT32_MAX) goto error;
+                if(builder.counts[id].last_row != row + 1)
+                {
+                    builder.counts[id].last_row = (uint32_t) row + 1;
+                    builder.counts[id].count++;
+                }
+            }
+        }
+    }
+    if(index->words_size == 0) goto done;
+
+    size_t size;
+    if(!psnip_safe_add(&size, index->words_size, 1) || !psnip_safe_mul(&size, size, sizeof(size_t))) goto error;
+    index->posting_starts = malloc(size);
+    if(index->posting_starts == NULL) goto error;
+    size_t postings_size = 0;
+    for(size_t id = 0; id < index->words_size; id++)
+    {
+        index->posting_starts[id] = postings_size;
+        postings_size += builder.counts[id].count; // Can't overflow, there are fewer postings than characters in the catalog.
+        builder.counts[id].count = 0;
+        builder.counts[id].last_row = 0;
+    }
+    index->posting_starts[index->words_size] = postings_size;
+    if(!psnip_safe_mul(&size, postings_size, sizeof(uint32_t))) goto error;
+    index->postings = malloc(size == 0 ? 1 : size);
+    if(index->postings == NULL) goto error;
+
+    // Second pass: fill the posting lists, records are visited in order so every list ends up sorted.
+    for(size_t row = 0; row < records_size; row++)
+    {
+        for(size_t column = 0; column < catalog_column_count(catalog, row); column++)
+        {
+            if(column == skip_column) continue;
+            size_t position = 0;
+            const char *word;
+            size_t length;
+            while(fuzzy_index_next_word(catalog_cell(catalog, row, column), &position, &word, &length))
+            {
+                uint32_t id = builder.slots[find_word_slot(&builder, hash_word(word, length), word, length)];
+                if(builder.counts[id].last_row != row + 1)
+                {
+                    builder.counts[id].last_row = (uint32_t) row + 1;
+                    index->postings[index->posting_starts[id] + builder.counts[id].count++] = (uint32_t) row;
+                }
+            }
+        }
+    }
+
+    if(!psnip_safe_mul(&size, index->words_size, sizeof(struct fuzzy_index_node))) goto error;
+    index->nodes = malloc(size);
+    if(index->nodes == NULL) goto error;
+    index->nodes[0].first_child = NO_NODE;
+    index->nodes[0].next_sibling = NO_NODE;
+    index->nodes[0].distance = 0;
+    for(size_t id = 1; id < index->words_size; id++) insert_node(index, (uint32_t) id);
+
+    done:
+    free(builder.slots);
+    free(builder.hashes);
+    free(builder.counts);
+    return true;
+
+    error:
+    free(builder.slots);
+    free(builder.hashes);
+    free(builder.counts);
+    fuzzy_index_free(index);
+    return false;
+}
+
+struct row_distance
+{
+    uint32_t row;
+    uint32_t distance;
+};
+
+static int compare_row_distances(const void *a, const void *b)
+{
+    const struct row_distance *x = a;
+    const struct row_distance *y = b;
+    if(x->row != y->row) return (x->row < y->row) ? -1 : 1;
+    if(x->distance != y->distance) return (x->distance < y->distance) ? -1 : 1;
+    return 0;
+}
+
+bool fuzzy_index_find(const struct fuzzy_index *index, const char *word, size_t word_length, struct row_list *rows, struct row_list *distances)
+{
+    rows->size = 0;
+    if(distances != NULL) distances->size = 0;
+    if(index->words_size == 0 || word_length == 0 || word_length > FUZZY_INDEX_MAX_WORD_LENGTH) return true;
+
+    char folded[FUZZY_INDEX_MAX_WORD_LENGTH];
+    for(size_t i = 0; i < word_length; i++) folded[i] = (char) fold_char((unsigned char) word[i]);
+    uint32_t max_distance = (uint32_t) fuzzy_index_max_distance(word_length);
+    // Every swap of adjacent characters costs two plain edits, allow for one swap in the tree search.
+    uint32_t radius = max_distance + 1;
+
+    // Walk the BK-tree, only children whose distance to their parent is within radius
+    // of the parent's distance to word can contain similar words (triangle inequality).
+    struct row_list stack;
+    struct row_list found; // Pairs of word number and distance.
+    row_list_init(&stack);
+    row_list_init(&found);
+    size_t matched_postings = 0;
+    if(!row_list_push(&stack, 0)) return false;
+    while(stack.size > 0)
+    {
+        uint32_t node = stack.rows[--stack.size];
+        size_t node_length;
+        const char *node_word = word_of(index, node, &node_length);
+        uint32_t distance = edit_distance(folded, word_length, node_word, node_length);
+        uint32_t similarity = distance;
+        if(distance > max_distance && distance <= radius) similarity = typo_distance(folded, word_length, node_word, node_length);
+        if(similarity <= max_distance)
+        {
+            if(!row_list_push(&found, node) || !row_list_push(&found, similarity)) goto error;
+            matched_postings += index->posting_starts[node + 1] - index->posting_starts[node];
+        }
+        for(uint32_t child = index->nodes[node].first_child; child != NO_NODE; child = index->nodes[child].next_sibling)
+        {
+            uint32_t edge = index->nodes[child].distance;
+            if(edge + radius >= distance && edge <= distance + radius && !row_list_push(&stack, child)) goto error;
+        }
+    }
+    row_list_free(&stack);
+
+    // Merge the records of all similar words, keeping the smallest distance of each record.
+    size_t size;
+    if(!psnip_safe_mul(&size, matched_postings, sizeof(struct row_distance))) goto error;
+    struct row_distance *pairs = malloc(size == 0 ? 1 : size);
+    if(pairs == NULL) goto error;
+    size_t pairs_size = 0;
+    for(size_t i = 0; i < found.size; i += 2)
+    {
+        uint32_t id = found.rows[i];
+        for(size_t j = index->posting_starts[id]; j < index->posting_starts[id + 1]; j++)
+        {
+            pairs[pairs_size].row = index->postings[j];
+            pairs[pairs_size].distance = found.rows[i + 1];
+            pairs_size++;
+        }
+    }
+    row_list_free(&found);
+    qsort(pairs, pairs_size, sizeof(struct row_distance), compare_row_distances);
+    for(size_t i = 0; i < pairs_size; i++)
+    {
+        if(i > 0 && pairs[i].row == pairs[i - 1].row) continue;
+        if(!row_list_push(rows, pairs[i].row) || (distances != NULL && !row_list_push(distances, pairs[i].distance))) { free(pairs); return false; }
+    }
+    free(pairs);
+    return true;
+
+    error:
+    row_list_free(&stack);
+    row_list_free(&found);
+    return false;
+}
+
+bool fuzzy_index_save_snapshot(const struct fuzzy_index *index, struct snapshot_writer *writer)
+{
+    if(!snapshot_write_size(writer, index->words_size)) return false;
+    if(index->words_size == 0) return true;
+    size_t words_text_size = index->word_starts[index->words_size];
+    size_t postings_size = index->posting_starts[index->words_size];
+    return snapshot_write_size(writer, words_text_size)
+        && snapshot_write_array(writer, index->words, words_text_size)
+        && snapshot_write_array(writer, index->word_starts, (index->words_size + 1) * sizeof(size_t))
+        && snapshot_write_array(writer, index->nodes, index->words_size * sizeof(struct fuzzy_index_node))
+        && snapshot_write_array(writer, index->posting_starts, (index->words_size + 1) * sizeof(size_t))
+        && snapshot_write_array(writer, index->postings, postings_size * sizeof(uint32_t));
+}
+
+bool fuzzy_index_load_snapshot(struct fuzzy_index *index, struct snapshot_reader *reader)
+{
+    memset(index, 0, sizeof(struct fuzzy_index));
+    index->borrowed = true;
+    size_t words_size;
+    if(!snapshot_read_size(reader, &words_size)) return false;
+    if(words_size == 0) return true;
+    if(words_size >= UINT32_MAX - 1) return false;
+
+    size_t words_text_size;
+    if(!snapshot_read_size(reader, &words_text_size) || words_text_size == 0) return false;
+    index->words = (char *) snapshot_read_array(reader, words_text_size, 1);
+    index->word_starts = (size_t *) snapshot_read_array(reader, words_size + 1, sizeof(size_t));
+    index->nodes = (struct fuzzy_index_node *) snapshot_read_array(reader, words_size, sizeof(struct fuzzy_index_node));
+    index->posting_starts = (size_t *) snapshot_read_array(reader, words_size + 1, sizeof(size_t));
+    if(index->words == NULL || index->word_starts == NULL || index->nodes == NULL || index->posting_starts == NULL) goto damaged;
+    index->words_size = words_size;
+    size_t postings_size = index->posting_starts[words_size];
+    index->postings = (uint32_t *) snapshot_read_array(reader, postings_size, sizeof(uint32_t));
+    if(index->postings == NULL) goto damaged;
+
+    if(index->words[words_text_size - 1] != '\0' || index->word_starts[0] != 0 || index->word_starts[words_size] != words_text_size) goto damaged;
+    if(index->posting_starts[0] != 0) goto damaged;
+    return true;
+
+    damaged:
+    fuzzy_index_free(index);
+    return false;
+}
+
+void fuzzy_index_free(struct fuzzy_index *index)
+{
+    if(!index->borrowed)
+    {
+        free(index->words);
+        free(index->word_starts);
+        free(index->nodes);
+        free(index->postings);
+        free(index->posting_starts);
+    }
+    memset(index, 0, sizeof(struct fuzzy_index));
+}
@@ -0,0 +1,94 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VOORRAADTELLEN_FUZZY_INDEX_H
+#define VOORRAADTELLEN_FUZZY_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "catalog.h"
+#include "snapshot.h"
+#include "row_list.h"
+
+// Words longer than this are not indexed, and can only be found by the normal search.
+#define FUZZY_INDEX_MAX_WORD_LENGTH 32
+
+/*
+ * Finds records containing words within a small edit distance of a query word, to forgive typos.
+ *
+ * All distinct (case-folded) words in the catalog are stored in a BK-tree,
+ * every word has a sorted list of the records containing it.
+ * Words consisting of only digits are not indexed, typos in numbers are not worth forgiving.
+ */
+struct fuzzy_index
+{
+    char *words;        // All words, each terminated by a '\0'.
+    size_t *word_starts;
+    struct fuzzy_index_node *nodes; // BK-tree nodes, nodes[i] belongs to word i, node 0 is the root.
+    size_t words_size;
+
+    uint32_t *postings;
+    size_t *posting_starts; // Word i's records are postings[posting_starts[i]] up to postings[posting_starts[i + 1]].
+    bool borrowed;      // The arrays point into a snapshot, they are not freed.
+};
+
+/*
+ * Indexes all columns except skip_column, pass SIZE_MAX to index every column.
+ *
+ * @returns false on error
+ */
+bool fuzzy_index_build(struct fuzzy_index *index, const struct catalog *catalog, size_t skip_column);
+
+/*
+ * Finds the next indexable word in str, starting at *position, splitting the same way the index does.
+ *
+ * @returns false if there are no more words.
+ */
+bool fuzzy_index_next_word(const char *str, size_t *position, const char **word, size_t *length);
+
+/*
+ * The edit distance forgiven for a word of the given length.
+ */
+size_t fuzzy_index_max_distance(size_t word_length);
+
+/*
+ * Stores the sorted list of records containing a word within fuzzy_index_max_distance of word in rows.
+ * If distances is not NULL, distances[i] is set to the smallest distance found for rows->rows[i].
+ *
+ * @returns false on error
+ */
+bool fuzzy_index_find(const struct fuzzy_index *index, const char *word, size_t word_length, struct row_list *rows, struct row_list *distances);
+
+/*
+ * @returns false on error
+ */
+bool fuzzy_index_save_snapshot(const struct fuzzy_index *index, struct snapshot_writer *writer);
+
+/*
+ * Initializes index with the index written by fuzzy_index_save_snapshot.
+ * The index is used right where it is in the snapshot, which has to stay open until the index is freed.
+ *
+ * @returns false on error, or if the snapshot is damaged
+ */
+bool fuzzy_index_load_snapshot(struct fuzzy_index *index, struct snapshot_reader *reader);
+
+void fuzzy_index_free(struct fuzzy_index *index);
+
+#endif
@@ -29,10 +29,26 @@
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
 
 #include <csv.h>
 #include <safe_math.h>
 
+#include "record.h"
+#include "catalog.h"
+#include "barcode_index.h"
+#include "row_list.h"
+#include "trigram_index.h"
+#include "folded_text.h"
+#include "fuzzy_index.h"
+#include "mapped_file.h"
+#include "parallel_parse.h"
+#include "arena.h"
+#include "snapshot.h"
+#include "csv_sniffer.h"
+#include "count_journal.h"
+#include "save_thread.h"
+
 #ifdef __unix__
     #include <unistd.h>
     #ifdef _POSIX_VERSION
@@ -111,8 +127,8 @@ static void print_welcome(void)
             "\n"
             "\n"
             "Pas op: Het CSV bestand waar u het pad voor geeft wordt aangepast met de veranderingen.\n"
-            "Als er een fout optreed tijdens het aanpassen van dit bestand, IS HET BESTAND MOGELIJK VERLOREN.\n"
-            "ALS DIT BESTAND BELANGRIJK IS, MAAK ER DAN EERST EEN KOPIE VAN.\n"
+            "Het bestand wordt pas vervangen als de nieuwe versie helemaal is opgeslagen, en tellingen die nog niet zijn opgeslagen\n"
+            "worden de volgende keer uit het logboek hersteld. Maak van een belangrijk bestand toch eerst een kopie.\n"
             "\n"
             "U kunt dit programma op elk moment normaal sluiten, veranderingen worden automatisch opgeslagen."
             "\n"
@@ -148,15 +164,18 @@ static char const *strcasestr(const char *str, const char *pattern) {
     if (!*pattern)
         return (char const *)str;
 
-    for (; *str; str++)
+    // Compare as unsigned char, passing a negative char to toupper is undefined behaviour.
+    const unsigned char *ustr = (const unsigned char *)str;
+    const unsigned char *upattern = (const unsigned char *)pattern;
+    for (; *ustr; ustr++)
     {
-        if (toupper(*str) == toupper(*pattern))
+        if (fold_char(*ustr) == fold_char(*upattern))
         {
             for (i = 1;; i++)
             {
-                if (!pattern[i])
-                    return (char const *)str;
-                if (toupper(str[i]) != toupper(pattern[i]))
+                if (!upattern[i])
+                    return (char const *)ustr;
+                if (fold_char(ustr[i]) != fold_char(upattern[i]))
                     break;
             }
         }
@@ -164,157 +183,146 @@ static char const *strcasestr(const char *str, const char *pattern) {
     return NULL;
 }
 
-static const size_t TO_FREE_BLOCK_SIZE = 256;
-static size_t to_free_size;
-static size_t to_free_max_size;
-static void **to_free_storage;
-
-static bool to_free_add(void *ptr)
-{
-    if(to_free_storage == NULL)
-    {
-        to_free_storage = malloc(TO_FREE_BLOCK_SIZE * sizeof(void *));
-        if(to_free_storage == NULL) return false;
-        to_free_size = 0;
-        to_free_max_size = TO_FREE_BLOCK_SIZE;
-    }
-    else if(to_free_size >= to_free_max_size)
-    {
-        void *tmp = realloc(to_free_storage, to_free_max_size * sizeof(void *) + TO_FREE_BLOCK_SIZE * sizeof(void *));
-        if(tmp == NULL) return false;
-        to_free_storage = tmp;
-        to_free_max_size = to_free_max_size + TO_FREE_BLOCK_SIZE;
-    }
-    to_free_storage[to_free_size] = ptr;
-    to_free_size++;
-    return true;
-}
-
-static void to_free_free(void)
-{
-    for(size_t i = 0; i < to_free_size; i++) free(to_free_storage[i]);
-}
-
-
-struct record
-{
-    size_t column_count;
-    char **columns;
-};
-
-static size_t const RECORDS_CHUNK_SIZE = 64;
-static size_t records_max_size;
-static size_t records_size = 0;
-static struct record *records;
+static struct catalog catalog;
 static struct record header;
+static bool header_parsed = false;
+// Owns the text and column array of the header, and libcsv's field buffer.
+static struct arena parse_arena;
+// Fields of the header while it is being parsed, copied into the arena once it is complete.
+static char **parsed_fields;
+static size_t parsed_fields_size;
+static size_t parsed_fields_capacity;
+// Where the data being parsed starts in the CSV file, a lazily loaded catalog stores where its records end.
+static size_t parse_offset;
 
 static size_t amount_column_index;
 static size_t barcode_column_index;
 static int delim;
+static unsigned char quote = CSV_QUOTE;
+// What the start of the CSV file looks like, dialect.barcode_column and dialect.amount_column are suggested to the user.
+static struct csv_dialect dialect;
+static bool columns_sniffed = false;
+// Counts are appended to the journal, and saved to the CSV file after this many.
+#define COUNT_JOURNAL_COMPACT_EVENTS 200
+// The journal is synced to disk after this many counts, 0 leaves it to the operating system.
+#define COUNT_JOURNAL_SYNC_INTERVAL 1
+static struct save_thread saver;
+
+static struct barcode_index barcode_index;
+static struct trigram_index trigram_index;
+static bool trigram_index_built = false;
+static struct folded_text folded_text;
+static bool folded_text_built = false;
+static struct fuzzy_index fuzzy_index;
+static bool fuzzy_index_built = false;
+// Snapshot of everything built from the CSV file, stored next to it. NULL if there can't be one.
+static char *snapshot_path;
+// The loaded snapshot, the catalog and indexes point into it if snapshot_opened is set.
+static struct snapshot snapshot;
+static bool snapshot_opened = false;
+// Records whose amount changed after the trigram index was built, these are always checked by the manual search.
+static struct row_list edited_rows;
+/*
+ * Manual search query, split into terms separated by whitespace.
+ * A record matches if every term is found in one of its fields, not necessarily the same field.
+ */
+struct query
+{
+    char *buffer;
+    char **terms;
+    size_t terms_size;
+};
+// Query and matches of the previous manual search, a query which extends it only has to check these matches.
+// previous_query.buffer is NULL if there is no previous search.
+static struct query previous_query;
+static struct row_list previous_matches;
+// Maximum amount of products with the same barcode shown to choose from.
+#define BARCODE_MATCHES_MAX 32
 
 
 static void end_of_field_callback(void *parsed_data, size_t len, void *callback_data)
 {
-    struct record *record = records + records_size;
-
-    if(record->column_count == 0)
+    if(header_parsed)
     {
-        record->columns = malloc(sizeof(char *));
-        if(record->columns == NULL) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
+        if(!catalog_append_field(&catalog, parsed_data, len)) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
+        return;
     }
-    else
+
+    if(parsed_fields_size == parsed_fields_capacity)
     {
+        size_t capacity;
+        if(parsed_fields_capacity == 0) capacity = 16;
+        else if(!psnip_safe_mul(&capacity, parsed_fields_capacity, 2)) { printf("Fout: integer overflow (main.c:%i).\n", __LINE__); exit(EXIT_FAILURE); }
         size_t size;
-        if(!psnip_safe_mul(&size, record->column_count, sizeof(char *))) { printf("Fout: integer overflow (main.c:%i).\n", __LINE__); exit(EXIT_FAILURE); }
-        if(!psnip_safe_add(&size, size, sizeof(char *))) { printf("Fout: integer overflow\n"); exit(EXIT_FAILURE); }
-        char **tmp = realloc(record->columns, size);
+        if(!psnip_safe_mul(&size, capacity, sizeof(char *))) { printf("Fout: integer overflow (main.c:%i).\n", __LINE__); exit(EXIT_FAILURE); }
+        char **tmp = realloc(parsed_fields, size);
         if(tmp == NULL) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
-        record->columns = tmp;
+        parsed_fields = tmp;
+        parsed_fields_capacity = capacity;
     }
 
-    size_t size;
-    if(!psnip_safe_add(&size, len, 1)) { printf("Fout: integer overflow (main.c:%i).\n", __LINE__); exit(EXIT_FAILURE); }
-    char *column = malloc(size);
+    char *column = arena_strndup(&parse_arena, parsed_data, len);
     if(column == NULL) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
-    memcpy(column, parsed_data, len);
-    column[len] = '\0';
-    record->columns[record->column_count] = column;
-    if(!psnip_safe_add(&(record->column_count), record->column_count, 1)) { printf("Fout: integer overflow (main.c:%i).\n", __LINE__); exit(EXIT_FAILURE); }
+    parsed_fields[parsed_fields_size++] = column;
 }
 
+/*
+ * callback_data is the parser if the catalog is loaded lazily.
+ */
 static void end_of_record_callback(int c, void *callback_data)
 {
-    static bool init = true;
-    if(init) // skip the header, use it to find the column indexes
-    {
-        struct record *record = records; // = "records", That's not a bug.
-
-        // Save header as header
-        size_t size;
-        if(!psnip_safe_mul(&size, record->column_count, sizeof(char *))) { printf("Fout: integer overflow (main.c:%i).\n", __LINE__); exit(EXIT_FAILURE); }
-        header.columns = malloc(size);
-        if(record->columns == NULL) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
-        header.column_count = record->column_count;
-        memcpy(header.columns, record->columns, size);
-
-        record->column_count = 0;
-        free(record->columns);
-        init = false;
-    }
-    else
+    if(header_parsed)
     {
-        if(!psnip_safe_add(&records_size, records_size, 1)) { printf("Fout: integer overflow (main.c:%i).\n", __LINE__); exit(EXIT_FAILURE); }
-        if(records_size >= records_max_size) // Grow if needed.
-        {
-            if(!psnip_safe_add(&records_max_size, records_max_size, RECORDS_CHUNK_SIZE)) { printf("Fout: integer overflow (main.c:%i).\n", __LINE__); exit(EXIT_FAILURE); }
-            size_t size;
-            if(!psnip_safe_mul(&size, records_max_size, sizeof(struct record))) { printf("Fout: integer overflow (main.c:%i).\n", __LINE__); exit(EXIT_FAILURE); }
-            void *tmp = realloc(records, size);
-            if(tmp == NULL) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
-            records = tmp;
-            for(size_t i = records_size; i < records_max_size; i++) records[i].column_count = 0;
-        }
+        bool stored = (catalog.source != NULL) ? catalog_end_lazy_record(&catalog, parse_offset + csv_row_end(callback_data)) : catalog_end_record(&catalog);
+        if(!stored) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
+        return;
     }
+
+    // The first record is the header, it is used to find the column indexes.
+    size_t size;
+    if(!psnip_safe_mul(&size, parsed_fields_size, sizeof(char *))) { printf("Fout: integer overflow (main.c:%i).\n", __LINE__); exit(EXIT_FAILURE); }
+    header.columns = arena_alloc(&parse_arena, size);
+    if(header.columns == NULL) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
+    memcpy(header.columns, parsed_fields, size);
+    header.column_count = parsed_fields_size;
+    header_parsed = true;
+    if(catalog.source != NULL) catalog_skip_source(&catalog, parse_offset + csv_row_end(callback_data));
 }
 
 /*
- * @returns false on error
+ * libcsv's field buffer lives in parse_arena too, it only grows for fields longer than any before.
  */
-static bool save(struct csv_parser *parser, struct record *records, size_t records_size, const char *path)
+static void *parser_realloc(void *ptr, size_t size)
 {
-    FILE *f = fopen(path, "w");
-    if(f == NULL) { printf("Fout: %s", strerror(errno)); }
-    for(size_t i = 0; i < header.column_count; i++)
-    {
-        if(csv_fwrite(f, header.columns[i], strlen(header.columns[i])) == EOF) return false;
-        if(i != header.column_count - 1) fputc(delim, f);
-    }
-    fputc('\n', f);
+    return arena_realloc(&parse_arena, ptr, size);
+}
 
-    for(size_t i = 0; i < records_size; i++)
-    {
-        struct record *record = records + i;
-        for(size_t j = 0; j < record->column_count; j++)
-        {
-            if(csv_fwrite(f, record->columns[j], strlen(record->columns[j])) == EOF) return false;
-            if(j != record->column_count - 1) fputc(delim, f);
-        }
-        fputc('\n', f);
-    }
-    if(fclose(f) == EOF) return false;
-    return true;
+static void parser_free(void *ptr)
+{
+    (void) ptr; // Freed together with parse_arena.
 }
 
+// Large enough for any size_t in decimal.
+#define TABLE_CELL_BUFFER_SIZE 24
+
+/*
+ * Rows of a table are not stored anywhere, their cells are fetched through these functions while printing.
+ * A cell function may format the cell in buffer, which holds TABLE_CELL_BUFFER_SIZE characters.
+ */
+typedef size_t (*table_column_count_func)(const void *data, size_t row);
+typedef const char *(*table_cell_func)(const void *data, size_t row, size_t column, char *buffer);
+
 /*
  * @returns true on error.
  */
-static bool print_table(struct record *records, size_t n)
+static bool print_table_cells(size_t n, table_column_count_func column_count, table_cell_func cell, const void *data)
 {
     if(n == 0) return false;
+    char buffer[TABLE_CELL_BUFFER_SIZE];
     size_t max_column_count = 0;
     for(size_t i = 0; i < n; i++)
     {
-        if(records[i].column_count > max_column_count) max_column_count = records[i].column_count;
+        if(column_count(data, i) > max_column_count) max_column_count = column_count(data, i);
     }
     if(max_column_count == 0) return false;
 
@@ -323,11 +331,11 @@ static bool print_table(struct record *records, size_t n)
 
     for(size_t i = 0; i < n; i++) // Calculate max widths
     {
-        struct record *record = records + i;
-        for(size_t column = 0; column < record->column_count; column++)
+        size_t row_column_count = column_count(data, i);
+        for(size_t column = 0; column < row_column_count; column++)
         {
             // TODO optimize, you dont need to keep counting the length after it's higher than previous ones already.
-            size_t len = strlen(record->columns[column]);
+            size_t len = strlen(cell(data, i, column, buffer));
             if(len > max_column_widths[column]) max_column_widths[column] = len;
         }
     }
@@ -371,15 +379,16 @@ static bool print_table(struct record *records, size_t n)
     puts(separator);
     for(size_t i = 0; i < n; i++) // Actually print table
     {
-        struct record *record = records + i;
+        size_t row_column_count = column_count(data, i);
         printf("| ");
-        for(size_t j = 0; j < record->column_count; j++)
+        for(size_t j = 0; j < row_column_count; j++)
         {
-            printf("%s", record->columns[j]);
-            size_t padding = max_column_widths[j] - strlen(record->columns[j]);
+            const char *text = cell(data, i, j, buffer);
+            printf("%s", text);
+            size_t padding = max_column_widths[j] - strlen(text);
             for(size_t k = 0; k < padding; k++) putchar(' ');
             printf(" |");
-            if(j != record->column_count - 1) putchar(' ');
+            if(j != row_column_count - 1) putchar(' ');
         }
         printf("\n");
         puts(separator);
@@ -388,9 +397,114 @@ static bool print_table(struct record *records, size_t n)
     return false;
 }
 
+/*
+ * The table shown when choosing columns: column numbers, the header, the first few records and a row of dots.
+ */
+struct preview_table
+{
+    size_t records_size;
+    size_t dots_column_count;
+};
+
+static size_t preview_column_count(const void *data, size_t row)
+{
+    const struct preview_table *table = data;
+    if(row < 2) return header.column_count;
+    if(row - 2 < table->records_size) return catalog_column_count(&catalog, row - 2);
+    return table->dots_column_count;
+}
+
+static const char *preview_cell(const void *data, size_t row, size_t column, char *buffer)
+{
+    const struct preview_table *table = data;
+    if(row == 0)
+    {
+        // blame bloody Macrosuft for the following abomination, they're still stuck in 1989.
+        #if defined(_WIN32)
+            snprintf(buffer, TABLE_CELL_BUFFER_SIZE, "%Iu", column + 1);
+        #else
+            snprintf(buffer, TABLE_CELL_BUFFER_SIZE, "%zu", column + 1);
+        #endif
+        return buffer;
+    }
+    if(row == 1) return header.columns[column];
+    if(row - 2 < table->records_size) return catalog_cell(&catalog, row - 2, column);
+    return "...";
+}
+
+/*
+ * Search results are shown as the header followed by the found records,
+ * with a generated "Keuzenummer" column in front if numbered is set.
+ */
+struct result_table
+{
+    const uint32_t *rows;
+    size_t first_number;
+    bool numbered;
+};
+
+static size_t result_column_count(const void *data, size_t row)
+{
+    const struct result_table *table = data;
+    size_t column_count = (row == 0) ? header.column_count : catalog_column_count(&catalog, table->rows[row - 1]);
+    return column_count + table->numbered;
+}
+
+static const char *result_cell(const void *data, size_t row, size_t column, char *buffer)
+{
+    const struct result_table *table = data;
+    if(table->numbered)
+    {
+        if(column == 0)
+        {
+            if(row == 0) return "Keuzenummer";
+            // blame bloody Macrosuft for the following abomination, they're still stuck in 1989.
+            #if defined(_WIN32)
+                snprintf(buffer, TABLE_CELL_BUFFER_SIZE, "%Iu", table->first_number + row - 1);
+            #else
+                snprintf(buffer, TABLE_CELL_BUFFER_SIZE, "%zu", table->first_number + row - 1);
+            #endif
+            return buffer;
+        }
+        column--;
+    }
+    if(row == 0) return header.columns[column];
+    return catalog_cell(&catalog, table->rows[row - 1], column);
+}
+
+/*
+ * Prints the header and the given records, numbered starting at first_number.
+ *
+ * @returns true on error.
+ */
+static bool print_result_table(const uint32_t *rows, size_t n, size_t first_number)
+{
+    struct result_table table;
+    table.rows = rows;
+    table.first_number = first_number;
+    table.numbered = true;
+    return print_table_cells(n + 1, result_column_count, result_cell, &table);
+}
+
+/*
+ * Prints the header and a single record.
+ *
+ * @returns true on error.
+ */
+static bool print_record_table(size_t row)
+{
+    uint32_t rows[1] = { (uint32_t) row };
+    struct result_table table;
+    table.rows = rows;
+    table.first_number = 0;
+    table.numbered = false;
+    return print_table_cells(2, result_column_count, result_cell, &table);
+}
+
 struct search_result
 {
-    struct record *record;
+    size_t row;
+    bool found;
     bool error;
 };
 
@@ -461,356 +575,678 @@ static bool ask_scanf(const char *question, const char *format, bool show_format
     return true;
 }
 
-static struct search_result do_manual_search(void)
+/*
+ * @returns false on error
+ */
+static bool query_split(const char *text, struct query *query)
 {
-    struct search_result retval;
+    size_t length = strlen(text);
+    size_t terms_capacity = length / 2 + 1;
+    query->buffer = malloc(length + 1);
+    query->terms = malloc(terms_capacity * sizeof(char *));
+    if(query->buffer == NULL || query->terms == NULL)
+    {
+        free(query->buffer);
+        free(query->terms);
+        query->buffer = NULL;
+        query->terms = NULL;
+        return false;
+    }
+    memcpy(query->buffer, text, length + 1);
 
+    query->terms_size = 0;
+    char *c = query->buffer;
     while(true)
     {
-        upper_loop:
-        clearscrn();
-        printf("Voer zoekterm in: "); fflush(stdout);
-        char *query = fgetline(stdin);
-        if(query == NULL) { printf("Fout: %s\n", strerror(errno)); exit(EXIT_FAILURE); }
+        while(isspace((unsigned char) *c)) c++;
+        if(*c == '\0') break;
+        query->terms[query->terms_size++] = c;
+        while(*c != '\0' && !isspace((unsigned char) *c)) c++;
+        if(*c == '\0') break;
+        *c++ = '\0';
+    }
+    // A query without terms matches every record, like an empty query always did.
+    if(query->terms_size == 0) query->terms[query->terms_size++] = query->buffer + length;
+    return true;
+}
 
-        const size_t search_results_chunk_size = 128;
-        size_t search_results_size = 0;
-        size_t search_results_max_size = search_results_chunk_size;
+static void query_free(struct query *query)
+{
+    free(query->buffer);
+    free(query->terms);
+    query->buffer = NULL;
+    query->terms = NULL;
+    query->terms_size = 0;
+}
 
-        size_t size;
-        if(!psnip_safe_mul(&size, search_results_chunk_size, sizeof(struct record))) { retval.error = true; retval.record = NULL; return retval; }
-        struct record *search_results = malloc(size);
-        if(search_results == NULL) { retval.error = true; retval.record = NULL; return retval; }
-
-        size_t size2;
-        if(!psnip_safe_mul(&size2, search_results_chunk_size, sizeof(struct record *))) { free(search_results); retval.error = true; retval.record = NULL; return retval; }
-        struct record **search_results_originals = malloc(size2);
-        if(search_results_originals == NULL) { free(search_results); retval.error = true; retval.record = NULL; return retval; }
-
-        search_results[0].column_count = header.column_count + 1;
-        size_t size3;
-        if(!psnip_safe_add(&size3, header.column_count, 1)) { free(search_results_originals); free(search_results); retval.error = true; retval.record = NULL; return retval; }
-        if(!psnip_safe_mul(&size3, size3, sizeof(char *))) { free(search_results_originals); free(search_results); retval.error = true; retval.record = NULL; return retval; }
-        search_results[0].columns = malloc(size3);
-        if(search_results[0].columns == NULL) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
-        for(size_t i = 0; i < header.column_count; i++) search_results[0].columns[i + 1] = header.columns[i];
-        search_results[0].columns[0] = "Keuzenummer";
-        search_results_size++; // That's integer-overflow safe
-
-        for(size_t i = 0; i < records_size; i++)
-        {
-            struct record *record = records + i;
-            for(size_t j = 0; j < record->column_count; j++)
-            {
-                const char *substr = strcasestr(record->columns[j], query);
-                if(substr != NULL) // Found a record which matches, add it to the search results and break to outer loop.
-                {
-                    if(search_results_size + 1 == SIZE_MAX - 1) goto quit_loops;
-                    if(search_results_size == search_results_max_size) // Grow it first
-                    {
-                        size_t size4;
-                        if(!psnip_safe_add(&size4, search_results_max_size, search_results_chunk_size)) { free(search_results_originals); free(search_results); retval.error = true; retval.record = NULL; return retval; }
-                        if(!psnip_safe_mul(&size4, size4, sizeof(struct record))) { free(search_results_originals); free(search_results); retval.error = true; retval.record = NULL; return retval; }
-                        struct record *tmp = realloc(search_results, size4);
-                        if(tmp == NULL) { free(search_results_originals); free(search_results); retval.error = true; retval.record = NULL; return retval; }
-                        search_results = tmp;
-
-                        size_t size5;
-                        if(!psnip_safe_add(&size5, search_results_max_size, search_results_chunk_size)) { free(search_results_originals); free(search_results); retval.error = true; retval.record = NULL; return retval; }
-                        if(!psnip_safe_mul(&size5, size5, sizeof(struct record *))) { free(search_results_originals); free(search_results); retval.error = true; retval.record = NULL; return retval; }
-                        struct record **tmp_search_results_originals = realloc(search_results_originals, size5);
-                        if(tmp_search_results_originals == NULL) { free(search_results_originals); free(search_results); retval.error = true; retval.record = NULL; return retval; }
-                        search_results_originals = tmp_search_results_originals;
-
-                        search_results_max_size += search_results_chunk_size; // Integer-overflow safe.
-                    }
-
-
-                    // Create copy of record
-                    struct record *search_record = search_results + search_results_size;
-                    search_record->column_count = record->column_count;
-                    size_t size6;
-                    if(!psnip_safe_add(&size6, record->column_count, 1)) { free(search_results_originals); free(search_results); retval.error = true; retval.record = NULL; return retval; }
-                    if(!psnip_safe_mul(&size6, size6, sizeof(char *))) { free(search_results_originals); free(search_results); retval.error = true; retval.record = NULL; return retval; }
-                    search_record->columns = malloc(size6);
-                    if(search_record->columns == NULL) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
-                    for(size_t k = 0; k < record->column_count; k++) search_record->columns[k + 1] = record->columns[k];
-
-
-                    // Insert number into first column of new copy of record.
-                    char tmp;
-                    // blame bloody Macrosuft for the following abomination, they're still stuck in 1989.
-                    #if defined(_WIN32)
-                        int required_size = snprintf(NULL, 0, "%Iu", search_results_size);
-                    #else
-                        int required_size = snprintf(&tmp, 1, "%zu", search_results_size);
-                    #endif
-                    if(required_size < 0) { printf("Fout: error returned by snprintf\n", strerror(errno)); exit(EXIT_FAILURE); }
-                    if((unsigned int) required_size > SIZE_MAX - 1) { printf("Fout: required_size is groter dan SIZE_MAX - 1\n"); exit(EXIT_FAILURE); }
-                    char *buf = malloc(required_size + 1);
-                    if(buf == NULL) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
-                    // blame bloody Macrosuft for the following abomination, they're still stuck in 1989.
-                    #if defined(_WIN32)
-                        if(sprintf(buf, "%Iu", search_results_size) < 0) { printf("Fout: error returned by sprintf\n"); exit(EXIT_FAILURE); }
-                    #else
-                        if(sprintf(buf, "%zu", search_results_size) < 0) { printf("Fout: error returned by sprintf\n"); exit(EXIT_FAILURE); }
-                    #endif
-                    search_record->columns[0] = buf;
-                    // same as: search_record->column_count++;
-                    if(!psnip_safe_add(&(search_record->column_count), search_record->column_count, 1)) { free(buf); free(search_results_originals); free(search_results); retval.error = true; retval.record = NULL; return retval; }
-                    search_results_originals[search_results_size - 1] = record;
-                    // same as: search_results_size++;
-                    if(!psnip_safe_add(&search_results_size, search_results_size, 1))
-                    {
-                        free(buf);
-                        free(search_results_originals);
-                        free(search_results);
-                        retval.error = true;
-                        retval.record = NULL;
-                        return retval;
-                    }
-                    break;
-                }
-            }
-        }
-        quit_loops:
-        if(search_results_size == 1) // the first is the header
+static bool record_matches(size_t row, const struct query *query)
+{
+    for(size_t term = 0; term < query->terms_size; term++)
+    {
+        bool found = false;
+        for(size_t i = 0; i < catalog_column_count(&catalog, row) && !found; i++)
         {
-            clearscrn();
-            printf("Geen resultaten gevonden. "); // no newline on purpose
-            if(ask("Wilt u opnieuw zoeken?"))
-            {
-                continue;
-            }
-            else
-            {
-                retval.record = NULL;
-                retval.error = false;
-                return retval;
-            }
+            found = (strcasestr(catalog_cell(&catalog, row, i), query->terms[term]) != NULL);
         }
+        if(!found) return false;
+    }
+    return true;
+}
 
-        size_t index;
-        clearscrn();
-        while(true) // Ask number from user
+// How well a field matches a query term, from worst to best.
+enum match_kind
+{
+    MATCH_NONE,
+    MATCH_SUBSTRING,
+    MATCH_WORD,     // The match starts at the beginning of a word.
+    MATCH_PREFIX,
+    MATCH_EXACT
+};
+
+static enum match_kind field_match(const char *field, const char *term, size_t term_length)
+{
+    const char *found = strcasestr(field, term);
+    if(found == NULL) return MATCH_NONE;
+    if(found == field) return (field[term_length] == '\0') ? MATCH_EXACT : MATCH_PREFIX;
+    while(found != NULL)
+    {
+        if(!isalnum((unsigned char) found[-1])) return MATCH_WORD;
+        found = strcasestr(found + 1, term);
+    }
+    return MATCH_SUBSTRING;
+}
+
+/*
+ * Scores how well a record matches query, a higher score is better.
+ * For every term the best matching field counts, and of equally well matching fields the shortest one.
+ * The match kinds of all terms are summed first, the lengths of their fields break ties.
+ *
+ * @returns 0 if the record doesn't match.
+ */
+static uint64_t record_score(size_t row, const struct query *query)
+{
+    uint64_t kinds = 0;
+    uint64_t lengths = 0;
+    for(size_t term = 0; term < query->terms_size; term++)
+    {
+        size_t term_length = strlen(query->terms[term]);
+        enum match_kind best_kind = MATCH_NONE;
+        size_t best_length = 0;
+        for(size_t i = 0; i < catalog_column_count(&catalog, row); i++)
         {
-            printf("Resultaten voor \"%s\":\n", query);
-            print_table(search_results, search_results_size);
-            printf("Kies een keuzenummer, druk op enter om opnieuw te zoeken, of voer 0 in om te stoppen met handmatig zoeken: "); fflush(stdout);
-            char *num = fgetline(stdin);
-            if(num == NULL)
-            {
-                printf("Fout: %s", strerror(errno));
-                retval.record = NULL;
-                retval.error = false;
-                free(num);
-                free(query);
-                for(size_t i = 1; i < search_results_size; i++) free(search_results[i].columns[0]); // Skip the first because that is a string literal.
-                free(search_results);
-                free(search_results_originals);
-                return retval;
-            }
-            if(*num == '\0') goto upper_loop;
-            if(num[0] == '0' && num[1] == '\0')
+            const char *field = catalog_cell(&catalog, row, i);
+            enum match_kind kind = field_match(field, query->terms[term], term_length);
+            if(kind == MATCH_NONE || kind < best_kind) continue;
+            size_t length = strlen(field);
+            if(kind > best_kind || length < best_length)
             {
-                retval.record = NULL;
-                retval.error = false;
-                free(num);
-                free(query);
-                for(size_t i = 1; i < search_results_size; i++) free(search_results[i].columns[0]); // Skip the first because that is a string literal.
-                free(search_results);
-                free(search_results_originals);
-                return retval;
+                best_kind = kind;
+                best_length = length;
             }
-            // TODO don't use atoll
-            long long llindex = atoll(num); // This index starts at 1 because we skip the header
-            free(num);
-            if(llindex <= 0 || (unsigned long long) llindex > search_results_size-1) { clearscrn(); printf("Fout: ongeldig nummer %lld\n", llindex); continue; }
-            if((unsigned long long) llindex > SIZE_MAX) { printf("Technische fout: nummer past niet in size_t."); exit(EXIT_FAILURE); }
-            index = (size_t) llindex;
-            break;
         }
-        retval.record = search_results_originals[index - 1];
-        retval.error = false;
-
-        free(query);
-        for(size_t i = 1; i < search_results_size; i++) free(search_results[i].columns[0]); // Skip the first because that is a string literal.
-        free(search_results);
-        free(search_results_originals);
-        return retval;
+        if(best_kind == MATCH_NONE) return 0;
+        kinds += best_kind;
+        lengths += best_length;
     }
+    if(lengths > UINT32_MAX) lengths = UINT32_MAX;
+    return (kinds << 32) | (UINT32_MAX - lengths);
 }
 
-static struct search_result do_barcode_search(char *barcode)
+/*
+ * Whether every record matching query also matches previous,
+ * which is the case if every term of previous is contained in a term of query.
+ */
+static bool query_refines(const struct query *query, const struct query *previous)
 {
-    struct record *record = NULL;
-    for(size_t i = 0; i < records_size; i++)
+    for(size_t i = 0; i < previous->terms_size; i++)
     {
-        struct record *current_record = records + i;
-        if(current_record->column_count < barcode_column_index) continue;
-        if(strcmp(current_record->columns[barcode_column_index], barcode) == 0)
+        bool contained = false;
+        for(size_t j = 0; j < query->terms_size && !contained; j++)
         {
-            record = records + i;
-            break;
+            contained = (strcasestr(query->terms[j], previous->terms[i]) != NULL);
         }
+        if(!contained) return false;
     }
-    struct search_result retval;
-    retval.record = record;
-    retval.error = false;
-    return retval;
+    return true;
 }
 
-void at_exit_callback(void)
+static int compare_row_list_sizes(const void *a, const void *b)
 {
-    printf("Druk op enter om het programma te sluiten..\n");
-    getchar();
+    const struct row_list *x = a;
+    const struct row_list *y = b;
+    if(x->size != y->size) return (x->size < y->size) ? -1 : 1;
+    return 0;
 }
 
-int main(void)
+/*
+ * Stores the records which may contain every term of query long enough for the trigram index in indexed.
+ * If *indexed_terms is set to 0, no term could be looked up.
+ *
+ * @returns false on error
+ */
+static bool trigram_candidates(const struct query *query, struct row_list *indexed, size_t *indexed_terms)
 {
-    atexit(at_exit_callback);
-    clearscrn_true();
-    print_welcome();
-    printf("Voer lijstscheidingsteken in (meestal een komma of puntkomma): "); fflush(stdout);
-    delim = fgetc(stdin);
-    if(delim == EOF) { printf("Fout.\n"); exit(EXIT_FAILURE); }
-    fgetc(stdin);
-
+    struct row_list *lists = malloc(query->terms_size * sizeof(struct row_list));
+    if(lists == NULL) return false;
+    size_t lists_size = 0;
+    bool success = true;
+    for(size_t i = 0; i < query->terms_size; i++)
+    {
+        if(strlen(query->terms[i]) < TRIGRAM_INDEX_MIN_QUERY_LENGTH) continue;
+        row_list_init(lists + lists_size);
+        lists_size++;
+        if(!trigram_index_candidates(&trigram_index, query->terms[i], lists + lists_size - 1)) { success = false; break; }
+        if(lists[lists_size - 1].size == 0) break; // Nothing can match every term anymore.
+    }
 
-    FILE *infile;
-    char *msg1 = "Voer pad naar CSV bestand in (bijvoorbeeld: C:\\Users\\Jan\\Desktop\\artikelen.csv): ";
-    printf("%s", msg1); fflush(stdout);
-    char *inpath;
-    while (true)
+    *indexed_terms = lists_size;
+    if(success && lists_size > 0)
     {
-        inpath = fgetline(stdin);
-        if(inpath == NULL) { printf("Fout: %s\n", strerror(errno)); exit(EXIT_FAILURE); }
+        // Intersect the shortest lists first, so the candidate list shrinks as fast as possible.
+        qsort(lists, lists_size, sizeof(struct row_list), compare_row_list_sizes);
+        row_list_free(indexed);
+        *indexed = lists[0];
+        row_list_init(lists);
+        for(size_t i = 1; i < lists_size && indexed->size > 0; i++) row_list_intersect(indexed, lists[i].rows, lists[i].size);
+    }
+    for(size_t i = 0; i < lists_size; i++) row_list_free(lists + i);
+    free(lists);
+    return success;
+}
 
-        infile = fopen(inpath, "r+");
-        if(infile == NULL)
-        {
-            clearscrn();
-            printf("Fout: kon bestand niet openen. (%s)\n", strerror(errno));
-            printf("%s", msg1); fflush(stdout);
-            free(inpath);
-        }
-        else
-        {
-            break;
-        }
+/*
+ * Finds the records which may match query, in order.
+ * If *all_records is set to true, there are no candidates and every record has to be checked instead.
+ *
+ * @returns false on error
+ */
+static bool manual_search_candidates(const struct query *query, struct row_list *candidates, bool *all_records)
+{
+    *all_records = false;
+    // Every record matching query also matched the previous query if query refines it,
+    // except for records whose amount has been edited since.
+    if(previous_query.buffer != NULL && query_refines(query, &previous_query))
+    {
+        return row_list_union(candidates, &previous_matches, &edited_rows);
     }
-    fseek(infile, 0, SEEK_END);
-    long fsize = ftell(infile);
-    if(fsize == -1) { printf("Fout: %s\n", strerror(errno)); exit(EXIT_FAILURE); }
-    if(fsize < 0) { printf("Fout: invalid value for fsize.\n"); exit(EXIT_FAILURE); }
-    fseek(infile, 0, SEEK_SET);
-    if((unsigned long) fsize > SIZE_MAX) { printf("Fout: value exceeded SIZE_MAX, could not store variable.\n"); exit(EXIT_FAILURE); }
-    char *buf = malloc(fsize);
-    if(buf == NULL) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); }
-    size_t buf_used = fread(buf, 1, fsize, infile);
-    if(buf_used == 0) { printf("Fout: kon data niet lezen uit bestand.\n"); exit(EXIT_FAILURE); }
-    fclose(infile);
 
+    if(trigram_index_built)
+    {
+        struct row_list indexed;
+        row_list_init(&indexed);
+        size_t indexed_terms;
+        bool success = trigram_candidates(query, &indexed, &indexed_terms);
+        if(success && indexed_terms > 0) success = row_list_union(candidates, &indexed, &edited_rows);
+        row_list_free(&indexed);
+        if(!success || indexed_terms > 0) return success;
+    }
 
-    char *outpath;
-    FILE *outfile;
-    if(ask("Wilt u het bijgewerkte bestand in een nieuw bestand opslaan?\n  Dit kan veiliger zijn i.v.m. gegevensverlies terwijl de wijzigingen worden opgeslagen."))
+    if(folded_text_built)
     {
-        char *msg2 = "Voer pad naar CSV bestand voor wijzigingen in (bijvoorbeeld: C:\\Users\\Jan\\Desktop\\bijgewerkt.csv): ";
-        printf("%s", msg2); fflush(stdout);
-        while (true)
+        // All terms are too short for the trigram index, scan for the longest one.
+        const char *longest = query->terms[0];
+        for(size_t i = 1; i < query->terms_size; i++) if(strlen(query->terms[i]) > strlen(longest)) longest = query->terms[i];
+
+        uint8_t *matched = calloc(catalog.records_size == 0 ? 1 : catalog.records_size, 1);
+        if(matched == NULL) return false;
+        if(!folded_text_search(&folded_text, longest, matched)) { free(matched); return false; }
+        // The folded text still has the old amounts of edited records.
+        for(size_t i = 0; i < edited_rows.size; i++) matched[edited_rows.rows[i]] = record_matches(edited_rows.rows[i], query);
+        for(size_t i = 0; i < catalog.records_size; i++)
         {
-            outpath = fgetline(stdin);
-            if (outpath == NULL) { printf("Fout: %s\n", strerror(errno)); exit(EXIT_FAILURE); }
-            if (strcmp(outpath, inpath) == 0) { free(outpath); outpath = inpath; break; }
-            outfile = fopen(outpath, "w");
-            if (outfile == NULL)
-            {
-                clearscrn();
-                printf("Fout: kon bestand niet openen. (%s)\n", strerror(errno));
-                printf("%s", msg2); fflush(stdout);
-                free(outpath);
-            }
-            else
-            {
-                break;
-            }
+            if(matched[i] && !row_list_push(candidates, (uint32_t) i)) { free(matched); return false; }
         }
-    }
-    else
-    {
-        outpath = inpath;
+        free(matched);
+        return true;
     }
 
-    clearscrn();
+    *all_records = true;
+    return true;
+}
 
-    printf("CSV bestand inladen..\n");
-    size_t size;
-    if(!psnip_safe_mul(&size, RECORDS_CHUNK_SIZE, sizeof(struct record))) { printf("Fout: integer overflow\n"); exit(EXIT_FAILURE); }
-    records = malloc(size);
-    if(records == NULL) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
-    records_max_size = RECORDS_CHUNK_SIZE;
-    for(size_t i = 0; i < records_max_size; i++) records[i].column_count = 0;
+/*
+ * Remembers the matches of query, so the next search can refine them.
+ * If remembering fails the previous search is forgotten.
+ */
+static void remember_manual_search(const char *text, const struct row_list *matches)
+{
+    query_free(&previous_query);
+    previous_matches.size = 0;
+    if(!query_split(text, &previous_query)) return;
+    if(!row_list_reserve(&previous_matches, matches->size)) { query_free(&previous_query); return; }
+    memcpy(previous_matches.rows, matches->rows, matches->size * sizeof(uint32_t));
+    previous_matches.size = matches->size;
+}
 
-    struct csv_parser parser;
-    if(csv_init(&parser, 0) != 0) { printf("Fout: kon parser niet initialiseren.\n"); free(records); exit(EXIT_FAILURE); }
-    csv_set_delim(&parser, delim);
-    size_t bytes_processed = csv_parse(&parser, buf, buf_used, end_of_field_callback, end_of_record_callback, NULL); // record is the line, field is an entry
-    if(bytes_processed < buf_used) { printf("Fout: fout tijdens het lezen van CSV bestand. (%s)\n", csv_strerror(csv_error(&parser))); free(records); exit(EXIT_FAILURE); }
-    csv_fini(&parser, end_of_field_callback, end_of_record_callback, NULL); // TODO do we want both callbacks to be called here?
+// Only this many of the best matching records are kept by the manual search.
+#define SEARCH_RESULTS_MAX 200
+#define SEARCH_RESULTS_PAGE_SIZE 20
 
-    clearscrn();
+struct ranked_row
+{
+    uint64_t score;
+    uint32_t row;
+};
 
-    size_t preview_length = 5; // preview_length may not be bigger than SIZE_MAX - 2
-    struct record choose_columns_table[preview_length + 3];
-    choose_columns_table[0].column_count = header.column_count;
-    char *choose_columns_table_header_columns[header.column_count];
-    choose_columns_table[0].columns = choose_columns_table_header_columns;
+// Of equal scores, the record that comes first in the file ranks higher.
+static bool ranks_below(const struct ranked_row *a, const struct ranked_row *b)
+{
+    return a->score < b->score || (a->score == b->score && a->row > b->row);
+}
 
-    // Add column numbers header
-    for (size_t i = 0; i < choose_columns_table[0].column_count; i++)
+/*
+ * Bounded min-heap of the best SEARCH_RESULTS_MAX records, the worst kept record is at the top.
+ */
+static void ranked_heap_offer(struct ranked_row *heap, size_t *heap_size, struct ranked_row candidate)
+{
+    size_t i;
+    if(*heap_size < SEARCH_RESULTS_MAX)
     {
-        size_t human_index; // Starts at 1 instead of 0
-        if(!psnip_safe_add(&human_index, i, 1)) { printf("Fout: integer overflow. (main.c:%i)\n", __LINE__); exit(EXIT_FAILURE); }
-
-        char tmp;
-        // blame bloody Macrosuft for the following abomination, they're still stuck in 1989.
-        #if defined(_WIN32)
-            int required_size = snprintf(NULL, 0, "%Iu", human_index);
-        #else
-            int required_size = snprintf(&tmp, 1, "%zu", human_index);
-        #endif
-        if(required_size < 0) { printf("Fout: error returned by snprintf\n", strerror(errno)); exit(EXIT_FAILURE); }
-        if((unsigned int) required_size > SIZE_MAX - 1) { printf("Fout: required_size is groter dan SIZE_MAX - 1\n"); exit(EXIT_FAILURE); }
-        char *buf = malloc(required_size + 1);
-        if(buf == NULL) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
-        // blame bloody Macrosuft for the following abomination, they're still stuck in 1989.
-        #if defined(_WIN32)
-            if(sprintf(buf, "%Iu", human_index) < 0) { printf("Fout: error returned by sprintf\n"); exit(EXIT_FAILURE); }
-        #else
-            if(sprintf(buf, "%zu", human_index) < 0) { printf("Fout: error returned by sprintf\n"); exit(EXIT_FAILURE); }
-        #endif
-        choose_columns_table[0].columns[i] = buf; // buf contains the string representation of the human index.
+        i = (*heap_size)++;
+        while(i > 0 && ranks_below(&candidate, heap + (i - 1) / 2))
+        {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = candidate;
+        return;
     }
-    size_t max_choose_columns_table_col_count = 0;
-    choose_columns_table[1] = header; // Second row becomes the header
-    for (size_t i = 0; i < preview_length; i++) // Remaining preview_length rows become preview rows
+    if(!ranks_below(heap, &candidate)) return;
+
+    i = 0;
+    while(true)
     {
-        choose_columns_table[i + 2] = records[i];
-        if (max_choose_columns_table_col_count < records[i].column_count) max_choose_columns_table_col_count = records[i].column_count;
+        size_t child = 2 * i + 1;
+        if(child >= *heap_size) break;
+        if(child + 1 < *heap_size && ranks_below(heap + child + 1, heap + child)) child++;
+        if(!ranks_below(heap + child, &candidate)) break;
+        heap[i] = heap[child];
+        i = child;
     }
+    heap[i] = candidate;
+}
 
-    // Produce a row containing only dots in each cell as the final row.
-    struct record sniff_and_so_on;
-    sniff_and_so_on.column_count = max_choose_columns_table_col_count;
+static int compare_ranked_rows(const void *a, const void *b)
+{
+    if(ranks_below(a, b)) return 1;
+    if(ranks_below(b, a)) return -1;
+    return 0;
+}
+
+/*
+ * Stores all records matching the query in text in matches, in order,
+ * and the best SEARCH_RESULTS_MAX of them in ranked, best first.
+ *
+ * @returns false on error
+ */
+static bool manual_search(const char *text, struct row_list *matches, struct row_list *ranked)
+{
+    struct ranked_row heap[SEARCH_RESULTS_MAX];
+    size_t heap_size = 0;
+
+    struct query query;
+    if(!query_split(text, &query)) return false;
+    struct row_list candidates;
+    row_list_init(&candidates);
+    bool all_records;
+    if(!manual_search_candidates(&query, &candidates, &all_records)) { row_list_free(&candidates); query_free(&query); return false; }
+
+    size_t candidates_size = all_records ? catalog.records_size : candidates.size;
+    for(size_t candidate = 0; candidate < candidates_size; candidate++)
+    {
+        size_t i = all_records ? candidate : candidates.rows[candidate];
+        struct ranked_row current;
+        current.score = record_score(i, &query);
+        if(current.score == 0) continue;
+        current.row = (uint32_t) i;
+        if(!row_list_push(matches, current.row)) { row_list_free(&candidates); query_free(&query); return false; }
+        ranked_heap_offer(heap, &heap_size, current);
+    }
+    row_list_free(&candidates);
+    query_free(&query);
+    remember_manual_search(text, matches);
+
+    qsort(heap, heap_size, sizeof(struct ranked_row), compare_ranked_rows);
+    if(!row_list_reserve(ranked, heap_size)) return false;
+    for(size_t i = 0; i < heap_size; i++) ranked->rows[i] = heap[i].row;
+    ranked->size = heap_size;
+    return true;
+}
+
+/*
+ * Finds records containing words similar to every word in query, to forgive typos.
+ * Stores the found records in matches, in order, and the best SEARCH_RESULTS_MAX of them in ranked, best first.
+ *
+ * @returns false on error
+ */
+static bool fuzzy_search(const char *query, struct row_list *matches, struct row_list *ranked)
+{
+    struct row_list distances; // distances.rows[i] is the summed edit distance for matches->rows[i].
+    struct row_list word_rows;
+    struct row_list word_distances;
+    row_list_init(&distances);
+    row_list_init(&word_rows);
+    row_list_init(&word_distances);
+
+    bool first = true;
+    size_t position = 0;
+    const char *word;
+    size_t length;
+    while(fuzzy_index_next_word(query, &position, &word, &length))
+    {
+        if(!fuzzy_index_find(&fuzzy_index, word, length, &word_rows, &word_distances)) goto error;
+        if(first)
+        {
+            if(!row_list_reserve(matches, word_rows.size) || !row_list_reserve(&distances, word_rows.size)) goto error;
+            memcpy(matches->rows, word_rows.rows, word_rows.size * sizeof(uint32_t));
+            memcpy(distances.rows, word_distances.rows, word_rows.size * sizeof(uint32_t));
+            matches->size = distances.size = word_rows.size;
+            first = false;
+            continue;
+        }
+
+        // Keep only the records which also contain a word similar to this one.
+        size_t kept = 0;
+        size_t j = 0;
+        for(size_t i = 0; i < matches->size; i++)
+        {
+            while(j < word_rows.size && word_rows.rows[j] < matches->rows[i]) j++;
+            if(j == word_rows.size) break;
+            if(word_rows.rows[j] != matches->rows[i]) continue;
+            matches->rows[kept] = matches->rows[i];
+            distances.rows[kept] = distances.rows[i] + word_distances.rows[j];
+            kept++;
+        }
+        matches->size = distances.size = kept;
+    }
+
+    struct ranked_row heap[SEARCH_RESULTS_MAX];
+    size_t heap_size = 0;
+    for(size_t i = 0; i < matches->size; i++)
+    {
+        struct ranked_row current;
+        current.score = UINT32_MAX - distances.rows[i];
+        current.row = matches->rows[i];
+        ranked_heap_offer(heap, &heap_size, current);
+    }
+    qsort(heap, heap_size, sizeof(struct ranked_row), compare_ranked_rows);
+    if(!row_list_reserve(ranked, heap_size)) goto error;
+    for(size_t i = 0; i < heap_size; i++) ranked->rows[i] = heap[i].row;
+    ranked->size = heap_size;
+
+    row_list_free(&distances);
+    row_list_free(&word_rows);
+    row_list_free(&word_distances);
+    return true;
+
+    error:
+    row_list_free(&distances);
+    row_list_free(&word_rows);
+    row_list_free(&word_distances);
+    return false;
+}
+
+enum choice
+{
+    CHOICE_NUMBER,
+    CHOICE_NEXT_PAGE,
+    CHOICE_PREVIOUS_PAGE,
+    CHOICE_EMPTY,
+    CHOICE_INVALID,
+    CHOICE_ERROR
+};
+
+/*
+ * Reads a keuzenummer from 0 up to and including max from the user.
+ */
+static enum choice read_choice(size_t max, size_t *number)
+{
+    char *line = fgetline(stdin);
+    if(line == NULL) return CHOICE_ERROR;
+    if(*line == '\0') { free(line); return CHOICE_EMPTY; }
+    if(strcmp(line, "v") == 0) { free(line); return CHOICE_NEXT_PAGE; }
+    if(strcmp(line, "p") == 0) { free(line); return CHOICE_PREVIOUS_PAGE; }
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(line, &end, 10);
+    bool valid = (*end == '\0' && errno == 0 && value <= max);
+    free(line);
+    if(!valid) return CHOICE_INVALID;
+    *number = (size_t) value;
+    return CHOICE_NUMBER;
+}
+
+static struct search_result do_manual_search(void)
+{
+    struct search_result retval;
+    retval.found = false;
+    retval.error = false;
 
-    char *sniff_and_so_on_columns[sniff_and_so_on.column_count];
-    for (size_t i = 0; i < sniff_and_so_on.column_count; i++)
+    while(true)
     {
-        sniff_and_so_on_columns[i] = "...";
+        clearscrn();
+        printf("Voer zoekterm in (begin met ~ om typfouten toe te staan): "); fflush(stdout);
+        char *query = fgetline(stdin);
+        if(query == NULL) { printf("Fout: %s\n", strerror(errno)); exit(EXIT_FAILURE); }
+        // A query starting with ~ always forgives typos, other queries only when nothing matches exactly.
+        bool fuzzy = (query[0] == '~');
+        if(fuzzy && !fuzzy_index_built)
+        {
+            free(query);
+            clearscrn();
+            // Without the index, typos can't be forgiven, for example when only the barcode and amount column were loaded.
+            printf("Zoeken met typfouten is niet beschikbaar, zoek zonder ~. "); // no newline on purpose
+            if(ask("Wilt u opnieuw zoeken?")) continue;
+            return retval;
+        }
+
+        struct row_list matches;
+        struct row_list ranked;
+        row_list_init(&matches);
+        row_list_init(&ranked);
+        bool success = fuzzy ? fuzzy_search(query + 1, &matches, &ranked) : manual_search(query, &matches, &ranked);
+        if(success && !fuzzy && matches.size == 0 && fuzzy_index_built)
+        {
+            fuzzy = true;
+            success = fuzzy_search(query, &matches, &ranked);
+        }
+        if(!success)
+        {
+            row_list_free(&matches);
+            row_list_free(&ranked);
+            free(query);
+            retval.error = true;
+            return retval;
+        }
+
+        if(matches.size == 0)
+        {
+            row_list_free(&matches);
+            row_list_free(&ranked);
+            free(query);
+            clearscrn();
+            printf("Geen resultaten gevonden. "); // no newline on purpose
+            if(ask("Wilt u opnieuw zoeken?")) continue;
+            return retval;
+        }
+
+        clearscrn();
+        bool search_again = false;
+        size_t pages = (ranked.size + SEARCH_RESULTS_PAGE_SIZE - 1) / SEARCH_RESULTS_PAGE_SIZE;
+        size_t page = 0;
+        while(true) // Ask number from user
+        {
+            size_t first = page * SEARCH_RESULTS_PAGE_SIZE;
+            size_t shown = (ranked.size - first < SEARCH_RESULTS_PAGE_SIZE) ? ranked.size - first : SEARCH_RESULTS_PAGE_SIZE;
+            if(fuzzy) printf("Resultaten die lijken op \"%s\" (%zu gevonden, pagina %zu van %zu):\n", (query[0] == '~') ? query + 1 : query, matches.size, page + 1, pages);
+            else printf("Resultaten voor \"%s\" (%zu gevonden, pagina %zu van %zu):\n", query, matches.size, page + 1, pages);
+            if(matches.size > ranked.size) printf("Alleen de %zu beste resultaten worden getoond, maak de zoekterm specifieker om andere te vinden.\n", ranked.size);
+            print_result_table(ranked.rows + first, shown, first + 1);
+            printf("Kies een keuzenummer, ");
+            if(page + 1 < pages) printf("voer v in voor de volgende pagina, ");
+            if(page > 0) printf("voer p in voor de vorige pagina, ");
+            printf("druk op enter om opnieuw te zoeken, of voer 0 in om te stoppen met handmatig zoeken: "); fflush(stdout);
+            size_t number;
+            enum choice choice = read_choice(ranked.size, &number);
+            if(choice == CHOICE_ERROR) { printf("Fout: %s", strerror(errno)); break; }
+            if(choice == CHOICE_EMPTY) { search_again = true; break; }
+            if(choice == CHOICE_NEXT_PAGE && page + 1 < pages) { page++; clearscrn(); continue; }
+            if(choice == CHOICE_PREVIOUS_PAGE && page > 0) { page--; clearscrn(); continue; }
+            if(choice != CHOICE_NUMBER) { clearscrn(); printf("Fout: ongeldig keuzenummer.\n"); continue; }
+            if(number != 0)
+            {
+                retval.row = ranked.rows[number - 1];
+                retval.found = true;
+            }
+            break;
+        }
+        row_list_free(&matches);
+        row_list_free(&ranked);
+        free(query);
+        if(search_again) continue;
+        return retval;
+    }
+}
+
+/*
+ * Lets the user choose between multiple products which share the same barcode.
+ */
+static struct search_result choose_barcode_duplicate(const char *barcode, const size_t *rows, size_t rows_size, size_t found)
+{
+    struct search_result retval;
+    retval.found = false;
+    retval.error = false;
+
+    uint32_t table_rows[BARCODE_MATCHES_MAX];
+    for(size_t i = 0; i < rows_size; i++) table_rows[i] = (uint32_t) rows[i];
+
+    clearscrn();
+    while(true)
+    {
+        printf("Er zijn %zu producten met barcode %s gevonden:\n", found, barcode);
+        if(found > rows_size) printf("Alleen de eerste %zu worden getoond.\n", rows_size);
+        print_result_table(table_rows, rows_size, 1);
+        printf("Kies een keuzenummer, of voer 0 in om opnieuw te scannen: "); fflush(stdout);
+        size_t number;
+        enum choice choice = read_choice(rows_size, &number);
+        if(choice == CHOICE_ERROR) { printf("Fout: %s", strerror(errno)); break; }
+        if(choice != CHOICE_NUMBER) { clearscrn(); printf("Fout: ongeldig keuzenummer.\n"); continue; }
+        if(number != 0)
+        {
+            retval.row = rows[number - 1];
+            retval.found = true;
+        }
+        break;
+    }
+    return retval;
+}
+
+static struct search_result do_barcode_search(char *barcode)
+{
+    struct search_result retval;
+    retval.found = false;
+    retval.error = false;
+
+    size_t rows[BARCODE_MATCHES_MAX];
+    size_t found = barcode_index_find(&barcode_index, &catalog, barcode_column_index, barcode, rows, BARCODE_MATCHES_MAX);
+    if(found == 0) return retval;
+    if(found == 1)
+    {
+        retval.row = rows[0];
+        retval.found = true;
+        return retval;
+    }
+    return choose_barcode_duplicate(barcode, rows, (found < BARCODE_MATCHES_MAX) ? found : BARCODE_MATCHES_MAX, found);
+}
+
+// Seconds between updates of the loading progress.
+#define LOAD_PROGRESS_INTERVAL 0.25
+
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (double) (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Shows how much of the CSV file has been loaded, total is 0 if the file size is unknown.
+ */
+static void print_load_progress(size_t loaded, size_t total, double seconds)
+{
+    double megabytes = loaded / (1024.0 * 1024.0);
+    double speed = (seconds > 0) ? megabytes / seconds : 0;
+    if(total > 0) printf("\rCSV bestand inladen.. %3u%% (%.1f MB/s)", (unsigned int) (loaded * 100.0 / total), speed);
+    else printf("\rCSV bestand inladen.. %.1f MB (%.1f MB/s)", megabytes, speed);
+    fflush(stdout);
+}
+
+/*
+ * Parses the whole CSV file into header and catalog, and closes input or hands it to a lazily loaded catalog.
+ */
+static void parse_csv(struct csv_parser *parser, struct mapped_file *input)
+{
+    // There are at most as many records as newlines, as the header takes a line too.
+    // If reserving fails the catalog just grows while loading.
+    size_t lines = mapped_file_count_lines(input);
+    if(lines > 1) catalog_reserve(&catalog, lines);
+
+    struct parallel_parser parallel;
+    parallel.parser = parser;
+    parallel.end_of_field_callback = end_of_field_callback;
+    parallel.end_of_record_callback = end_of_record_callback;
+    parallel.catalog = &catalog;
+    parallel.thread_count = parallel_parse_thread_count();
+    parallel.data_offset = &parse_offset;
+    struct timespec load_start;
+    timespec_get(&load_start, TIME_UTC);
+    double last_progress = 0;
+    while(true)
+    {
+        const char *chunk;
+        size_t chunk_size;
+        if(!mapped_file_next_chunk(input, &chunk, &chunk_size)) { printf("\nFout: kon bestand niet lezen. (%s)\n", strerror(errno)); exit(EXIT_FAILURE); }
+        if(chunk_size == 0) break;
+        parse_offset = input->position - chunk_size;
+        size_t bytes_processed;
+        // The pieces parsed on other threads go straight into the catalog, so the header has to be parsed first.
+        if(header_parsed && parallel.thread_count > 1) bytes_processed = parallel_parse(&parallel, chunk, chunk_size);
+        else bytes_processed = csv_parse(parser, chunk, chunk_size, end_of_field_callback, end_of_record_callback, parser); // record is the line, field is an entry
+        if(bytes_processed < chunk_size) { printf("\nFout: fout tijdens het lezen van CSV bestand. (%s)\n", csv_strerror(csv_error(parser))); exit(EXIT_FAILURE); }
+        // Give every thread a piece of each chunk, if this fails the chunks just stay small.
+        if(header_parsed && parallel.thread_count > 1 && input->chunk_size == MAPPED_FILE_CHUNK_SIZE) mapped_file_set_chunk_size(input, parallel.thread_count * PARALLEL_PARSE_PIECE_SIZE);
+        double elapsed = seconds_since(&load_start);
+        if(elapsed - last_progress >= LOAD_PROGRESS_INTERVAL)
+        {
+            print_load_progress(input->position, input->size, elapsed);
+            last_progress = elapsed;
+        }
+    }
+    print_load_progress(input->position, input->size, seconds_since(&load_start));
+    printf("\n");
+    if(input->position == 0) { printf("Fout: kon data niet lezen uit bestand.\n"); exit(EXIT_FAILURE); }
+    parse_offset = input->position;
+    csv_fini(parser, end_of_field_callback, end_of_record_callback, parser); // TODO do we want both callbacks to be called here?
+    // A lazily loaded catalog parses its records from the mapped file again, otherwise all fields have been copied out of it by now.
+    if(catalog.source == NULL) mapped_file_close(input);
+    else if(!catalog_end_source(&catalog, input)) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
+    free(parsed_fields);
+    // Search results and indexes store record indexes as 32 bits.
+    if(catalog.records_size >= UINT32_MAX) { printf("Fout: CSV bestand bevat te veel regels.\n"); exit(EXIT_FAILURE); }
+}
+
+/*
+ * Shows the first records and lets the user choose the barcode and amount columns.
+ */
+static void choose_columns(void)
+{
+    struct preview_table preview;
+    preview.records_size = (catalog.records_size < 5) ? catalog.records_size : 5;
+    preview.dots_column_count = 0;
+    for (size_t i = 0; i < preview.records_size; i++)
+    {
+        if (preview.dots_column_count < catalog_column_count(&catalog, i)) preview.dots_column_count = catalog_column_count(&catalog, i);
     }
-    sniff_and_so_on.columns = sniff_and_so_on_columns;
-    choose_columns_table[preview_length + 2] = sniff_and_so_on;
 
 
     // blame bloody Macrosuft for the following abomination, they're still stuck in 1989.
@@ -820,9 +1256,23 @@ int main(void)
         char *human_index_format = "%zu";
     #endif
 
-    print_table(choose_columns_table, preview_length + 3);
+    print_table_cells(preview.records_size + 3, preview_column_count, preview_cell, &preview);
     printf("\nAls deze voorbeeld tabel er vreemd uit ziet, kan het zijn dat u het verkeerde lijstscheidingsteken heeft ingevoerd.\n"
             "Sluit dan het programma en start het opnieuw om een ander lijstscheidingsteken te proberen.\n\n");
+    if(columns_sniffed && !dialect.has_header) printf("Let op: de eerste regel lijkt geen kolomnamen te bevatten, maar wordt wel als kolomnamen gebruikt.\n\n");
+
+    if(columns_sniffed && dialect.barcode_found && dialect.amount_found
+            && dialect.barcode_column < header.column_count && dialect.amount_column < header.column_count)
+    {
+        printf("Barcode-kolom: %zu (%s)\nAantal/voorraad-kolom: %zu (%s)\n", dialect.barcode_column + 1, header.columns[dialect.barcode_column],
+                dialect.amount_column + 1, header.columns[dialect.amount_column]);
+        if(ask("Wilt u deze kolommen gebruiken?"))
+        {
+            barcode_column_index = dialect.barcode_column;
+            amount_column_index = dialect.amount_column;
+            return;
+        }
+    }
 
 
     // Select barcode column index
@@ -862,73 +1312,530 @@ int main(void)
         amount_column_index = chosen_human_index - 1;
         break;
     }
+}
 
-    for(size_t i = 0; i < choose_columns_table[0].column_count; i++)
+/*
+ * Lets the user choose the barcode and amount columns from the records at the start of input, before the whole file is parsed.
+ * Afterwards header, catalog and parser are left as if nothing was parsed.
+ *
+ * @returns false if the start of input has no complete header, no columns are chosen then.
+ */
+static bool choose_columns_first(struct csv_parser *parser, struct mapped_file *input)
+{
+    char *sample = malloc(CSV_SNIFFER_SAMPLE_SIZE);
+    if(sample == NULL) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
+    size_t sample_size = mapped_file_peek(input, sample, CSV_SNIFFER_SAMPLE_SIZE);
+    // A record cut off by the end of the sample never ends, so it isn't shown. Parse errors are reported when the file is loaded.
+    csv_parse(parser, sample, sample_size, end_of_field_callback, end_of_record_callback, parser);
+    csv_fini(parser, NULL, NULL, NULL);
+    free(sample);
+    bool chosen = header_parsed;
+    if(chosen)
     {
-      free(choose_columns_table[0].columns[i]);
+        clearscrn();
+        choose_columns();
     }
+
+    catalog_free(&catalog);
+    // The header's text stays in the arena until the end, it is small.
+    header.columns = NULL;
+    header.column_count = 0;
+    header_parsed = false;
+    parsed_fields_size = 0;
+    return chosen;
+}
+
+static void build_indexes(void)
+{
+    printf("Barcode-index opbouwen..\n");
+    if(!barcode_index_build(&barcode_index, &catalog, barcode_column_index)) { printf("Fout: kon barcode-index niet opbouwen. (%s)\n", strerror(errno)); exit(EXIT_FAILURE); }
+    // The search indexes would hold every cell, so a lazily loaded catalog is searched by parsing its records instead.
+    if(catalog.source != NULL) return;
+    printf("Zoekindex opbouwen..\n");
+    trigram_index_built = trigram_index_build(&trigram_index, &catalog);
+    folded_text_built = folded_text_build(&folded_text, &catalog);
+    if(!trigram_index_built || !folded_text_built) { printf("Waarschuwing: kon zoekindex niet opbouwen, handmatig zoeken zal langzamer zijn.\n"); }
+    // The amount column changes while counting, and typos in amounts aren't worth forgiving anyway.
+    fuzzy_index_built = fuzzy_index_build(&fuzzy_index, &catalog, amount_column_index);
+    if(!fuzzy_index_built) { printf("Waarschuwing: kon index voor zoeken met typfouten niet opbouwen.\n"); }
+}
+
+/*
+ * Adds every record with an edited cell to edited_rows.
+ *
+ * @returns false on error
+ */
+static bool collect_edited_rows(void)
+{
+    for(size_t row = 0; row < catalog.records_size; row++)
+    {
+        for(size_t column = 0; column < catalog.column_count; column++)
+        {
+            char **edited = catalog.columns[column].edited;
+            if(edited == NULL || edited[row] == NULL) continue;
+            if(!row_list_push(&edited_rows, (uint32_t) row)) return false;
+            break;
+        }
+    }
+    return true;
+}
+
+/*
+ * Loads the header, chosen columns, catalog and indexes from the snapshot of the CSV file, if it belongs to source.
+ *
+ * @returns false if there is no usable snapshot, nothing is loaded then.
+ */
+static bool load_snapshot(const struct snapshot_source *source)
+{
+    if(!snapshot_open(&snapshot, snapshot_path, source, (unsigned char) delim)) return false;
+    struct snapshot_reader *body = &snapshot.body;
+
+    size_t column_count;
+    // Every header column takes at least a byte of the snapshot, so a damaged count can't cause a huge allocation.
+    if(!snapshot_read_size(body, &column_count) || column_count == 0 || column_count > body->size) goto damaged;
+    header.columns = arena_alloc(&parse_arena, column_count * sizeof(char *));
+    if(header.columns == NULL) goto damaged;
+    for(size_t i = 0; i < column_count; i++)
+    {
+        const char *text;
+        size_t length;
+        if(!snapshot_read_string(body, &text, &length)) goto damaged;
+        header.columns[i] = arena_strndup(&parse_arena, text, length);
+        if(header.columns[i] == NULL) goto damaged;
+    }
+    if(!snapshot_read_size(body, &barcode_column_index) || !snapshot_read_size(body, &amount_column_index)) goto damaged;
+    if(barcode_column_index >= column_count || amount_column_index >= column_count) goto damaged;
+
+    if(!catalog_load_snapshot(&catalog, body) || catalog.records_size >= UINT32_MAX) goto damaged;
+    if(!barcode_index_load_snapshot(&barcode_index, body)) goto damaged;
+    if(!trigram_index_load_snapshot(&trigram_index, body)) goto damaged;
+    if(!fuzzy_index_load_snapshot(&fuzzy_index, body)) goto damaged;
+    if(!catalog_load_edits(&catalog, &snapshot.edits, column_count)) goto damaged;
+    // The catalog and indexes point into the snapshot, it stays open until they are freed.
+    snapshot_opened = true;
+    header.column_count = column_count;
+    header_parsed = true;
+    return true;
+
+    damaged:
+    catalog_free(&catalog);
+    barcode_index_free(&barcode_index);
+    trigram_index_free(&trigram_index);
+    fuzzy_index_free(&fuzzy_index);
+    snapshot_close(&snapshot);
+    // The header's text stays in the arena until the end, it is small.
+    header.columns = NULL;
+    return false;
+}
+
+/*
+ * Saves the header, chosen columns, catalog and indexes to a new snapshot belonging to source.
+ *
+ * @returns false on error
+ */
+static bool create_snapshot(const struct snapshot_source *source)
+{
+    struct snapshot_writer writer;
+    if(!snapshot_create(&writer, snapshot_path)) return false;
+    bool written = snapshot_write_size(&writer, header.column_count);
+    for(size_t i = 0; written && i < header.column_count; i++) written = snapshot_write_string(&writer, header.columns[i]);
+    written = written && snapshot_write_size(&writer, barcode_column_index) && snapshot_write_size(&writer, amount_column_index)
+        && catalog_save_snapshot(&catalog, &writer) && barcode_index_save_snapshot(&barcode_index, &writer)
+        && trigram_index_save_snapshot(&trigram_index, &writer) && fuzzy_index_save_snapshot(&fuzzy_index, &writer);
+    snapshot_begin_edits(&writer);
+    written = written && catalog_save_edits(&catalog, &writer);
+    if(!written || !snapshot_finish(&writer, source, (unsigned char) delim)) { snapshot_discard(&writer); return false; }
+    return true;
+}
+
+/*
+ * Stores a new amount for record row in memory, it is handed over to the save thread separately.
+ *
+ * @returns false on error
+ */
+static bool set_amount(size_t row, const char *amount)
+{
+    if(!catalog_set_cell(&catalog, row, amount_column_index, amount)) return false;
+    if((trigram_index_built || folded_text_built) && !row_list_insert_sorted(&edited_rows, (uint32_t) row))
+    {
+        // Without the edited record in the list, the manual search could miss it.
+        trigram_index_free(&trigram_index);
+        trigram_index_built = false;
+        folded_text_free(&folded_text);
+        folded_text_built = false;
+    }
+    return true;
+}
+
+static const char *barcode_of_row(size_t row)
+{
+    if(catalog_column_count(&catalog, row) <= barcode_column_index) return "";
+    return catalog_cell(&catalog, row, barcode_column_index);
+}
+
+static const char *amount_of_row(size_t row)
+{
+    if(catalog_column_count(&catalog, row) <= amount_column_index) return "";
+    return catalog_cell(&catalog, row, amount_column_index);
+}
+
+/*
+ * Stores a counted amount for record row, and hands it over to the save thread, which journals it before anything is shown.
+ * If it can't be handed over, the old amount is put back, so no amount is shown that won't be saved.
+ *
+ * @returns false on error
+ */
+static bool count_amount(size_t row, const char *amount)
+{
+    // The current amount may live in a buffer which set_amount reuses.
+    const char *current = amount_of_row(row);
+    size_t length = strlen(current);
+    char *old_amount = malloc(length + 1);
+    if(old_amount == NULL) return false;
+    memcpy(old_amount, current, length + 1);
+    bool counted = set_amount(row, amount);
+    if(counted && !save_thread_count(&saver, row, barcode_of_row(row), old_amount, amount))
+    {
+        set_amount(row, old_amount);
+        counted = false;
+    }
+    free(old_amount);
+    return counted;
+}
+
+struct journal_replay
+{
+    size_t replayed;
+    size_t skipped;     // Counts for records which aren't there anymore, or have another barcode now.
+    size_t damaged;     // Counts which were only partly written to the journal.
+    bool error;
+};
+
+static void replay_count(size_t row, const char *barcode, const char *old_amount, const char *new_amount, void *data)
+{
+    struct journal_replay *replay = data;
+    (void) old_amount; // The last count wins, whatever the amount was before.
+    if(row >= catalog.records_size || strcmp(barcode_of_row(row), barcode) != 0) { replay->skipped++; return; }
+    if(!set_amount(row, new_amount) || !save_thread_restore(&saver, row, new_amount)) { replay->error = true; return; }
+    replay->replayed++;
+}
+
+/*
+ * Replays the journal a previous session left behind, opens it for this session and saves the replayed counts,
+ * which clears the journal. If the journal can't be opened, every count is saved right away.
+ */
+static void open_count_journal(const char *csv_path)
+{
+    char *path = count_journal_path_of(csv_path);
+    if(path == NULL) { printf("Waarschuwing: kon logboek niet openen, elke telling wordt meteen opgeslagen.\n"); return; }
+    struct journal_replay replay;
+    replay.replayed = 0;
+    replay.skipped = 0;
+    replay.error = false;
+    if(!count_journal_replay(path, replay_count, &replay, &replay.damaged) || replay.error) { printf("Fout: kon logboek %s niet inlezen. (%s)\n", path, strerror(errno)); exit(EXIT_FAILURE); }
+    if(!save_thread_open_journal(&saver, path, COUNT_JOURNAL_SYNC_INTERVAL, COUNT_JOURNAL_COMPACT_EVENTS)) { printf("Waarschuwing: kon logboek niet openen, elke telling wordt meteen opgeslagen.\n"); }
+    if(replay.replayed > 0 || replay.skipped > 0 || replay.damaged > 0)
+    {
+        printf("%zu tellingen hersteld uit het logboek van de vorige keer.\n", replay.replayed);
+        if(replay.skipped > 0) printf("Waarschuwing: %zu tellingen in het logboek horen niet bij dit bestand en zijn overgeslagen.\n", replay.skipped);
+        if(replay.damaged > 0) printf("Waarschuwing: %zu tellingen in het logboek zijn beschadigd en overgeslagen, controleer deze aantallen.\n", replay.damaged);
+        if(!save_thread_flush(&saver))
+        {
+            int error_number = 0;
+            save_thread_take_error(&saver, &error_number);
+            printf("Fout: kon herstelde tellingen niet opslaan. (%s)\n", strerror(error_number));
+        }
+        printf("Druk op enter om verder te gaan.."); fflush(stdout);
+        free(fgetline(stdin));
+    }
+}
+
+static const char *delimiter_name(unsigned char c)
+{
+    switch(c)
+    {
+        case ';': return "puntkomma (;)";
+        case ',': return "komma (,)";
+        case '\t': return "tab";
+        case '|': return "verticale streep (|)";
+        default: return "onbekend";
+    }
+}
+
+/*
+ * Sniffs the delimiter and columns from the start of input, and lets the user confirm the delimiter or enter another one.
+ */
+static void choose_dialect(struct mapped_file *input)
+{
+    char *sample = malloc(CSV_SNIFFER_SAMPLE_SIZE);
+    if(sample == NULL) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
+    size_t sample_size = mapped_file_peek(input, sample, CSV_SNIFFER_SAMPLE_SIZE);
+    bool confirmed = sample_size > 0 && csv_sniff_dialect(sample, sample_size, &dialect);
+    clearscrn();
+    if(confirmed)
+    {
+        printf("Lijstscheidingsteken: %s\n", delimiter_name(dialect.delim));
+        if(dialect.quote != CSV_QUOTE) printf("Aanhalingsteken: %c\n", dialect.quote);
+        confirmed = ask("Klopt dit?");
+    }
+    if(!confirmed)
+    {
+        printf("Voer lijstscheidingsteken in (meestal een komma of puntkomma): "); fflush(stdout);
+        int c = fgetc(stdin);
+        if(c == EOF) { printf("Fout.\n"); exit(EXIT_FAILURE); }
+        fgetc(stdin);
+        dialect.delim = (unsigned char) c;
+        dialect.quote = CSV_QUOTE;
+    }
+    delim = dialect.delim;
+    quote = dialect.quote;
+    // The columns are sniffed with the delimiter which is actually used.
+    columns_sniffed = sample_size > 0 && csv_sniff_columns(sample, sample_size, &dialect);
+    free(sample);
+}
+
+void at_exit_callback(void)
+{
+    printf("Druk op enter om het programma te sluiten..\n");
+    getchar();
+}
+
+int main(void)
+{
+    atexit(at_exit_callback);
+    clearscrn_true();
+    print_welcome();
+
+    FILE *infile;
+    char *msg1 = "Voer pad naar CSV bestand in (bijvoorbeeld: C:\\Users\\Jan\\Desktop\\artikelen.csv): ";
+    printf("%s", msg1); fflush(stdout);
+    char *inpath;
+    while (true)
+    {
+        inpath = fgetline(stdin);
+        if(inpath == NULL) { printf("Fout: %s\n", strerror(errno)); exit(EXIT_FAILURE); }
+
+        infile = fopen(inpath, "r+");
+        if(infile == NULL)
+        {
+            clearscrn();
+            printf("Fout: kon bestand niet openen. (%s)\n", strerror(errno));
+            printf("%s", msg1); fflush(stdout);
+            free(inpath);
+        }
+        else
+        {
+            break;
+        }
+    }
+    struct mapped_file input;
+    if(!mapped_file_open(&input, infile)) { printf("Fout: kon bestand niet lezen. (%s)\n", strerror(errno)); exit(EXIT_FAILURE); }
+    choose_dialect(&input);
+
+
+    char *outpath;
+    FILE *outfile;
+    if(ask("Wilt u het bijgewerkte bestand in een nieuw bestand opslaan?\n  Dit kan veiliger zijn i.v.m. gegevensverlies terwijl de wijzigingen worden opgeslagen."))
+    {
+        char *msg2 = "Voer pad naar CSV bestand voor wijzigingen in (bijvoorbeeld: C:\\Users\\Jan\\Desktop\\bijgewerkt.csv): ";
+        printf("%s", msg2); fflush(stdout);
+        while (true)
+        {
+            outpath = fgetline(stdin);
+            if (outpath == NULL) { printf("Fout: %s\n", strerror(errno)); exit(EXIT_FAILURE); }
+            if (strcmp(outpath, inpath) == 0) { free(outpath); outpath = inpath; break; }
+            outfile = fopen(outpath, "w");
+            if (outfile == NULL)
+            {
+                clearscrn();
+                printf("Fout: kon bestand niet openen. (%s)\n", strerror(errno));
+                printf("%s", msg2); fflush(stdout);
+                free(outpath);
+            }
+            else
+            {
+                break;
+            }
+        }
+    }
+    else
+    {
+        outpath = inpath;
+    }
+
     clearscrn();
 
+    printf("CSV bestand inladen.."); fflush(stdout);
+    catalog_init(&catalog);
+    arena_init(&parse_arena);
+    struct csv_parser parser;
+    if(csv_init(&parser, 0) != 0) { printf("Fout: kon parser niet initialiseren.\n"); exit(EXIT_FAILURE); }
+    csv_set_delim(&parser, delim);
+    csv_set_quote(&parser, quote);
+    csv_set_realloc_func(&parser, parser_realloc);
+    csv_set_free_func(&parser, parser_free);
+    snapshot_path = snapshot_path_of(inpath);
+    struct snapshot_source source;
+    bool source_known = snapshot_path != NULL && snapshot_source_of(&source, &input);
+    bool snapshot_loaded = source_known && load_snapshot(&source);
+    bool columns_chosen = false;
+    if(snapshot_loaded)
+    {
+        mapped_file_close(&input);
+        printf("\n");
+    }
+    else
+    {
+        clearscrn();
+        // The records of a lazily loaded catalog are parsed from the mapping again.
+        // Its barcode and amount columns are stored while the file is loaded, so they are chosen from the start of the file first.
+        if(input.mapped && ask("Wilt u alleen de barcode- en aantal-kolom meteen inladen?\n  Dit is sneller en gebruikt minder geheugen, maar handmatig zoeken is dan langzamer en zoeken met typfouten kan niet."))
+        {
+            columns_chosen = choose_columns_first(&parser, &input);
+            if(!columns_chosen) { printf("Waarschuwing: de eerste regel is te lang om de kolommen vooraf te kiezen, alle kolommen worden ingeladen.\n"); }
+            size_t columns[] = { barcode_column_index, amount_column_index };
+            if(columns_chosen && !catalog_init_lazy(&catalog, &parser, columns, 2)) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
+            clearscrn();
+        }
+        printf("CSV bestand inladen.."); fflush(stdout);
+        parse_csv(&parser, &input);
+    }
+
+    clearscrn();
+
+    // The snapshot is only updated along with the CSV file if it belongs to the loaded file as it is now.
+    bool snapshot_current = snapshot_loaded;
+    bool indexes_built = false;
+    if(snapshot_loaded)
+    {
+        printf("Momentopname van het CSV bestand ingeladen.\nBarcode-kolom: %s\nAantal/voorraad-kolom: %s\n\n",
+                header.columns[barcode_column_index], header.columns[amount_column_index]);
+        columns_chosen = ask("Wilt u deze kolommen weer gebruiken?");
+        indexes_built = columns_chosen;
+        if(columns_chosen)
+        {
+            trigram_index_built = true;
+            fuzzy_index_built = true;
+            folded_text_built = folded_text_build(&folded_text, &catalog);
+            if(!folded_text_built) { printf("Waarschuwing: kon zoekindex niet opbouwen, handmatig zoeken zal langzamer zijn.\n"); }
+        }
+        else
+        {
+            // The indexes depend on the chosen columns, they are built again.
+            barcode_index_free(&barcode_index);
+            trigram_index_free(&trigram_index);
+            fuzzy_index_free(&fuzzy_index);
+            clearscrn();
+        }
+    }
+    if(!columns_chosen)
+    {
+        choose_columns();
+        clearscrn();
+    }
+    if(!indexes_built)
+    {
+        build_indexes();
+        if(source_known && trigram_index_built && fuzzy_index_built)
+        {
+            printf("Momentopname opslaan..\n");
+            snapshot_current = create_snapshot(&source);
+            if(!snapshot_current) { printf("Waarschuwing: kon momentopname voor snel opstarten niet opslaan.\n"); }
+        }
+    }
+    row_list_init(&edited_rows);
+    // Cells edited in an earlier session come from the snapshot, they are checked like cells edited now.
+    if(!collect_edited_rows()) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
+    // The save thread reads the columns array of the catalog, so it may not grow anymore while counting.
+    if(!catalog_add_columns(&catalog, header.column_count)) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. (%s) (main.c:%i)\n", strerror(errno), __LINE__); exit(EXIT_FAILURE); }
+    const char *saved_snapshot_path = outpath == inpath && snapshot_current ? snapshot_path : NULL;
+    if(!save_thread_start(&saver, &catalog, &header, outpath, saved_snapshot_path, amount_column_index, (unsigned char) delim, quote))
+    {
+        printf("Fout: kon opslaan niet starten. (%s) (main.c:%i)\n", strerror(errno), __LINE__);
+        exit(EXIT_FAILURE);
+    }
+    open_count_journal(outpath);
+
     while(true)
     {
-        bool save_error = false;
+        int save_error;
 
         clearscrn();
-        if(save_error) { printf("Fout: kon bestand niet opslaan. (%s ?)\n", strerror(errno)); save_error = false; }
-        printf("Voer barcode in (druk op enter om meteen handmatig te zoeken):\a "); fflush(stdout);
+        if(save_thread_take_error(&saver, &save_error)) { printf("Fout: kon bestand niet opslaan. (%s ?)\n", strerror(save_error)); }
+        printf("Voer barcode in (druk op enter om meteen handmatig te zoeken, voer !opslaan in om op te slaan of !stoppen om af te sluiten):\a "); fflush(stdout);
         char *barcode = fgetline(stdin);
         struct search_result result;
-        struct record *record;
         if(barcode == NULL)
         {
             printf("Fout: %s\n", strerror(errno));
             continue;
         }
+        else if(strcmp(barcode, "!opslaan") == 0)
+        {
+            free(barcode);
+            printf("Opslaan.."); fflush(stdout);
+            save_thread_flush(&saver);
+            continue;
+        }
+        else if(strcmp(barcode, "!stoppen") == 0)
+        {
+            free(barcode);
+            break;
+        }
         else if(barcode[0] == '\0')
         {
             result = do_manual_search();
             if(result.error) { printf("Fout: %s", strerror(errno)); free(barcode); continue; }
-            record = result.record;
-            if(record == NULL) { free(barcode); continue; }
+            if(!result.found) { free(barcode); continue; }
         }
         else
         {
             result = do_barcode_search(barcode);
             if(result.error) { printf("Fout: %s", strerror(errno)); free(barcode); continue; }
-            record = result.record;
-            if(record == NULL)
+            if(!result.found)
             {
                 clearscrn();
                 printf("Kon geen product met barcode %s vinden. ", barcode); // no newline and purpose
                 if(!ask("Wilt u handmatig zoeken?")) { free(barcode); continue; }
                 result = do_manual_search();
                 if(result.error) { printf("Fout: %s", strerror(errno)); free(barcode); continue; }
-                record = result.record;
-                if(record == NULL) { free(barcode); continue; }
+                if(!result.found) { free(barcode); continue; }
             }
         }
         free(barcode);
 
         clearscrn();
         printf("Dit product is gevonden:\n");
-        struct record table_records[2];
-        table_records[0] = header;
-        table_records[1] = *record;
-        print_table(table_records, 2);
+        print_record_table(result.row);
 
         printf("Voer aantal in (of druk op enter om niks te veranderen en opnieuw te zoeken): "); fflush(stdout);
         char *amount = fgetline(stdin);
         if(amount == NULL) { printf("Fout: kon ingevoerd aantal niet lezen (%s). Kon aantal hierdoor niet opslaan.\n", strerror(errno)); continue; }
-        if(*amount == '\0') continue;
-        free(record->columns[amount_column_index]);
-        record->columns[amount_column_index] = amount;
-        to_free_add(amount);
-        if(!save(&parser, records, records_size, outpath)) save_error = true;
+        if(*amount == '\0') { free(amount); continue; }
+        bool stored = count_amount(result.row, amount);
+        free(amount);
+        if(!stored) { printf("Fout: kon geen extra geheugen-ruimte aanvragen. Kon aantal hierdoor niet opslaan.\n"); continue; }
+    }
+    printf("Opslaan.."); fflush(stdout);
+    int error_number;
+    if(!save_thread_stop(&saver, &error_number))
+    {
+        printf("\nFout: kon tellingen niet opslaan. (%s) Ze worden de volgende keer uit het logboek hersteld.\n", strerror(error_number));
     }
-    // TODO free all columns in records, remove to_free construct as it is no longer needed
+    else printf("\n");
     csv_free(&parser);
-    to_free_free();
+    arena_free(&parse_arena);
+    catalog_free(&catalog);
+    barcode_index_free(&barcode_index);
+    trigram_index_free(&trigram_index);
+    folded_text_free(&folded_text);
+    fuzzy_index_free(&fuzzy_index);
+    if(snapshot_opened) snapshot_close(&snapshot);
+    row_list_free(&edited_rows);
+    query_free(&previous_query);
+    row_list_free(&previous_matches);
     if (outpath != inpath) free(outpath);
     free(inpath);
+    free(snapshot_path);
     return EXIT_SUCCESS;
 }
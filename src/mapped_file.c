@@ -0,0 +1,171 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// fileno, mmap and friends are not part of C11.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mapped_file.h"
+
+#ifdef __unix__
+    #include <unistd.h>
+    #ifdef _POSIX_VERSION
+        #define POSIX
+        #include <sys/types.h>
+        #include <sys/stat.h>
+        #include <sys/mman.h>
+    #endif
+#endif
+
+#ifdef POSIX
+/*
+ * @returns false if the file could not be mapped, it may still be readable.
+ */
+static bool map_file(struct mapped_file *file)
+{
+    int fd = fileno(file->stream);
+    if(fd == -1) return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    if(st.st_size < 0 || (uintmax_t) st.st_size > SIZE_MAX) return false;
+    file->size = (size_t) st.st_size;
+    // An empty file cannot be mapped, but there is nothing to read either.
+    if(st.st_size == 0) return false;
+
+    void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED) return false;
+    // The parser reads the file from start to end once.
+    posix_madvise(data, (size_t) st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    file->data = data;
+    file->mapped = true;
+    return true;
+}
+#endif
+
+bool mapped_file_open(struct mapped_file *file, FILE *stream)
+{
+    file->stream = stream;
+    file->data = NULL;
+    file->size = 0;
+    file->position = 0;
+    file->released = 0;
+    file->chunk_size = MAPPED_FILE_CHUNK_SIZE;
+    file->mapped = false;
+#ifdef POSIX
+    if(map_file(file)) return true;
+#endif
+    file->data = malloc(MAPPED_FILE_CHUNK_SIZE);
+    return file->data != NULL;
+}
+
+bool mapped_file_next_chunk(struct mapped_file *file, const char **chunk, size_t *chunk_size)
+{
+#ifdef POSIX
+    if(file->mapped)
+    {
+        // The previous chunk has been parsed, its pages can go.
+        if(file->position > file->released)
+        {
+            posix_madvise((void *) (file->data + file->released), file->position - file->released, POSIX_MADV_DONTNEED);
+            file->released = file->position;
+        }
+        size_t left = file->size - file->position;
+        *chunk = file->data + file->position;
+        *chunk_size = (left < file->chunk_size) ? left : file->chunk_size;
+        file->position += *chunk_size;
+        return true;
+    }
+#endif
+    char *buffer = (char *) file->data;
+    *chunk = buffer;
+    *chunk_size = fread(buffer, 1, file->chunk_size, file->stream);
+    if(*chunk_size < file->chunk_size && ferror(file->stream)) return false;
+    file->position += *chunk_size;
+    return true;
+}
+
+bool mapped_file_set_chunk_size(struct mapped_file *file, size_t chunk_size)
+{
+    if(chunk_size == 0) return false;
+    if(!file->mapped)
+    {
+        char *buffer = realloc((void *) file->data, chunk_size);
+        if(buffer == NULL) return false;
+        file->data = buffer;
+    }
+    file->chunk_size = chunk_size;
+    return true;
+}
+
+size_t mapped_file_peek(struct mapped_file *file, char *buffer, size_t size)
+{
+    if(file->position != 0) return 0;
+    if(file->mapped)
+    {
+        size_t copied = (file->size < size) ? file->size : size;
+        memcpy(buffer, file->data, copied);
+        return copied;
+    }
+    size_t copied = fread(buffer, 1, size, file->stream);
+    if(fseek(file->stream, 0, SEEK_SET) != 0) return 0;
+    clearerr(file->stream);
+    return copied;
+}
+
+size_t mapped_file_count_lines(const struct mapped_file *file)
+{
+    if(!file->mapped) return 0;
+    size_t lines = 0;
+    const char *position = file->data;
+    const char *end = file->data + file->size;
+    while((position = memchr(position, '\n', end - position)) != NULL)
+    {
+        lines++;
+        position++;
+    }
+    return lines;
+}
+
+void mapped_file_advise_random(struct mapped_file *file)
+{
+#ifdef POSIX
+    if(file->mapped) posix_madvise((void *) file->data, file->size, POSIX_MADV_RANDOM);
+#else
+    (void) file;
+#endif
+}
+
+void mapped_file_close(struct mapped_file *file)
+{
+#ifdef POSIX
+    if(file->mapped) munmap((void *) file->data, file->size);
+    else free((void *) file->data);
+#else
+    free((void *) file->data);
+#endif
+    if(file->stream != NULL) fclose(file->stream);
+    file->stream = NULL;
+    file->data = NULL;
+    file->size = 0;
+    file->mapped = false;
+}
@@ -0,0 +1,91 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VOORRAADTELLEN_MAPPED_FILE_H
+#define VOORRAADTELLEN_MAPPED_FILE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define MAPPED_FILE_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * File which is read front to back in chunks of at most chunk_size bytes,
+ * so loading it never needs memory for the whole file.
+ * On POSIX systems the file is memory mapped and chunks are windows of the mapping,
+ * which are released again once the next chunk is requested.
+ * Elsewhere, or if mapping fails, chunks are read into a buffer instead.
+ */
+struct mapped_file
+{
+    FILE *stream;
+    const char *data;   // The whole file if mapped, otherwise the buffer chunks are read into.
+    size_t size;        // Size of the file, or 0 if it is unknown.
+    size_t position;    // Amount of bytes handed out as chunks so far.
+    size_t released;    // Mapped bytes before this offset have been released.
+    size_t chunk_size;  // MAPPED_FILE_CHUNK_SIZE unless changed by mapped_file_set_chunk_size.
+    bool mapped;
+};
+
+/*
+ * Opens the file behind stream, which has to be at its start.
+ * stream is closed by mapped_file_close.
+ *
+ * @returns false on error, with errno set
+ */
+bool mapped_file_open(struct mapped_file *file, FILE *stream);
+
+/*
+ * Sets *chunk to the next part of the file, which stays valid until the next call.
+ * *chunk_size is set to 0 at the end of the file.
+ *
+ * @returns false on error
+ */
+bool mapped_file_next_chunk(struct mapped_file *file, const char **chunk, size_t *chunk_size);
+
+/*
+ * Changes the size of the chunks handed out from now on.
+ *
+ * @returns false on error, the chunk size is left alone then.
+ */
+bool mapped_file_set_chunk_size(struct mapped_file *file, size_t chunk_size);
+
+/*
+ * Copies up to size bytes from the start of the file into buffer, before any chunk has been handed out.
+ * The chunks still start at the beginning of the file afterwards.
+ *
+ * @returns the amount of bytes copied, or 0 on error
+ */
+size_t mapped_file_peek(struct mapped_file *file, char *buffer, size_t size);
+
+/*
+ * Counts the newlines in the file without reading it through the chunks.
+ *
+ * @returns the amount of newlines, or 0 if the file is not mapped
+ */
+size_t mapped_file_count_lines(const struct mapped_file *file);
+
+/*
+ * Tells the system that the mapped file is read in any order from now on, instead of front to back.
+ */
+void mapped_file_advise_random(struct mapped_file *file);
+
+void mapped_file_close(struct mapped_file *file);
+
+#endif
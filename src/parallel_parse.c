@@ -0,0 +1,178 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// sysconf is not part of C11.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+
+#ifdef HAVE_THREADS_H
+    #include <threads.h>
+#endif
+
+#include "parallel_parse.h"
+
+#ifdef __unix__
+    #include <unistd.h>
+    #ifdef _POSIX_VERSION
+        #define POSIX
+    #endif
+#endif
+
+size_t parallel_parse_thread_count(void)
+{
+#if defined(POSIX) && defined(HAVE_THREADS_H)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if(count < 1) return 1;
+    if(count > PARALLEL_PARSE_THREADS_MAX) return PARALLEL_PARSE_THREADS_MAX;
+    return (size_t) count;
+#else
+    return 1;
+#endif
+}
+
+#ifndef HAVE_THREADS_H
+
+size_t parallel_parse(const struct parallel_parser *parallel, const char *data, size_t size)
+{
+    return csv_parse(parallel->parser, data, size, parallel->end_of_field_callback, parallel->end_of_record_callback, parallel->parser);
+}
+
+#else
+
+struct piece
+{
+    const char *data;
+    size_t size;
+    size_t offset;  // Where data starts in the CSV file.
+    struct csv_parser parser;
+    struct catalog catalog;
+    thrd_t thread;
+    bool started;
+    bool error;
+    bool clean; // Parsed without errors and ended between two rows.
+};
+
+/*
+ * Finds where the pieces start, a piece starts right after a newline which is not inside quotes.
+ * The last piece ends after the last such newline, the data after it is left for the parser.
+ *
+ * @returns the amount of pieces, at most count, starts[0] up to and including starts[pieces] are set.
+ */
+static size_t split(const char *data, size_t size, unsigned char quote, size_t count, size_t *starts)
+{
+    size_t pieces = 0;
+    size_t row_end = 0;
+    size_t piece_size = size / count;
+    // Assumes data does not start inside quotes, the first piece then doesn't end between two rows, which is caught.
+    bool quoted = false;
+    starts[0] = 0;
+    for(size_t i = 0; i < size; i++)
+    {
+        if((unsigned char) data[i] == quote) quoted = !quoted;
+        else if(data[i] == '\n' && !quoted)
+        {
+            row_end = i + 1;
+            if(pieces + 1 < count && row_end >= (pieces + 1) * piece_size) starts[++pieces] = row_end;
+        }
+    }
+    if(row_end > starts[pieces]) starts[++pieces] = row_end;
+    return pieces;
+}
+
+static void piece_field_callback(void *parsed_data, size_t len, void *callback_data)
+{
+    struct piece *piece = callback_data;
+    if(!piece->error && !catalog_append_field(&piece->catalog, parsed_data, len)) piece->error = true;
+}
+
+static void piece_record_callback(int c, void *callback_data)
+{
+    struct piece *piece = callback_data;
+    if(piece->error) return;
+    bool stored = (piece->catalog.source != NULL) ? catalog_end_lazy_record(&piece->catalog, piece->offset + csv_row_end(&piece->parser)) : catalog_end_record(&piece->catalog);
+    if(!stored) piece->error = true;
+}
+
+static int parse_piece(void *arg)
+{
+    struct piece *piece = arg;
+    size_t bytes_processed = csv_parse(&piece->parser, piece->data, piece->size, piece_field_callback, piece_record_callback, piece);
+    piece->clean = !piece->error && bytes_processed == piece->size && csv_at_row_start(&piece->parser);
+    return 0;
+}
+
+/*
+ * Starts parsing a piece on a new thread, with a parser and catalog set up like those of parallel.
+ * If that fails the piece is left unparsed, which makes the caller parse it instead.
+ */
+static void start_piece(struct piece *piece, const struct parallel_parser *parallel, const char *data, size_t size, size_t offset)
+{
+    struct csv_parser *parser = parallel->parser;
+    piece->data = data;
+    piece->size = size;
+    piece->offset = offset;
+    piece->started = false;
+    piece->error = false;
+    piece->clean = false;
+    if(!catalog_init_like(&piece->catalog, parallel->catalog)) return;
+    if(csv_init(&piece->parser, (unsigned char) csv_get_opts(parser)) != 0) return;
+    csv_set_delim(&piece->parser, csv_get_delim(parser));
+    csv_set_quote(&piece->parser, csv_get_quote(parser));
+    csv_set_space_func(&piece->parser, parser->is_space);
+    csv_set_term_func(&piece->parser, parser->is_term);
+    if(thrd_create(&piece->thread, parse_piece, piece) != thrd_success) { csv_free(&piece->parser); return; }
+    piece->started = true;
+}
+
+size_t parallel_parse(const struct parallel_parser *parallel, const char *data, size_t size)
+{
+    struct csv_parser *parser = parallel->parser;
+    size_t count = parallel->thread_count;
+    if(count > PARALLEL_PARSE_THREADS_MAX) count = PARALLEL_PARSE_THREADS_MAX;
+    size_t starts[PARALLEL_PARSE_THREADS_MAX + 1];
+    size_t pieces = (count > 1) ? split(data, size, csv_get_quote(parser), count, starts) : 0;
+    if(pieces < 2) return csv_parse(parser, data, size, parallel->end_of_field_callback, parallel->end_of_record_callback, parser);
+
+    size_t data_offset = *parallel->data_offset;
+    struct piece piece_list[PARALLEL_PARSE_THREADS_MAX];
+    for(size_t i = 1; i < pieces; i++) start_piece(piece_list + i, parallel, data + starts[i], starts[i + 1] - starts[i], data_offset + starts[i]);
+
+    size_t bytes_processed = csv_parse(parser, data, starts[1], parallel->end_of_field_callback, parallel->end_of_record_callback, parser);
+    // Parsing a piece only gives the same records as parser would if parser is between two rows at its start.
+    bool clean = bytes_processed == starts[1] && csv_at_row_start(parser);
+    size_t position = starts[1];
+    for(size_t i = 1; i < pieces; i++)
+    {
+        struct piece *piece = piece_list + i;
+        if(piece->started)
+        {
+            thrd_join(piece->thread, NULL);
+            csv_free(&piece->parser);
+        }
+        // If appending fails the parser parses the piece instead, and reports the error through its callbacks.
+        if(clean && piece->clean && catalog_append(parallel->catalog, &piece->catalog)) position = starts[i + 1];
+        else clean = false;
+        catalog_free(&piece->catalog);
+    }
+    if(bytes_processed < starts[1]) return bytes_processed;
+    *parallel->data_offset = data_offset + position;
+    return position + csv_parse(parser, data + position, size - position, parallel->end_of_field_callback, parallel->end_of_record_callback, parser);
+}
+
+#endif
@@ -0,0 +1,64 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VOORRAADTELLEN_PARALLEL_PARSE_H
+#define VOORRAADTELLEN_PARALLEL_PARSE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <csv.h>
+
+#include "catalog.h"
+
+#define PARALLEL_PARSE_THREADS_MAX 16
+// Bytes each thread parses per call of parallel_parse, if the caller hands it that much.
+#define PARALLEL_PARSE_PIECE_SIZE (4 * 1024 * 1024)
+
+/*
+ * Parses CSV data on several threads, with the same result as calling csv_parse on parser.
+ * The data is split into pieces at newlines which are not inside quotes, going by a count of the quotes before them.
+ * The first piece is parsed by parser on the calling thread, the other pieces by worker threads into catalogs of their own.
+ * A piece is only used if the piece before it ended between two rows,
+ * otherwise the split was wrong and parser parses the rest of the data itself.
+ * The records of the used pieces are appended to catalog in order, like end_of_record_callback would have done.
+ * The callbacks get parser as their callback data.
+ */
+struct parallel_parser
+{
+    struct csv_parser *parser;
+    void (*end_of_field_callback)(void *, size_t, void *);
+    void (*end_of_record_callback)(int, void *);
+    struct catalog *catalog;
+    size_t thread_count;
+    // Where the data starts in the CSV file, set by the caller.
+    // Moved along before parser parses the data after the pieces, so a lazily loaded catalog can store where records end.
+    size_t *data_offset;
+};
+
+/*
+ * @returns the amount of threads worth parsing on, at most PARALLEL_PARSE_THREADS_MAX
+ */
+size_t parallel_parse_thread_count(void);
+
+/*
+ * @returns the amount of bytes parsed, less than size on error like csv_parse
+ */
+size_t parallel_parse(const struct parallel_parser *parallel, const char *data, size_t size);
+
+#endif
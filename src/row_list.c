@@ -0,0 +1,132 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <safe_math.h>
+
+#include "row_list.h"
+
+void row_list_init(struct row_list *list)
+{
+    list->rows = NULL;
+    list->size = 0;
+    list->capacity = 0;
+}
+
+void row_list_free(struct row_list *list)
+{
+    free(list->rows);
+    row_list_init(list);
+}
+
+bool row_list_reserve(struct row_list *list, size_t capacity)
+{
+    if(capacity <= list->capacity) return true;
+    size_t size;
+    if(!psnip_safe_mul(&size, capacity, sizeof(uint32_t))) return false;
+    uint32_t *tmp = realloc(list->rows, size);
+    if(tmp == NULL) return false;
+    list->rows = tmp;
+    list->capacity = capacity;
+    return true;
+}
+
+static bool row_list_grow(struct row_list *list)
+{
+    size_t capacity;
+    if(list->capacity == 0) capacity = 64;
+    else if(!psnip_safe_mul(&capacity, list->capacity, 2)) return false;
+    return row_list_reserve(list, capacity);
+}
+
+bool row_list_push(struct row_list *list, uint32_t row)
+{
+    if(list->size == list->capacity && !row_list_grow(list)) return false;
+    list->rows[list->size++] = row;
+    return true;
+}
+
+bool row_list_insert_sorted(struct row_list *list, uint32_t row)
+{
+    size_t low = 0;
+    size_t high = list->size;
+    while(low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if(list->rows[middle] < row) low = middle + 1; else high = middle;
+    }
+    if(low < list->size && list->rows[low] == row) return true;
+
+    if(list->size == list->capacity && !row_list_grow(list)) return false;
+    memmove(list->rows + low + 1, list->rows + low, (list->size - low) * sizeof(uint32_t));
+    list->rows[low] = row;
+    list->size++;
+    return true;
+}
+
+bool row_list_union(struct row_list *out, const struct row_list *a, const struct row_list *b)
+{
+    size_t capacity;
+    if(!psnip_safe_add(&capacity, a->size, b->size)) return false;
+    if(!row_list_reserve(out, capacity)) return false;
+
+    size_t i = 0, j = 0, k = 0;
+    while(i < a->size && j < b->size)
+    {
+        if(a->rows[i] < b->rows[j]) out->rows[k++] = a->rows[i++];
+        else if(b->rows[j] < a->rows[i]) out->rows[k++] = b->rows[j++];
+        else { out->rows[k++] = a->rows[i++]; j++; }
+    }
+    while(i < a->size) out->rows[k++] = a->rows[i++];
+    while(j < b->size) out->rows[k++] = b->rows[j++];
+    out->size = k;
+    return true;
+}
+
+void row_list_intersect(struct row_list *list, const uint32_t *other, size_t other_size)
+{
+    size_t kept = 0;
+    size_t j = 0;
+    for(size_t i = 0; i < list->size; i++)
+    {
+        uint32_t row = list->rows[i];
+        if(j < other_size && other[j] < row)
+        {
+            // Double the step until other[j + step] is not below row, then binary search that range.
+            size_t step = 1;
+            while(j + step < other_size && other[j + step] < row)
+            {
+                j += step;
+                step *= 2;
+            }
+            size_t low = j + 1;
+            size_t high = (j + step < other_size) ? j + step : other_size;
+            while(low < high)
+            {
+                size_t middle = low + (high - low) / 2;
+                if(other[middle] < row) low = middle + 1; else high = middle;
+            }
+            j = low;
+        }
+        if(j == other_size) break;
+        if(other[j] == row) list->rows[kept++] = row;
+    }
+    list->size = kept;
+}
@@ -0,0 +1,71 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VOORRAADTELLEN_ROW_LIST_H
+#define VOORRAADTELLEN_ROW_LIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Growable array of record indexes.
+ * Record indexes are stored as 32 bits to keep index data compact,
+ * the search indexes refuse to index catalogs with more records than that.
+ */
+struct row_list
+{
+    uint32_t *rows;
+    size_t size;
+    size_t capacity;
+};
+
+void row_list_init(struct row_list *list);
+void row_list_free(struct row_list *list);
+
+/*
+ * @returns false on error
+ */
+bool row_list_reserve(struct row_list *list, size_t capacity);
+
+/*
+ * @returns false on error
+ */
+bool row_list_push(struct row_list *list, uint32_t row);
+
+/*
+ * Inserts row in a sorted list, unless it is already present.
+ *
+ * @returns false on error
+ */
+bool row_list_insert_sorted(struct row_list *list, uint32_t row);
+
+/*
+ * Stores the sorted union of the sorted lists a and b in out, out may not be a or b.
+ *
+ * @returns false on error
+ */
+bool row_list_union(struct row_list *out, const struct row_list *a, const struct row_list *b);
+
+/*
+ * Keeps only the rows of the sorted list which are also in the sorted array other.
+ * Gallops through other, so this is fastest when list is the shorter of the two.
+ */
+void row_list_intersect(struct row_list *list, const uint32_t *other, size_t other_size);
+
+#endif
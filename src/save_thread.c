@@ -0,0 +1,374 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <safe_math.h>
+
+#include "save_thread.h"
+#include "snapshot.h"
+
+struct save_thread_amount
+{
+    size_t row;
+    char *amount;
+};
+
+static void lock(struct save_thread *saver)
+{
+#ifdef HAVE_THREADS_H
+    mtx_lock(&saver->lock);
+#else
+    (void) saver;
+#endif
+}
+
+static void unlock(struct save_thread *saver)
+{
+#ifdef HAVE_THREADS_H
+    mtx_unlock(&saver->lock);
+#else
+    (void) saver;
+#endif
+}
+
+static size_t saved_column_count(void *data, size_t row)
+{
+    struct save_thread *saver = data;
+    return saver->column_counts[row];
+}
+
+static const char *saved_cell(void *data, size_t row, size_t column)
+{
+    struct save_thread *saver = data;
+    const struct catalog *catalog = saver->catalog;
+    if(column == saver->amount_column)
+    {
+        if(saver->amounts[row] != NULL) return saver->amounts[row];
+    }
+    else
+    {
+        // Only the amount column changes while counting, the edits of other columns come from the snapshot.
+        char **edited = catalog->columns[column].edited;
+        if(edited != NULL && edited[row] != NULL) return edited[row];
+    }
+    return catalog_read_cell(&saver->reader, catalog, row, column);
+}
+
+/*
+ * Stores the edits in the snapshot after the CSV file has been saved over, so it belongs to the saved file identified by source.
+ * If this fails, the snapshot no longer matches the CSV file and is not used next time.
+ */
+static void update_snapshot(struct save_thread *saver, const struct snapshot_source *source)
+{
+    saver->snapshot_stale = false;
+    if(saver->snapshot_path == NULL) return;
+    struct snapshot_writer writer;
+    if(!snapshot_reopen(&writer, saver->snapshot_path)) return;
+    if(!catalog_save_edits_replacing(saver->catalog, &writer, saver->amount_column, saver->amounts)
+            || !snapshot_finish(&writer, source, saver->delim)) snapshot_discard(&writer);
+}
+
+/*
+ * Takes over the amounts in batch, and saves every amount which changed since the last save.
+ *
+ * @returns false on error
+ */
+static bool save(struct save_thread *saver, struct save_thread_amount *batch, size_t batch_size)
+{
+    for(size_t i = 0; i < batch_size; i++)
+    {
+        size_t row = batch[i].row;
+        free(saver->amounts[row]);
+        saver->amounts[row] = batch[i].amount;
+        if(saver->column_counts[row] <= saver->amount_column) saver->column_counts[row] = saver->amount_column + 1;
+        if(!row_list_insert_sorted(&saver->unsaved, (uint32_t) row)) saver->all_unsaved = true;
+    }
+    if(saver->unsaved.size == 0 && !saver->all_unsaved) return true;
+
+    struct saved_csv_records records;
+    records.size = saver->catalog->records_size;
+    records.column_count = saved_column_count;
+    records.cell = saved_cell;
+    records.data = saver;
+    bool saved = !saver->all_unsaved && saved_csv_update(&saver->saved, saver->path, saver->unsaved.rows, saver->unsaved.size, &records);
+    if(!saved)
+    {
+        if(!saved_csv_write(&saver->saved, saver->path, saver->header, &records, saver->amount_column, saver->delim, saver->quote)) return false;
+    }
+    saver->unsaved.size = 0;
+    saver->all_unsaved = false;
+    // A file overwritten in place would have to be read whole to hash it, which is left until the thread stops.
+    if(saver->saved.source_known) update_snapshot(saver, &saver->saved.source);
+    else saver->snapshot_stale = true;
+    return true;
+}
+
+/*
+ * Runs one requested save, called with the lock held.
+ */
+static void run_save(struct save_thread *saver)
+{
+    struct save_thread_amount *batch = saver->pending;
+    size_t batch_size = saver->pending_size;
+    saver->pending = NULL;
+    saver->pending_size = 0;
+    saver->pending_capacity = 0;
+    saver->requested = false;
+    saver->busy = true;
+    unlock(saver);
+
+    errno = 0;
+    bool saved = save(saver, batch, batch_size);
+    int error_number = errno;
+    free(batch);
+
+    lock(saver);
+    saver->busy = false;
+    saver->last_saved = saved;
+    if(!saved)
+    {
+        saver->failed = true;
+        saver->error_number = error_number;
+    }
+    // Counts appended to the journal during the save are not saved yet, the journal is cleared after the next save.
+    else if(saver->pending_size == 0 && saver->journal.stream != NULL)
+    {
+        count_journal_clear(&saver->journal);
+    }
+}
+
+#ifdef HAVE_THREADS_H
+static int save_thread_main(void *data)
+{
+    struct save_thread *saver = data;
+    lock(saver);
+    while(true)
+    {
+        while(!saver->requested && !saver->stopping) cnd_wait(&saver->wake, &saver->lock);
+        if(!saver->requested) break;
+        run_save(saver);
+        cnd_broadcast(&saver->idle);
+    }
+    unlock(saver);
+    return 0;
+}
+#endif
+
+/*
+ * Asks for a save of everything handed over, called with the lock held.
+ */
+static void request(struct save_thread *saver)
+{
+    saver->requested = true;
+#ifdef HAVE_THREADS_H
+    cnd_signal(&saver->wake);
+#else
+    run_save(saver);
+#endif
+}
+
+bool save_thread_start(struct save_thread *saver, const struct catalog *catalog, const struct record *header, const char *path,
+        const char *snapshot_path, size_t amount_column, unsigned char delim, unsigned char quote)
+{
+    saver->catalog = catalog;
+    saver->header = header;
+    saver->path = path;
+    saver->snapshot_path = snapshot_path;
+    saver->amount_column = amount_column;
+    saver->delim = delim;
+    saver->quote = quote;
+    saver->compact_events = 1;
+    saved_csv_init(&saver->saved);
+    row_list_init(&saver->unsaved);
+    saver->all_unsaved = false;
+    saver->snapshot_stale = false;
+    saver->journal.stream = NULL;
+    saver->journal.path = NULL;
+    saver->pending = NULL;
+    saver->pending_size = 0;
+    saver->pending_capacity = 0;
+    saver->requested = false;
+    saver->busy = false;
+    saver->stopping = false;
+    saver->last_saved = true;
+    saver->failed = false;
+    saver->error_number = 0;
+
+    size_t records_size = catalog->records_size;
+    size_t column_counts_size;
+    saver->amounts = NULL;
+    saver->column_counts = NULL;
+    if(!psnip_safe_mul(&column_counts_size, records_size == 0 ? 1 : records_size, sizeof(size_t))) goto error;
+    saver->amounts = calloc(records_size == 0 ? 1 : records_size, sizeof(char *));
+    saver->column_counts = malloc(column_counts_size);
+    if(saver->amounts == NULL || saver->column_counts == NULL) goto error;
+    memcpy(saver->column_counts, catalog->column_counts, records_size * sizeof(size_t));
+    // Amounts counted in an earlier session come from the snapshot.
+    char **edited = catalog->columns[amount_column].edited;
+    for(size_t row = 0; edited != NULL && row < records_size; row++)
+    {
+        if(edited[row] == NULL) continue;
+        size_t length = strlen(edited[row]);
+        saver->amounts[row] = malloc(length + 1);
+        if(saver->amounts[row] == NULL) goto error;
+        memcpy(saver->amounts[row], edited[row], length + 1);
+    }
+    if(!catalog_reader_init(&saver->reader, catalog)) goto error;
+
+#ifdef HAVE_THREADS_H
+    if(mtx_init(&saver->lock, mtx_plain) != thrd_success) goto reader_error;
+    if(cnd_init(&saver->wake) != thrd_success) { mtx_destroy(&saver->lock); goto reader_error; }
+    if(cnd_init(&saver->idle) != thrd_success) { cnd_destroy(&saver->wake); mtx_destroy(&saver->lock); goto reader_error; }
+    if(thrd_create(&saver->thread, save_thread_main, saver) != thrd_success)
+    {
+        cnd_destroy(&saver->idle);
+        cnd_destroy(&saver->wake);
+        mtx_destroy(&saver->lock);
+        goto reader_error;
+    }
+#endif
+    return true;
+
+#ifdef HAVE_THREADS_H
+    reader_error:
+    catalog_reader_free(&saver->reader);
+#endif
+    error:
+    for(size_t row = 0; saver->amounts != NULL && row < records_size; row++) free(saver->amounts[row]);
+    free(saver->amounts);
+    free(saver->column_counts);
+    saver->amounts = NULL;
+    saver->column_counts = NULL;
+    return false;
+}
+
+bool save_thread_open_journal(struct save_thread *saver, char *path, size_t sync_interval, size_t compact_events)
+{
+    lock(saver);
+    bool opened = count_journal_open(&saver->journal, path, sync_interval);
+    if(opened) saver->compact_events = compact_events;
+    unlock(saver);
+    return opened;
+}
+
+/*
+ * Adds a copy of amount to the amounts handed over, called with the lock held.
+ *
+ * @returns false on error
+ */
+static bool hand_over(struct save_thread *saver, size_t row, const char *amount)
+{
+    if(saver->pending_size == saver->pending_capacity)
+    {
+        size_t capacity;
+        if(saver->pending_capacity == 0) capacity = 16;
+        else if(!psnip_safe_mul(&capacity, saver->pending_capacity, 2)) return false;
+        size_t size;
+        if(!psnip_safe_mul(&size, capacity, sizeof(struct save_thread_amount))) return false;
+        struct save_thread_amount *tmp = realloc(saver->pending, size);
+        if(tmp == NULL) return false;
+        saver->pending = tmp;
+        saver->pending_capacity = capacity;
+    }
+    size_t length = strlen(amount);
+    char *copy = malloc(length + 1);
+    if(copy == NULL) return false;
+    memcpy(copy, amount, length + 1);
+    saver->pending[saver->pending_size].row = row;
+    saver->pending[saver->pending_size].amount = copy;
+    saver->pending_size++;
+    return true;
+}
+
+bool save_thread_count(struct save_thread *saver, size_t row, const char *barcode, const char *old_amount, const char *new_amount)
+{
+    lock(saver);
+    bool handed_over = hand_over(saver, row, new_amount);
+    // Without the journal every count is saved right away.
+    if(handed_over)
+    {
+        bool journaled = count_journal_append(&saver->journal, row, barcode, old_amount, new_amount);
+        if(!journaled || saver->journal.events >= saver->compact_events) request(saver);
+    }
+    unlock(saver);
+    return handed_over;
+}
+
+bool save_thread_restore(struct save_thread *saver, size_t row, const char *amount)
+{
+    lock(saver);
+    bool handed_over = hand_over(saver, row, amount);
+    unlock(saver);
+    return handed_over;
+}
+
+bool save_thread_flush(struct save_thread *saver)
+{
+    lock(saver);
+    request(saver);
+#ifdef HAVE_THREADS_H
+    while(saver->requested || saver->busy) cnd_wait(&saver->idle, &saver->lock);
+#endif
+    bool saved = saver->last_saved;
+    unlock(saver);
+    return saved;
+}
+
+bool save_thread_take_error(struct save_thread *saver, int *error_number)
+{
+    lock(saver);
+    bool failed = saver->failed;
+    if(failed) *error_number = saver->error_number;
+    saver->failed = false;
+    unlock(saver);
+    return failed;
+}
+
+bool save_thread_stop(struct save_thread *saver, int *error_number)
+{
+    bool saved = save_thread_flush(saver);
+    if(!saved) *error_number = saver->error_number;
+#ifdef HAVE_THREADS_H
+    lock(saver);
+    saver->stopping = true;
+    cnd_signal(&saver->wake);
+    unlock(saver);
+    thrd_join(saver->thread, NULL);
+    cnd_destroy(&saver->idle);
+    cnd_destroy(&saver->wake);
+    mtx_destroy(&saver->lock);
+#endif
+
+    // The file is read once here instead of after every save which overwrote it in place.
+    struct snapshot_source source;
+    if(saved && saver->snapshot_stale && saver->snapshot_path != NULL && snapshot_source_of_path(&source, saver->path)) update_snapshot(saver, &source);
+    if(saved) count_journal_remove(&saver->journal);
+    else count_journal_close(&saver->journal);
+    for(size_t i = 0; i < saver->pending_size; i++) free(saver->pending[i].amount);
+    free(saver->pending);
+    for(size_t row = 0; row < saver->catalog->records_size; row++) free(saver->amounts[row]);
+    free(saver->amounts);
+    free(saver->column_counts);
+    row_list_free(&saver->unsaved);
+    saved_csv_free(&saver->saved);
+    catalog_reader_free(&saver->reader);
+    return saved;
+}
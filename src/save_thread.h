@@ -0,0 +1,138 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VOORRAADTELLEN_SAVE_THREAD_H
+#define VOORRAADTELLEN_SAVE_THREAD_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef HAVE_THREADS_H
+    #include <threads.h>
+#endif
+
+#include "record.h"
+#include "catalog.h"
+#include "row_list.h"
+#include "saved_csv.h"
+#include "count_journal.h"
+
+/*
+ * Saves counted amounts to the CSV file on a thread of its own, so counting goes on while the file is written.
+ *
+ * Amounts are copied when they are handed over, and the saving thread keeps its own copy of the amount column.
+ * It reads the other columns from the catalog, which don't change while counting,
+ * and parses the records of a lazily loaded catalog with a reader of its own.
+ * Amounts handed over while a save is in progress are all saved by the next save.
+ * The count journal is only cleared once every amount handed over has been saved.
+ * Without C11 threads, saves happen right away on the calling thread.
+ */
+struct save_thread
+{
+    const struct catalog *catalog;
+    const struct record *header;
+    const char *path;
+    const char *snapshot_path;  // NULL if there is no snapshot belonging to the file at path.
+    size_t amount_column;
+    unsigned char delim;
+    unsigned char quote;
+    size_t compact_events;      // A save is started after this many counts in the journal.
+
+    // Only used by the saving thread.
+    struct saved_csv saved;
+    struct catalog_reader reader;
+    char **amounts;             // amounts[row] is the amount of record row if it changed since loading, NULL otherwise.
+    size_t *column_counts;
+    struct row_list unsaved;    // Records whose amount changed since the last save.
+    bool all_unsaved;           // Set if unsaved misses records, the whole file is written then.
+    bool snapshot_stale;        // Set if the file was overwritten in place since the snapshot was updated.
+
+    // Guarded by lock.
+    struct count_journal journal;
+    struct save_thread_amount *pending;  // Handed over since the last save started.
+    size_t pending_size;
+    size_t pending_capacity;
+    bool requested;
+    bool busy;
+    bool stopping;
+    bool last_saved;            // Whether the last save succeeded.
+    bool failed;                // Whether a save failed since save_thread_take_error was called last.
+    int error_number;
+#ifdef HAVE_THREADS_H
+    mtx_t lock;
+    cnd_t wake;     // Signalled when a save is requested, or the thread has to stop.
+    cnd_t idle;     // Signalled when a save has ended.
+    thrd_t thread;
+#endif
+};
+
+/*
+ * Starts saving the amounts in the amount column of the catalog to the file at path.
+ * The columns of the catalog may not be added to until the thread is stopped, the amount column has to be there already.
+ * The catalog, header and paths have to stay valid until the thread is stopped.
+ *
+ * @returns false on error
+ */
+bool save_thread_start(struct save_thread *saver, const struct catalog *catalog, const struct record *header, const char *path,
+        const char *snapshot_path, size_t amount_column, unsigned char delim, unsigned char quote);
+
+/*
+ * Opens the count journal at path, which is owned by saver after this.
+ * Once it is open, counts are appended to it and saves only start after compact_events counts.
+ *
+ * @returns false on error, every count starts a save then.
+ */
+bool save_thread_open_journal(struct save_thread *saver, char *path, size_t sync_interval, size_t compact_events);
+
+/*
+ * Hands over a new amount for record row, appending the count to the journal first.
+ *
+ * @returns false on error, the amount will not be saved then.
+ */
+bool save_thread_count(struct save_thread *saver, size_t row, const char *barcode, const char *old_amount, const char *new_amount);
+
+/*
+ * Hands over an amount replayed from the journal, without appending it to the journal again.
+ *
+ * @returns false on error, the amount will not be saved then.
+ */
+bool save_thread_restore(struct save_thread *saver, size_t row, const char *amount);
+
+/*
+ * Saves every amount handed over, and waits until they are saved.
+ *
+ * @returns false if saving failed
+ */
+bool save_thread_flush(struct save_thread *saver);
+
+/*
+ * Sets *error_number to the errno of a failed save, if a save failed since the last call.
+ *
+ * @returns whether a save failed
+ */
+bool save_thread_take_error(struct save_thread *saver, int *error_number);
+
+/*
+ * Saves every amount handed over, and stops the thread.
+ * The journal is removed if everything was saved, otherwise it is left for the next start.
+ *
+ * @returns false if saving failed, with *error_number set to its errno
+ */
+bool save_thread_stop(struct save_thread *saver, int *error_number);
+
+#endif
@@ -0,0 +1,363 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// fileno, fsync and open are not part of C11.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+#include <csv.h>
+#include <safe_math.h>
+
+#include "saved_csv.h"
+
+#ifdef __unix__
+    #include <unistd.h>
+    #ifdef _POSIX_VERSION
+        #define POSIX
+        #include <fcntl.h>
+    #endif
+#endif
+
+// The whole file is written to a file with this suffix next to it first, which then replaces it.
+#define SAVED_CSV_TEMP_SUFFIX ".tmp"
+// Records are collected in a buffer of this size, which is written to the file whenever it is full.
+#define SAVED_CSV_BUFFER_SIZE (1024 * 1024)
+
+// The file is written in binary mode so the offsets are exact, with the newlines of the platform.
+#ifdef _WIN32
+    #define SAVED_CSV_NEWLINE "\r\n"
+#else
+    #define SAVED_CSV_NEWLINE "\n"
+#endif
+
+void saved_csv_init(struct saved_csv *saved)
+{
+    saved->amount_offsets = NULL;
+    saved->rows = 0;
+    saved->amount_column = 0;
+    saved->amount_width = 0;
+    saved->file_size = 0;
+    saved->delim = CSV_COMMA;
+    saved->quote = CSV_QUOTE;
+    saved->valid = false;
+    saved->source_known = false;
+}
+
+void saved_csv_free(struct saved_csv *saved)
+{
+    free(saved->amount_offsets);
+    saved_csv_init(saved);
+}
+
+/*
+ * Closes f after making sure what was written to it is on disk, the count journal is cleared after saving.
+ *
+ * @returns false on error
+ */
+static bool sync_and_close(FILE *f)
+{
+    bool synced = fflush(f) == 0;
+#ifdef POSIX
+    synced = synced && fsync(fileno(f)) == 0;
+#endif
+    if(fclose(f) == EOF) synced = false;
+    return synced;
+}
+
+/*
+ * @returns the length of text as a field, which is only quoted if it needs to be
+ */
+static size_t field_length(const char *text, unsigned char delim, unsigned char quote)
+{
+    return csv_write_field(NULL, 0, text, strlen(text), delim, quote, CSV_QUOTE_MINIMAL);
+}
+
+/*
+ * Output collected in memory and written to the file in large blocks, instead of a character at a time.
+ */
+struct write_buffer
+{
+    FILE *f;
+    char *data;
+    size_t size;
+    size_t capacity;
+    size_t position;    // Offset in the file of the end of the buffered output.
+    struct snapshot_hasher hasher;  // Of everything written to the file.
+};
+
+static bool flush_buffer(struct write_buffer *buffer)
+{
+    if(buffer->size > 0 && fwrite(buffer->data, 1, buffer->size, buffer->f) != buffer->size) return false;
+    snapshot_hasher_update(&buffer->hasher, buffer->data, buffer->size);
+    buffer->size = 0;
+    return true;
+}
+
+/*
+ * Makes room for up to length more bytes, writing out what is buffered if they don't fit.
+ * The bytes are only added to the buffer by advance.
+ *
+ * @returns where the bytes go, or NULL on error
+ */
+static char *make_room(struct write_buffer *buffer, size_t length)
+{
+    if(buffer->capacity - buffer->size < length)
+    {
+        if(!flush_buffer(buffer)) return NULL;
+        // A field longer than the whole buffer gets a buffer of its own size.
+        if(length > buffer->capacity)
+        {
+            char *tmp = realloc(buffer->data, length);
+            if(tmp == NULL) return NULL;
+            buffer->data = tmp;
+            buffer->capacity = length;
+        }
+    }
+    return buffer->data + buffer->size;
+}
+
+static void advance(struct write_buffer *buffer, size_t length)
+{
+    buffer->size += length;
+    buffer->position += length;
+}
+
+/*
+ * Writes text as a field, which is only quoted if it needs to be.
+ *
+ * @returns false on error
+ */
+static bool write_field(struct write_buffer *buffer, const char *text, unsigned char delim, unsigned char quote)
+{
+    size_t text_length = strlen(text);
+    // Room for the field if every character is a quote, so it is written in one pass.
+    size_t max_length;
+    if(!psnip_safe_mul(&max_length, text_length, 2) || !psnip_safe_add(&max_length, max_length, 2)) return false;
+    char *dest = make_room(buffer, max_length);
+    if(dest == NULL) return false;
+    advance(buffer, csv_write_field(dest, max_length, text, text_length, delim, quote, CSV_QUOTE_MINIMAL));
+    return true;
+}
+
+static bool write_chars(struct write_buffer *buffer, char c, size_t count)
+{
+    char *dest = make_room(buffer, count);
+    if(dest == NULL) return false;
+    memset(dest, c, count);
+    advance(buffer, count);
+    return true;
+}
+
+static bool write_newline(struct write_buffer *buffer)
+{
+    char *dest = make_room(buffer, sizeof(SAVED_CSV_NEWLINE) - 1);
+    if(dest == NULL) return false;
+    memcpy(dest, SAVED_CSV_NEWLINE, sizeof(SAVED_CSV_NEWLINE) - 1);
+    advance(buffer, sizeof(SAVED_CSV_NEWLINE) - 1);
+    return true;
+}
+
+/*
+ * Makes sure the rename of the file at path is on disk, as far as the platform allows.
+ */
+static void sync_directory_of(const char *path)
+{
+#ifdef POSIX
+    const char *slash = strrchr(path, '/');
+    char *directory;
+    if(slash == NULL)
+    {
+        directory = malloc(2);
+        if(directory == NULL) return;
+        strcpy(directory, ".");
+    }
+    else
+    {
+        size_t length = slash == path ? 1 : (size_t) (slash - path);
+        directory = malloc(length + 1);
+        if(directory == NULL) return;
+        memcpy(directory, path, length);
+        directory[length] = '\0';
+    }
+    int fd = open(directory, O_RDONLY);
+    free(directory);
+    if(fd == -1) return;
+    fsync(fd);
+    close(fd);
+#else
+    (void) path;
+#endif
+}
+
+/*
+ * Replaces the file at path with the file at temp_path.
+ *
+ * @returns false on error
+ */
+static bool replace_file(const char *temp_path, const char *path)
+{
+#ifdef _WIN32
+    // rename doesn't replace an existing file here, so there is a moment without the file at path.
+    // The complete file at temp_path is left behind if renaming fails.
+    remove(path);
+#endif
+    if(rename(temp_path, path) != 0) return false;
+    sync_directory_of(path);
+    return true;
+}
+
+/*
+ * Writes the header and all records to buffer, and stores where the amount cells are in saved->amount_offsets.
+ *
+ * @returns false on error
+ */
+static bool write_records(struct saved_csv *saved, struct write_buffer *buffer, const struct record *header, const struct saved_csv_records *records,
+        size_t amount_column, size_t width, unsigned char delim, unsigned char quote)
+{
+    for(size_t i = 0; i < header->column_count; i++)
+    {
+        if(!write_field(buffer, header->columns[i], delim, quote)) return false;
+        if(i != header->column_count - 1 && !write_chars(buffer, (char) delim, 1)) return false;
+    }
+    if(!write_newline(buffer)) return false;
+
+    for(size_t i = 0; i < records->size; i++)
+    {
+        size_t column_count = records->column_count(records->data, i);
+        saved->amount_offsets[i] = SIZE_MAX;
+        for(size_t j = 0; j < column_count; j++)
+        {
+            const char *cell = records->cell(records->data, i, j);
+            if(j == amount_column)
+            {
+                saved->amount_offsets[i] = buffer->position;
+                if(!write_field(buffer, cell, delim, quote) || !write_chars(buffer, ' ', width - field_length(cell, delim, quote))) return false;
+            }
+            else if(!write_field(buffer, cell, delim, quote))
+            {
+                return false;
+            }
+            if(j != column_count - 1 && !write_chars(buffer, (char) delim, 1)) return false;
+        }
+        if(!write_newline(buffer)) return false;
+    }
+    return flush_buffer(buffer);
+}
+
+bool saved_csv_write(struct saved_csv *saved, const char *path, const struct record *header, const struct saved_csv_records *records,
+        size_t amount_column, unsigned char delim, unsigned char quote)
+{
+    saved->valid = false;
+    saved->source_known = false;
+    if(records->size > saved->rows || saved->amount_offsets == NULL)
+    {
+        size_t size;
+        if(!psnip_safe_mul(&size, records->size == 0 ? 1 : records->size, sizeof(size_t))) return false;
+        size_t *offsets = realloc(saved->amount_offsets, size);
+        if(offsets == NULL) return false;
+        saved->amount_offsets = offsets;
+    }
+
+    // Every amount cell gets the width of the longest one, so any amount up to that long fits later.
+    size_t width = SAVED_CSV_AMOUNT_MIN_WIDTH;
+    for(size_t i = 0; i < records->size; i++)
+    {
+        if(records->column_count(records->data, i) <= amount_column) continue;
+        size_t length = field_length(records->cell(records->data, i, amount_column), delim, quote);
+        if(length > width) width = length;
+    }
+
+    size_t path_length = strlen(path);
+    size_t temp_path_size;
+    if(!psnip_safe_add(&temp_path_size, path_length, sizeof(SAVED_CSV_TEMP_SUFFIX))) return false;
+    char *temp_path = malloc(temp_path_size);
+    if(temp_path == NULL) return false;
+    memcpy(temp_path, path, path_length);
+    memcpy(temp_path + path_length, SAVED_CSV_TEMP_SUFFIX, sizeof(SAVED_CSV_TEMP_SUFFIX));
+
+    // The file at path stays as it is until the new one is completely on disk, so a crash while saving never loses it.
+    struct write_buffer buffer;
+    buffer.size = 0;
+    buffer.capacity = SAVED_CSV_BUFFER_SIZE;
+    buffer.position = 0;
+    snapshot_hasher_init(&buffer.hasher);
+    buffer.data = malloc(buffer.capacity);
+    if(buffer.data == NULL) { free(temp_path); return false; }
+    buffer.f = fopen(temp_path, "wb");
+    if(buffer.f == NULL) { free(buffer.data); free(temp_path); return false; }
+    bool written = write_records(saved, &buffer, header, records, amount_column, width, delim, quote) && fflush(buffer.f) == 0;
+    // Renaming the file keeps its modification time, so it can be read before the file replaces the one at path.
+    struct snapshot_source source;
+    bool source_known = written && snapshot_source_of_written(&source, buffer.f, snapshot_hasher_final(&buffer.hasher));
+    free(buffer.data);
+    if(!sync_and_close(buffer.f)) written = false;
+    written = written && replace_file(temp_path, path);
+    if(!written) remove(temp_path);
+    free(temp_path);
+    if(!written) return false;
+
+    saved->rows = records->size;
+    saved->amount_column = amount_column;
+    saved->amount_width = width;
+    saved->file_size = buffer.position;
+    saved->delim = delim;
+    saved->quote = quote;
+    saved->valid = true;
+    saved->source = source;
+    saved->source_known = source_known;
+    return true;
+}
+
+bool saved_csv_update(struct saved_csv *saved, const char *path, const uint32_t *rows, size_t count, const struct saved_csv_records *records)
+{
+    if(!saved->valid || saved->file_size > LONG_MAX) return false;
+    if(count == 0) return true;
+    saved->source_known = false;
+    // Nothing is written unless every amount fits in its cell.
+    for(size_t i = 0; i < count; i++)
+    {
+        size_t row = rows[i];
+        if(row >= saved->rows || saved->amount_offsets[row] == SIZE_MAX) return false;
+        if(field_length(records->cell(records->data, row, saved->amount_column), saved->delim, saved->quote) > saved->amount_width) return false;
+    }
+
+    char *slot = malloc(saved->amount_width);
+    if(slot == NULL) return false;
+    FILE *f = fopen(path, "r+b");
+    if(f == NULL) { free(slot); return false; }
+    // Something else wrote the file if its size changed, the offsets can't be trusted anymore.
+    bool written = fseek(f, 0, SEEK_END) == 0 && ftell(f) == (long) saved->file_size;
+    for(size_t i = 0; written && i < count; i++)
+    {
+        const char *amount = records->cell(records->data, rows[i], saved->amount_column);
+        size_t length = field_length(amount, saved->delim, saved->quote);
+        csv_write_field(slot, length, amount, strlen(amount), saved->delim, saved->quote, CSV_QUOTE_MINIMAL);
+        memset(slot + length, ' ', saved->amount_width - length);
+        written = fseek(f, (long) saved->amount_offsets[rows[i]], SEEK_SET) == 0 && fwrite(slot, 1, saved->amount_width, f) == saved->amount_width;
+    }
+    if(!sync_and_close(f)) written = false;
+    free(slot);
+    // A partly overwritten cell or a file changed by something else is written again as a whole.
+    if(!written) saved->valid = false;
+    return written;
+}
@@ -0,0 +1,85 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VOORRAADTELLEN_SAVED_CSV_H
+#define VOORRAADTELLEN_SAVED_CSV_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "record.h"
+#include "snapshot.h"
+
+// Amount cells take at least this many bytes in the saved file, so most new amounts fit in place.
+#define SAVED_CSV_AMOUNT_MIN_WIDTH 10
+
+/*
+ * Where the amount cells are in the CSV file the catalog was saved to last,
+ * so saving a changed amount only has to overwrite its cell.
+ *
+ * Fields are only quoted if they need to be. Every amount cell is padded with spaces to the same width,
+ * which the parser skips. A new amount which doesn't fit means the whole file is written again.
+ */
+struct saved_csv
+{
+    size_t *amount_offsets; // amount_offsets[row] is where the amount cell of record row starts, SIZE_MAX if it has none.
+    size_t rows;
+    size_t amount_column;
+    size_t amount_width;
+    size_t file_size;       // The saved file is not overwritten in place if its size changed since.
+    unsigned char delim;
+    unsigned char quote;
+    bool valid;             // Whether the file at the path saved to last is laid out as described.
+    // Identifies the file saved_csv_write wrote, hashed while it was written so it never has to be read back.
+    struct snapshot_source source;
+    bool source_known;      // Cleared when cells are overwritten in place, the hash no longer matches then.
+};
+
+/*
+ * The records saved_csv_write writes, fetched through these functions while writing.
+ */
+struct saved_csv_records
+{
+    size_t size;
+    size_t (*column_count)(void *data, size_t row);
+    const char *(*cell)(void *data, size_t row, size_t column);
+    void *data;
+};
+
+void saved_csv_init(struct saved_csv *saved);
+void saved_csv_free(struct saved_csv *saved);
+
+/*
+ * Writes the header and all records to a new file next to the file at path, which then replaces it.
+ * If this fails, the file at path is left as it was.
+ *
+ * @returns false on error
+ */
+bool saved_csv_write(struct saved_csv *saved, const char *path, const struct record *header, const struct saved_csv_records *records,
+        size_t amount_column, unsigned char delim, unsigned char quote);
+
+/*
+ * Overwrites the amount cells of the count records in rows, which are sorted, in the file at path which saved_csv_write wrote last.
+ * The amounts are fetched through records. The file is opened and synced once for all of them.
+ *
+ * @returns false if the cells could not be overwritten, the whole file has to be written then.
+ */
+bool saved_csv_update(struct saved_csv *saved, const char *path, const uint32_t *rows, size_t count, const struct saved_csv_records *records);
+
+#endif
@@ -0,0 +1,334 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// fileno, fstat and fsync are not part of C11.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <limits.h>
+
+#include <safe_math.h>
+
+#include "snapshot.h"
+
+#ifdef __unix__
+    #include <unistd.h>
+    #ifdef _POSIX_VERSION
+        #define POSIX
+        #include <sys/types.h>
+        #include <sys/stat.h>
+    #endif
+#endif
+
+#define SNAPSHOT_MAGIC "VTSNAP\r\n"
+#define SNAPSHOT_VERSION 2
+// A snapshot is only read by a build which lays out its arrays the same way.
+#define SNAPSHOT_LAYOUT ((uint64_t) SNAPSHOT_VERSION << 8 | sizeof(size_t))
+#define SNAPSHOT_SUFFIX ".snapshot"
+
+struct snapshot_header
+{
+    char magic[8];
+    uint64_t layout;
+    uint64_t delim;
+    struct snapshot_source source;
+    uint64_t body_size;
+    uint64_t edits_size;
+    uint64_t edits_hash;
+    uint64_t check; // snapshot_hash of all fields above, so a torn header is never used.
+};
+
+static uint64_t hash_word(uint64_t state, const unsigned char *bytes)
+{
+    uint64_t word;
+    memcpy(&word, bytes, 8);
+    state = (state ^ word) * UINT64_C(0xFF51AFD7ED558CCD);
+    return state ^ state >> 32;
+}
+
+void snapshot_hasher_init(struct snapshot_hasher *hasher)
+{
+    hasher->state = UINT64_C(0x9E3779B97F4A7C15);
+    hasher->size = 0;
+}
+
+void snapshot_hasher_update(struct snapshot_hasher *hasher, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    size_t pending = (size_t) (hasher->size % 8);
+    hasher->size += size;
+    if(pending != 0)
+    {
+        size_t count = 8 - pending < size ? 8 - pending : size;
+        memcpy(hasher->tail + pending, bytes, count);
+        bytes += count;
+        size -= count;
+        if(pending + count < 8) return;
+        hasher->state = hash_word(hasher->state, hasher->tail);
+    }
+    for(; size >= 8; bytes += 8, size -= 8) hasher->state = hash_word(hasher->state, bytes);
+    memcpy(hasher->tail, bytes, size);
+}
+
+uint64_t snapshot_hasher_final(const struct snapshot_hasher *hasher)
+{
+    uint64_t hash = hasher->state;
+    for(size_t i = 0; i < hasher->size % 8; i++) hash = (hash ^ hasher->tail[i]) * UINT64_C(0x100000001B3);
+    hash = (hash ^ hasher->size) * UINT64_C(0xFF51AFD7ED558CCD);
+    return hash ^ hash >> 32;
+}
+
+uint64_t snapshot_hash(const void *data, size_t size)
+{
+    struct snapshot_hasher hasher;
+    snapshot_hasher_init(&hasher);
+    snapshot_hasher_update(&hasher, data, size);
+    return snapshot_hasher_final(&hasher);
+}
+
+bool snapshot_source_of_written(struct snapshot_source *source, FILE *stream, uint64_t hash)
+{
+#ifdef POSIX
+    int fd = fileno(stream);
+    if(fd == -1) return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < 0) return false;
+    source->size = (uint64_t) st.st_size;
+    source->mtime = (int64_t) st.st_mtime;
+    source->hash = hash;
+    return true;
+#else
+    (void) source;
+    (void) stream;
+    (void) hash;
+    return false;
+#endif
+}
+
+bool snapshot_source_of(struct snapshot_source *source, const struct mapped_file *file)
+{
+    if(!file->mapped) return false;
+    return snapshot_source_of_written(source, file->stream, snapshot_hash(file->data, file->size));
+}
+
+bool snapshot_source_of_path(struct snapshot_source *source, const char *path)
+{
+    FILE *stream = fopen(path, "rb");
+    if(stream == NULL) return false;
+    struct mapped_file file;
+    bool found = mapped_file_open(&file, stream) && snapshot_source_of(source, &file);
+    mapped_file_close(&file);
+    return found;
+}
+
+char *snapshot_path_of(const char *csv_path)
+{
+    size_t length = strlen(csv_path);
+    size_t size;
+    if(!psnip_safe_add(&size, length, sizeof(SNAPSHOT_SUFFIX))) return NULL;
+    char *path = malloc(size);
+    if(path == NULL) return NULL;
+    memcpy(path, csv_path, length);
+    memcpy(path + length, SNAPSHOT_SUFFIX, sizeof(SNAPSHOT_SUFFIX));
+    return path;
+}
+
+/*
+ * @returns false if header is not the intact header of a snapshot made by this build
+ */
+static bool header_valid(const struct snapshot_header *header)
+{
+    return memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 && header->layout == SNAPSHOT_LAYOUT
+        && header->check == snapshot_hash(header, offsetof(struct snapshot_header, check));
+}
+
+bool snapshot_open(struct snapshot *snapshot, const char *path, const struct snapshot_source *source, unsigned char delim)
+{
+    FILE *stream = fopen(path, "rb");
+    if(stream == NULL) return false;
+    if(!mapped_file_open(&snapshot->file, stream) || !snapshot->file.mapped) goto unusable;
+
+    struct snapshot_header header;
+    if(snapshot->file.size < sizeof(header)) goto unusable;
+    memcpy(&header, snapshot->file.data, sizeof(header));
+    if(!header_valid(&header) || header.delim != delim) goto unusable;
+    if(header.source.size != source->size || header.source.mtime != source->mtime || header.source.hash != source->hash) goto unusable;
+    size_t available = snapshot->file.size - sizeof(header);
+    if(header.body_size > available || header.edits_size > available - header.body_size) goto unusable;
+
+    // The indexes in the body are looked up in any order.
+    mapped_file_advise_random(&snapshot->file);
+    const unsigned char *data = (const unsigned char *) snapshot->file.data + sizeof(header);
+    if(snapshot_hash(data + header.body_size, (size_t) header.edits_size) != header.edits_hash) goto unusable;
+    snapshot->body.data = data;
+    snapshot->body.size = (size_t) header.body_size;
+    snapshot->body.position = 0;
+    snapshot->edits.data = data + header.body_size;
+    snapshot->edits.size = (size_t) header.edits_size;
+    snapshot->edits.position = 0;
+    return true;
+
+    unusable:
+    mapped_file_close(&snapshot->file);
+    return false;
+}
+
+void snapshot_close(struct snapshot *snapshot)
+{
+    mapped_file_close(&snapshot->file);
+}
+
+bool snapshot_create(struct snapshot_writer *writer, const char *path)
+{
+    writer->path = path;
+    writer->size = 0;
+    writer->body_size = 0;
+    snapshot_hasher_init(&writer->hasher);
+    // The old snapshot may still be mapped by snapshot_open, removing it gives the new one a file of its own instead of truncating it.
+    remove(path);
+    writer->stream = fopen(path, "wb");
+    if(writer->stream == NULL) return false;
+    // Until the real header is written, the snapshot is not valid.
+    struct snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    if(fwrite(&header, sizeof(header), 1, writer->stream) != 1) { snapshot_discard(writer); return false; }
+    return true;
+}
+
+void snapshot_begin_edits(struct snapshot_writer *writer)
+{
+    writer->body_size = writer->size;
+    snapshot_hasher_init(&writer->hasher);
+}
+
+bool snapshot_reopen(struct snapshot_writer *writer, const char *path)
+{
+    writer->path = path;
+    writer->stream = fopen(path, "r+b");
+    if(writer->stream == NULL) return false;
+    struct snapshot_header header;
+    if(fread(&header, sizeof(header), 1, writer->stream) != 1 || !header_valid(&header)) goto error;
+    if(header.body_size > LONG_MAX - sizeof(header)) goto error;
+    if(fseek(writer->stream, (long) (sizeof(header) + header.body_size), SEEK_SET) != 0) goto error;
+    writer->body_size = (size_t) header.body_size;
+    writer->size = writer->body_size;
+    snapshot_hasher_init(&writer->hasher);
+    return true;
+
+    error:
+    fclose(writer->stream);
+    writer->stream = NULL;
+    return false;
+}
+
+bool snapshot_finish(struct snapshot_writer *writer, const struct snapshot_source *source, unsigned char delim)
+{
+    struct snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.layout = SNAPSHOT_LAYOUT;
+    header.delim = delim;
+    header.source = *source;
+    header.body_size = writer->body_size;
+    header.edits_size = writer->size - writer->body_size;
+    header.edits_hash = snapshot_hasher_final(&writer->hasher);
+    header.check = snapshot_hash(&header, offsetof(struct snapshot_header, check));
+
+    // Everything else has to be on disk before the header makes it valid.
+    bool written = fflush(writer->stream) == 0;
+#ifdef POSIX
+    written = written && fsync(fileno(writer->stream)) == 0;
+#endif
+    written = written && fseek(writer->stream, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, writer->stream) == 1;
+    if(fclose(writer->stream) != 0) written = false;
+    writer->stream = NULL;
+    return written;
+}
+
+void snapshot_discard(struct snapshot_writer *writer)
+{
+    if(writer->stream != NULL) fclose(writer->stream);
+    writer->stream = NULL;
+    remove(writer->path);
+}
+
+bool snapshot_write(struct snapshot_writer *writer, const void *data, size_t size)
+{
+    if(size == 0) return true;
+    if(fwrite(data, 1, size, writer->stream) != size) return false;
+    snapshot_hasher_update(&writer->hasher, data, size);
+    writer->size += size;
+    return true;
+}
+
+bool snapshot_write_size(struct snapshot_writer *writer, size_t value)
+{
+    uint64_t stored = value;
+    return snapshot_write(writer, &stored, sizeof(stored));
+}
+
+bool snapshot_write_string(struct snapshot_writer *writer, const char *str)
+{
+    size_t length = strlen(str);
+    return snapshot_write_size(writer, length) && snapshot_write(writer, str, length);
+}
+
+bool snapshot_write_array(struct snapshot_writer *writer, const void *data, size_t size)
+{
+    static const unsigned char padding[SNAPSHOT_ARRAY_ALIGNMENT];
+    size_t misalignment = writer->size % SNAPSHOT_ARRAY_ALIGNMENT;
+    if(misalignment != 0 && !snapshot_write(writer, padding, SNAPSHOT_ARRAY_ALIGNMENT - misalignment)) return false;
+    return snapshot_write(writer, data, size);
+}
+
+bool snapshot_read(struct snapshot_reader *reader, void *data, size_t size)
+{
+    if(size > reader->size - reader->position) return false;
+    memcpy(data, reader->data + reader->position, size);
+    reader->position += size;
+    return true;
+}
+
+bool snapshot_read_size(struct snapshot_reader *reader, size_t *value)
+{
+    uint64_t stored;
+    if(!snapshot_read(reader, &stored, sizeof(stored)) || stored > SIZE_MAX) return false;
+    *value = (size_t) stored;
+    return true;
+}
+
+bool snapshot_read_string(struct snapshot_reader *reader, const char **str, size_t *length)
+{
+    if(!snapshot_read_size(reader, length) || *length > reader->size - reader->position) return false;
+    *str = (const char *) reader->data + reader->position;
+    reader->position += *length;
+    return true;
+}
+
+const void *snapshot_read_array(struct snapshot_reader *reader, size_t count, size_t element_size)
+{
+    size_t misalignment = reader->position % SNAPSHOT_ARRAY_ALIGNMENT;
+    size_t position = reader->position;
+    if(misalignment != 0 && !psnip_safe_add(&position, position, SNAPSHOT_ARRAY_ALIGNMENT - misalignment)) return NULL;
+    size_t size;
+    if(!psnip_safe_mul(&size, count, element_size) || position > reader->size || size > reader->size - position) return NULL;
+    reader->position = position + size;
+    return reader->data + position;
+}
@@ -0,0 +1,192 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VOORRAADTELLEN_SNAPSHOT_H
+#define VOORRAADTELLEN_SNAPSHOT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mapped_file.h"
+
+/*
+ * Binary snapshot of everything built from a CSV file, stored next to it,
+ * so the next start can skip parsing the file and building the indexes.
+ *
+ * A snapshot starts with a header naming the CSV file it was made from,
+ * followed by the body written when it was created and the edits written after every save.
+ * The header is written last, so an interrupted write leaves a snapshot which is never used.
+ * It holds a hash of the edits, which are rewritten after every save. The body is not checked when the snapshot is opened,
+ * its arrays are used right where they are in the mapping, so starting doesn't have to read all of it.
+ * Snapshots are only made on systems where files can be memory mapped.
+ */
+
+// Arrays in the body start at a multiple of this many bytes, so they can be used in place.
+#define SNAPSHOT_ARRAY_ALIGNMENT 8
+
+// Identifies the contents of a CSV file.
+struct snapshot_source
+{
+    uint64_t size;
+    int64_t mtime;
+    uint64_t hash;
+};
+
+// Computes snapshot_hash over data which arrives in pieces.
+struct snapshot_hasher
+{
+    uint64_t state;
+    uint64_t size;
+    unsigned char tail[8];  // The bytes of an unfinished word.
+};
+
+struct snapshot_writer
+{
+    FILE *stream;
+    const char *path;
+    size_t size;        // Bytes written after the header.
+    size_t body_size;   // Bytes of the body, the edits follow them.
+    struct snapshot_hasher hasher;  // Of the edits.
+};
+
+struct snapshot_reader
+{
+    const unsigned char *data;
+    size_t size;
+    size_t position;
+};
+
+struct snapshot
+{
+    struct mapped_file file;
+    struct snapshot_reader body;
+    struct snapshot_reader edits;
+};
+
+uint64_t snapshot_hash(const void *data, size_t size);
+void snapshot_hasher_init(struct snapshot_hasher *hasher);
+void snapshot_hasher_update(struct snapshot_hasher *hasher, const void *data, size_t size);
+uint64_t snapshot_hasher_final(const struct snapshot_hasher *hasher);
+
+/*
+ * Reads the size, modification time and hash of the file.
+ *
+ * @returns false on error, or if the file can't be memory mapped
+ */
+bool snapshot_source_of(struct snapshot_source *source, const struct mapped_file *file);
+
+/*
+ * Like snapshot_source_of, for the file behind stream which was just written, with hash as the snapshot_hash of everything written.
+ * Anything buffered in stream has to be flushed first.
+ *
+ * @returns false on error, or where snapshots aren't made
+ */
+bool snapshot_source_of_written(struct snapshot_source *source, FILE *stream, uint64_t hash);
+
+/*
+ * Like snapshot_source_of, for the file at path, which is read whole.
+ *
+ * @returns false on error
+ */
+bool snapshot_source_of_path(struct snapshot_source *source, const char *path);
+
+/*
+ * @returns the path of the snapshot belonging to csv_path, or NULL on error
+ */
+char *snapshot_path_of(const char *csv_path);
+
+/*
+ * Opens the snapshot at path, if it was made from source with the given delimiter.
+ * Its body and edits are read through snapshot->body and snapshot->edits.
+ * Arrays read from the body point into the snapshot, so it has to stay open as long as they are used.
+ *
+ * @returns false if there is no usable snapshot
+ */
+bool snapshot_open(struct snapshot *snapshot, const char *path, const struct snapshot_source *source, unsigned char delim);
+void snapshot_close(struct snapshot *snapshot);
+
+/*
+ * Starts a new snapshot at path, the body is written next.
+ * path has to stay valid until the snapshot is finished or discarded.
+ *
+ * @returns false on error
+ */
+bool snapshot_create(struct snapshot_writer *writer, const char *path);
+
+/*
+ * Ends the body of a new snapshot, the edits are written next.
+ */
+void snapshot_begin_edits(struct snapshot_writer *writer);
+
+/*
+ * Opens the existing snapshot at path to replace its edits, which are written next.
+ *
+ * @returns false on error
+ */
+bool snapshot_reopen(struct snapshot_writer *writer, const char *path);
+
+/*
+ * Writes the header, which makes the snapshot belong to source, and closes it.
+ *
+ * @returns false on error
+ */
+bool snapshot_finish(struct snapshot_writer *writer, const struct snapshot_source *source, unsigned char delim);
+
+/*
+ * Closes and removes an unfinished snapshot.
+ */
+void snapshot_discard(struct snapshot_writer *writer);
+
+/*
+ * @returns false on error
+ */
+bool snapshot_write(struct snapshot_writer *writer, const void *data, size_t size);
+bool snapshot_write_size(struct snapshot_writer *writer, size_t value);
+bool snapshot_write_string(struct snapshot_writer *writer, const char *str);
+
+/*
+ * Writes size bytes of an array, aligned to SNAPSHOT_ARRAY_ALIGNMENT so snapshot_read_array can use it in place.
+ *
+ * @returns false on error
+ */
+bool snapshot_write_array(struct snapshot_writer *writer, const void *data, size_t size);
+
+/*
+ * @returns false on error, or if the snapshot ends too soon
+ */
+bool snapshot_read(struct snapshot_reader *reader, void *data, size_t size);
+bool snapshot_read_size(struct snapshot_reader *reader, size_t *value);
+
+/*
+ * Sets *str to the next string, which is not '\0' terminated and stays valid until the snapshot is closed.
+ *
+ * @returns false on error, or if the snapshot ends too soon
+ */
+bool snapshot_read_string(struct snapshot_reader *reader, const char **str, size_t *length);
+
+/*
+ * Reads count elements of element_size bytes written by snapshot_write_array, without copying them.
+ * The array is read-only and stays valid until the snapshot is closed.
+ *
+ * @returns the array, never NULL if count is 0, or NULL on error
+ */
+const void *snapshot_read_array(struct snapshot_reader *reader, size_t count, size_t element_size);
+
+#endif
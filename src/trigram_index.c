@@ -0,0 +1,261 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <safe_math.h>
+
+#include "trigram_index.h"
+#include "folded_text.h"
+
+#define EMPTY_TRIGRAM UINT32_MAX
+
+struct trigram_index_slot
+{
+    uint32_t trigram; // EMPTY_TRIGRAM if this slot is empty.
+    uint32_t count;
+    size_t start; // Offset of this trigram's posting list in postings.
+};
+
+static size_t slot_of(uint32_t trigram, size_t mask)
+{
+    return (size_t) ((trigram * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & mask;
+}
+
+static size_t find_slot(const struct trigram_index_slot *slots, size_t capacity, uint32_t trigram)
+{
+    size_t mask = capacity - 1;
+    size_t slot = slot_of(trigram, mask);
+    while(slots[slot].trigram != trigram && slots[slot].trigram != EMPTY_TRIGRAM) slot = (slot + 1) & mask;
+    return slot;
+}
+
+/*
+ * Doubles the capacity of the hash table, last_rows is moved along with the slots.
+ *
+ * @returns false on error
+ */
+static bool grow(struct trigram_index_slot **slots, uint32_t **last_rows, size_t *capacity)
+{
+    size_t new_capacity;
+    if(!psnip_safe_mul(&new_capacity, *capacity, 2)) return false;
+    size_t size;
+    if(!psnip_safe_mul(&size, new_capacity, sizeof(struct trigram_index_slot))) return false;
+    struct trigram_index_slot *new_slots = malloc(size);
+    if(new_slots == NULL) return false;
+    if(!psnip_safe_mul(&size, new_capacity, sizeof(uint32_t))) { free(new_slots); return false; }
+    uint32_t *new_last_rows = malloc(size);
+    if(new_last_rows == NULL) { free(new_slots); return false; }
+    for(size_t i = 0; i < new_capacity; i++) new_slots[i].trigram = EMPTY_TRIGRAM;
+
+    for(size_t i = 0; i < *capacity; i++)
+    {
+        if((*slots)[i].trigram == EMPTY_TRIGRAM) continue;
+        size_t slot = find_slot(new_slots, new_capacity, (*slots)[i].trigram);
+        new_slots[slot] = (*slots)[i];
+        new_last_rows[slot] = (*last_rows)[i];
+    }
+    free(*slots);
+    free(*last_rows);
+    *slots = new_slots;
+    *last_rows = new_last_rows;
+    *capacity = new_capacity;
+    return true;
+}
+
+bool trigram_index_build(struct trigram_index *index, const struct catalog *catalog)
+{
+    size_t records_size = catalog->records_size;
+    index->slots = NULL;
+    index->capacity = 0;
+    index->postings = NULL;
+    index->borrowed = false;
+    if(records_size >= UINT32_MAX) return false;
+
+    size_t capacity = 4096;
+    size_t used = 0;
+    struct trigram_index_slot *slots = malloc(capacity * sizeof(struct trigram_index_slot));
+    uint32_t *last_rows = malloc(capacity * sizeof(uint32_t)); // Last record + 1 counted for a trigram, so every record is counted once.
+    if(slots == NULL || last_rows == NULL) { free(slots); free(last_rows); return false; }
+    for(size_t i = 0; i < capacity; i++) slots[i].trigram = EMPTY_TRIGRAM;
+
+    // First pass: find all trigrams and count the records containing each.
+    for(size_t row = 0; row < records_size; row++)
+    {
+        for(size_t column = 0; column < catalog_column_count(catalog, row); column++)
+        {
+            const unsigned char *str = (const unsigned char *) catalog_cell(catalog, row, column);
+            if(str[0] == '\0' || str[1] == '\0') continue;
+            uint32_t trigram = ((uint32_t) fold_char(str[0]) << 8) | fold_char(str[1]);
+            for(const unsigned char *c = str + 2; *c != '\0'; c++)
+            {
+                trigram = ((trigram << 8) | fold_char(*c)) & 0xFFFFFF;
+                size_t slot = find_slot(slots, capacity, trigram);
+                if(slots[slot].trigram == EMPTY_TRIGRAM)
+                {
+                    slots[slot].trigram = trigram;
+                    slots[slot].count = 0;
+                    last_rows[slot] = 0;
+                    used++;
+                }
+                if(last_rows[slot] != row + 1)
+                {
+                    last_rows[slot] = (uint32_t) row + 1;
+                    slots[slot].count++;
+                }
+                if(used > capacity / 2 && !grow(&slots, &last_rows, &capacity)) { free(slots); free(last_rows); return false; }
+            }
+        }
+    }
+
+    size_t postings_size = 0;
+    for(size_t i = 0; i < capacity; i++)
+    {
+        if(slots[i].trigram == EMPTY_TRIGRAM) continue;
+        slots[i].start = postings_size;
+        if(!psnip_safe_add(&postings_size, postings_size, slots[i].count)) { free(slots); free(last_rows); return false; }
+        slots[i].count = 0;
+        last_rows[i] = 0;
+    }
+    size_t size;
+    if(!psnip_safe_mul(&size, postings_size, sizeof(uint32_t))) { free(slots); free(last_rows); return false; }
+    uint32_t *postings = malloc(size == 0 ? 1 : size);
+    if(postings == NULL) { free(slots); free(last_rows); return false; }
+
+    // Second pass: fill the posting lists, records are visited in order so every list ends up sorted.
+    for(size_t row = 0; row < records_size; row++)
+    {
+        for(size_t column = 0; column < catalog_column_count(catalog, row); column++)
+        {
+            const unsigned char *str = (const unsigned char *) catalog_cell(catalog, row, column);
+            if(str[0] == '\0' || str[1] == '\0') continue;
+            uint32_t trigram = ((uint32_t) fold_char(str[0]) << 8) | fold_char(str[1]);
+            for(const unsigned char *c = str + 2; *c != '\0'; c++)
+            {
+                trigram = ((trigram << 8) | fold_char(*c)) & 0xFFFFFF;
+                size_t slot = find_slot(slots, capacity, trigram);
+                if(last_rows[slot] != row + 1)
+                {
+                    last_rows[slot] = (uint32_t) row + 1;
+                    postings[slots[slot].start + slots[slot].count++] = (uint32_t) row;
+                }
+            }
+        }
+    }
+    free(last_rows);
+
+    index->slots = slots;
+    index->capacity = capacity;
+    index->postings = postings;
+    return true;
+}
+
+static int compare_slot_counts(const void *a, const void *b)
+{
+    const struct trigram_index_slot *x = *(const struct trigram_index_slot * const *) a;
+    const struct trigram_index_slot *y = *(const struct trigram_index_slot * const *) b;
+    if(x->count != y->count) return (x->count < y->count) ? -1 : 1;
+    return 0;
+}
+
+bool trigram_index_candidates(const struct trigram_index *index, const char *query, struct row_list *candidates)
+{
+    candidates->size = 0;
+    size_t length = strlen(query);
+    if(length < TRIGRAM_INDEX_MIN_QUERY_LENGTH || index->capacity == 0) return false;
+
+    size_t lists_size = 0;
+    size_t size;
+    if(!psnip_safe_mul(&size, length - 2, sizeof(struct trigram_index_slot *))) return false;
+    const struct trigram_index_slot **lists = malloc(size);
+    if(lists == NULL) return false;
+
+    const unsigned char *str = (const unsigned char *) query;
+    uint32_t trigram = ((uint32_t) fold_char(str[0]) << 8) | fold_char(str[1]);
+    for(const unsigned char *c = str + 2; *c != '\0'; c++)
+    {
+        trigram = ((trigram << 8) | fold_char(*c)) & 0xFFFFFF;
+        const struct trigram_index_slot *slot = index->slots + find_slot(index->slots, index->capacity, trigram);
+        if(slot->trigram == EMPTY_TRIGRAM) { free(lists); return true; } // No record contains this trigram.
+        bool duplicate = false;
+        for(size_t i = 0; i < lists_size; i++) if(lists[i] == slot) duplicate = true;
+        if(!duplicate) lists[lists_size++] = slot;
+    }
+
+    // Intersect the shortest lists first, so the candidate list shrinks as fast as possible.
+    qsort(lists, lists_size, sizeof(const struct trigram_index_slot *), compare_slot_counts);
+    if(!row_list_reserve(candidates, lists[0]->count)) { free(lists); return false; }
+    memcpy(candidates->rows, index->postings + lists[0]->start, lists[0]->count * sizeof(uint32_t));
+    candidates->size = lists[0]->count;
+
+    for(size_t i = 1; i < lists_size && candidates->size > 0; i++)
+    {
+        row_list_intersect(candidates, index->postings + lists[i]->start, lists[i]->count);
+    }
+    free(lists);
+    return true;
+}
+
+bool trigram_index_save_snapshot(const struct trigram_index *index, struct snapshot_writer *writer)
+{
+    size_t postings_size = 0;
+    for(size_t i = 0; i < index->capacity; i++)
+    {
+        if(index->slots[i].trigram != EMPTY_TRIGRAM) postings_size += index->slots[i].count;
+    }
+    return snapshot_write_size(writer, index->capacity)
+        && snapshot_write_array(writer, index->slots, index->capacity * sizeof(struct trigram_index_slot))
+        && snapshot_write_size(writer, postings_size)
+        && snapshot_write_array(writer, index->postings, postings_size * sizeof(uint32_t));
+}
+
+bool trigram_index_load_snapshot(struct trigram_index *index, struct snapshot_reader *reader)
+{
+    index->slots = NULL;
+    index->capacity = 0;
+    index->postings = NULL;
+    index->borrowed = true;
+
+    size_t capacity, postings_size;
+    if(!snapshot_read_size(reader, &capacity) || capacity == 0 || (capacity & (capacity - 1)) != 0) return false;
+    index->slots = (struct trigram_index_slot *) snapshot_read_array(reader, capacity, sizeof(struct trigram_index_slot));
+    if(index->slots == NULL) return false;
+    index->capacity = capacity;
+    if(!snapshot_read_size(reader, &postings_size)) goto damaged;
+    index->postings = (uint32_t *) snapshot_read_array(reader, postings_size, sizeof(uint32_t));
+    if(index->postings == NULL) goto damaged;
+    return true;
+
+    damaged:
+    trigram_index_free(index);
+    return false;
+}
+
+void trigram_index_free(struct trigram_index *index)
+{
+    if(!index->borrowed)
+    {
+        free(index->slots);
+        free(index->postings);
+    }
+    index->borrowed = false;
+    index->slots = NULL;
+    index->capacity = 0;
+    index->postings = NULL;
+}
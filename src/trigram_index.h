@@ -0,0 +1,76 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VOORRAADTELLEN_TRIGRAM_INDEX_H
+#define VOORRAADTELLEN_TRIGRAM_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "catalog.h"
+#include "snapshot.h"
+#include "row_list.h"
+
+// Queries shorter than this can not use the trigram index.
+#define TRIGRAM_INDEX_MIN_QUERY_LENGTH 3
+
+/*
+ * Inverted index from every (case-insensitive) trigram in any column to the sorted
+ * list of records containing it. Trigrams never span two columns.
+ *
+ * A record containing all trigrams of a query is only a candidate,
+ * it still has to be checked against the query itself.
+ */
+struct trigram_index
+{
+    struct trigram_index_slot *slots;
+    size_t capacity; // Always a power of two.
+    uint32_t *postings; // All posting lists, back to back.
+    bool borrowed;      // The arrays point into a snapshot, they are not freed.
+};
+
+/*
+ * @returns false on error, or if there are too many records to index.
+ */
+bool trigram_index_build(struct trigram_index *index, const struct catalog *catalog);
+
+/*
+ * Stores the sorted list of candidate records for query in candidates.
+ * query must be at least TRIGRAM_INDEX_MIN_QUERY_LENGTH characters long.
+ *
+ * @returns false on error
+ */
+bool trigram_index_candidates(const struct trigram_index *index, const char *query, struct row_list *candidates);
+
+/*
+ * @returns false on error
+ */
+bool trigram_index_save_snapshot(const struct trigram_index *index, struct snapshot_writer *writer);
+
+/*
+ * Initializes index with the index written by trigram_index_save_snapshot.
+ * The index is used right where it is in the snapshot, which has to stay open until the index is freed.
+ *
+ * @returns false on error, or if the snapshot is damaged
+ */
+bool trigram_index_load_snapshot(struct trigram_index *index, struct snapshot_reader *reader);
+
+void trigram_index_free(struct trigram_index *index);
+
+#endif
@@ -0,0 +1,190 @@
+/*
+    Voorraad tellen.
+    Copyright (C) 2018-2020  Martijn Heil
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Writes records with csv_write_field and parses them back with csv_parse, for every delimiter the sniffer detects.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <csv.h>
+
+#define FIELDS_MAX 32
+#define FIELD_SIZE 64
+#define LINE_SIZE 4096
+
+// "%" is replaced by the delimiter.
+static const char *const templates[] =
+{
+    "plain",
+    "",
+    "a%b",
+    "%",
+    "ends with%",
+    "say \"hi\"",
+    "\"",
+    "line\nbreak",
+    "carriage\rreturn",
+    "crlf\r\n",
+    " leading space",
+    "trailing space ",
+    "\tleading tab",
+    "trailing tab\t",
+    "space inside",
+    "tab\tinside",
+    "all \"%\n\r of it ",
+};
+#define TEMPLATES_SIZE (sizeof(templates) / sizeof(templates[0]))
+
+struct parsed
+{
+    char fields[FIELDS_MAX][FIELD_SIZE];
+    size_t field_count;
+    size_t record_count;
+    bool overflow;
+};
+
+static void field_callback(void *data, size_t length, void *callback_data)
+{
+    struct parsed *parsed = callback_data;
+    if(parsed->field_count >= FIELDS_MAX || length >= FIELD_SIZE) { parsed->overflow = true; return; }
+    memcpy(parsed->fields[parsed->field_count], data, length);
+    parsed->fields[parsed->field_count][length] = '\0';
+    parsed->field_count++;
+}
+
+static void record_callback(int c, void *callback_data)
+{
+    (void) c;
+    struct parsed *parsed = callback_data;
+    parsed->record_count++;
+}
+
+static void fill_template(char *field, const char *template, unsigned char delim)
+{
+    for(; *template != '\0'; template++) *field++ = *template == '%' ? (char) delim : *template;
+    *field = '\0';
+}
+
+static const char *delimiter_name(unsigned char delim)
+{
+    switch(delim)
+    {
+        case CSV_COMMA: return "komma";
+        case CSV_SEMICOLON: return "puntkomma";
+        case CSV_TAB: return "tab";
+        default: return "?";
+    }
+}
+
+/*
+ * Writes one record of all templates, with padding spaces after every field like saved_csv does for amounts,
+ * and checks that parsing it gives the same fields back.
+ *
+ * @returns false if the test failed
+ */
+static bool round_trip(unsigned char delim, unsigned char options, size_t padding)
+{
+    char fields[TEMPLATES_SIZE][FIELD_SIZE];
+    char line[LINE_SIZE];
+    size_t length = 0;
+    for(size_t i = 0; i < TEMPLATES_SIZE; i++)
+    {
+        fill_template(fields[i], templates[i], delim);
+        size_t field_length = strlen(fields[i]);
+        size_t written = csv_write_field(line + length, LINE_SIZE - length, fields[i], field_length, delim, CSV_QUOTE, options);
+        // The length without a destination has to be the length written.
+        if(written != csv_write_field(NULL, 0, fields[i], field_length, delim, CSV_QUOTE, options) || length + written + padding + 2 > LINE_SIZE)
+        {
+            fprintf(stderr, "%s: lengte van veld %zu klopt niet\n", delimiter_name(delim), i);
+            return false;
+        }
+        length += written;
+        memset(line + length, ' ', padding);
+        length += padding;
+        line[length++] = i == TEMPLATES_SIZE - 1 ? '\n' : (char) delim;
+    }
+
+    struct csv_parser parser;
+    if(csv_init(&parser, 0) != 0) return false;
+    csv_set_delim(&parser, delim);
+    static struct parsed parsed;
+    memset(&parsed, 0, sizeof(parsed));
+    bool parsed_all = csv_parse(&parser, line, length, field_callback, record_callback, &parsed) == length
+        && csv_fini(&parser, field_callback, record_callback, &parsed) == 0;
+    csv_free(&parser);
+    if(!parsed_all || parsed.overflow || parsed.record_count != 1 || parsed.field_count != TEMPLATES_SIZE)
+    {
+        fprintf(stderr, "%s (opties %u, %zu spaties): %zu velden in %zu records gelezen in plaats van %zu in 1\n",
+                delimiter_name(delim), options, padding, parsed.field_count, parsed.record_count, TEMPLATES_SIZE);
+        return false;
+    }
+    bool equal = true;
+    for(size_t i = 0; i < TEMPLATES_SIZE; i++)
+    {
+        if(strcmp(parsed.fields[i], fields[i]) == 0) continue;
+        fprintf(stderr, "%s (opties %u, %zu spaties): veld %zu komt niet terug zoals het geschreven is\n", delimiter_name(delim), options, padding, i);
+        equal = false;
+    }
+    return equal;
+}
+
+/*
+ * Checks that csv_fwrite_field writes the same as csv_write_field.
+ *
+ * @returns false if the test failed
+ */
+static bool same_as_fwrite(unsigned char delim, unsigned char options)
+{
+    FILE *f = tmpfile();
+    if(f == NULL) return false;
+    char fields[TEMPLATES_SIZE][FIELD_SIZE];
+    char expected[LINE_SIZE];
+    size_t length = 0;
+    bool written = true;
+    for(size_t i = 0; written && i < TEMPLATES_SIZE; i++)
+    {
+        fill_template(fields[i], templates[i], delim);
+        size_t field_length = strlen(fields[i]);
+        length += csv_write_field(expected + length, LINE_SIZE - length, fields[i], field_length, delim, CSV_QUOTE, options);
+        written = csv_fwrite_field(f, fields[i], field_length, delim, CSV_QUOTE, options) == 0;
+    }
+    char actual[LINE_SIZE];
+    bool same = written && fseek(f, 0, SEEK_SET) == 0 && fread(actual, 1, LINE_SIZE, f) == length && memcmp(actual, expected, length) == 0;
+    fclose(f);
+    if(!same) fprintf(stderr, "%s (opties %u): csv_fwrite_field schrijft iets anders dan csv_write_field\n", delimiter_name(delim), options);
+    return same;
+}
+
+int main(void)
+{
+    const unsigned char delims[] = { CSV_COMMA, CSV_SEMICOLON, CSV_TAB };
+    const unsigned char options[] = { 0, CSV_QUOTE_MINIMAL };
+    bool passed = true;
+    for(size_t i = 0; i < sizeof(delims); i++)
+    {
+        for(size_t j = 0; j < sizeof(options); j++)
+        {
+            if(!round_trip(delims[i], options[j], 0)) passed = false;
+            if(!round_trip(delims[i], options[j], 3)) passed = false;
+            if(!same_as_fwrite(delims[i], options[j])) passed = false;
+        }
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}